@@ -0,0 +1,173 @@
+#include "log.h"
+#include "vospi.h"
+#include "unpack.h"
+#include "delta.h"
+#include "recording.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+// The number of frames to encode, unless given
+#define DEFAULT_FRAMES 300
+
+// How often to encode a keyframe, as leptonic does by default
+#define KEYFRAME_INTERVAL 30
+
+// The number of times to encode (and decode) every frame, to time them
+#define ITERATIONS 20
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Make up a Lepton 3.x scene: a gentle gradient with a warm object drifting across it, and a
+ * little noise on every pixel.
+ */
+static void synthesise_frame(uint16_t* pixels, int frame)
+{
+  int blob_x = 20 + frame % 120, blob_y = 60;
+
+  for (int y = 0; y < 120; y ++) {
+    for (int x = 0; x < 160; x ++) {
+      int dx = x - blob_x, dy = y - blob_y;
+      int value = 7800 + x * 2 + y;
+      if (dx * dx + dy * dy < 15 * 15) {
+        value += 600;
+      }
+      pixels[y * 160 + x] = value + rand() % 5 - 2;
+    }
+  }
+}
+
+/**
+ * Capture frames from a camera (or a recording of one), unpacking each.
+ * Returns the number of frames captured.
+ */
+static int capture_frames(const char* path, uint16_t* pixels, int count, const vospi_geometry_t** geometry)
+{
+  static vospi_device_t dev;
+  static vospi_frame_t frame;
+  uint16_t min, max;
+  int fd, captured = 0;
+
+  if ((fd = open(path, O_RDWR)) < 0 && (fd = open(path, O_RDONLY)) < 0) {
+    log_fatal("failed to open %s", path);
+    exit(-1);
+  }
+  if (vospi_init(&dev, fd, 20000000) == -1) {
+    log_fatal("SPI: failed to condition SPI device for VoSPI use.");
+    exit(-1);
+  }
+  if (dev.replay != NULL) {
+    dev.replay->paced = 0;
+  }
+  *geometry = dev.geometry;
+
+  if (!sync_and_transfer_frame(&dev, &frame)) {
+    log_fatal("failed to obtain frame from device.");
+    exit(-1);
+  }
+  do {
+    unpack_frame(&frame, dev.geometry, pixels + captured * dev.geometry->width * dev.geometry->height, &min, &max);
+    captured ++;
+  } while (captured < count && transfer_frame(&dev, &frame));
+
+  return captured;
+}
+
+/**
+ * Main entry point for example.
+ *
+ * This example delta-encodes a run of frames (captured from the device or recording given, or else
+ * made up), checks they decode to the originals and reports the compression ratio and the time
+ * taken to encode and decode each frame.
+ */
+int main(int argc, char *argv[])
+{
+  log_set_level(LOG_INFO);
+  int count = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : DEFAULT_FRAMES;
+  const vospi_geometry_t* geometry = &vospi_geometry_lepton3;
+  uint16_t* frames = malloc((size_t)count * UNPACK_MAX_PIXELS * sizeof(uint16_t));
+  static uint16_t previous[UNPACK_MAX_PIXELS], decoded[UNPACK_MAX_PIXELS], residuals[UNPACK_MAX_PIXELS];
+  uint8_t* encoded = malloc(DELTA_MAX_ENCODED_SIZE(160, 120));
+  size_t* sizes = malloc(count * sizeof(size_t));
+  uint8_t** encoded_frames = malloc(count * sizeof(uint8_t*));
+  delta_encoder_t encoder;
+  delta_decoder_t decoder;
+  uint64_t start_ns, encode_ns, decode_ns;
+
+  // Gather the frames
+  if (argc > 1) {
+    count = capture_frames(argv[1], frames, count, &geometry);
+  } else {
+    srand(1);
+    for (int i = 0; i < count; i ++) {
+      synthesise_frame(frames + i * UNPACK_MAX_PIXELS, i);
+    }
+  }
+  int pixel_count = geometry->width * geometry->height;
+
+  // Encode every frame in turn, keeping the encoded frames of the last pass to decode
+  start_ns = monotonic_ns();
+  for (int iteration = 0; iteration < ITERATIONS; iteration ++) {
+    delta_encoder_init(&encoder, geometry->width, geometry->height, KEYFRAME_INTERVAL, previous, residuals);
+    for (int i = 0; i < count; i ++) {
+      sizes[i] = delta_encode(&encoder, frames + i * pixel_count, i + 1, encoded);
+      __asm__ volatile("" : : "r"(encoded) : "memory");
+      if (iteration == ITERATIONS - 1) {
+        encoded_frames[i] = malloc(sizes[i]);
+        memcpy(encoded_frames[i], encoded, sizes[i]);
+      }
+    }
+  }
+  encode_ns = monotonic_ns() - start_ns;
+
+  // Decode them all again, checking they match
+  start_ns = monotonic_ns();
+  for (int iteration = 0; iteration < ITERATIONS; iteration ++) {
+    delta_decoder_init(&decoder, geometry->width, geometry->height, decoded, residuals);
+    for (int i = 0; i < count; i ++) {
+      if (delta_decode(&decoder, encoded_frames[i], sizes[i]) != 1 ||
+          memcmp(decoded, frames + i * pixel_count, pixel_count * sizeof(uint16_t)) != 0) {
+        log_error("frame %d didn't decode to the original", i + 1);
+        exit(-1);
+      }
+    }
+  }
+  decode_ns = monotonic_ns() - start_ns;
+
+  // Total up the sizes of each type of frame
+  size_t keyframe_bytes = 0, difference_bytes = 0;
+  for (int i = 0; i < count; i ++) {
+    if (((delta_header_t*)encoded_frames[i])->type == DELTA_KEYFRAME) {
+      keyframe_bytes += sizes[i];
+    } else {
+      difference_bytes += sizes[i];
+    }
+  }
+
+  log_info(
+    "%d %dx%d frames: %u keyframes (%zu bytes each), %u differences (%zu bytes each)",
+    count, geometry->width, geometry->height, encoder.keyframes, keyframe_bytes / encoder.keyframes,
+    encoder.differences, encoder.differences ? difference_bytes / encoder.differences : 0
+  );
+  log_info(
+    "compression: %.2fx (%zu bytes per frame, from %d)",
+    (double)encoder.bytes_in / encoder.bytes_out, (size_t)(encoder.bytes_out / count), pixel_count * 2
+  );
+  log_info(
+    "encode: %llu ns/frame, decode: %llu ns/frame",
+    (unsigned long long)(encode_ns / ITERATIONS / count), (unsigned long long)(decode_ns / ITERATIONS / count)
+  );
+  return 0;
+}
@@ -1,262 +0,0 @@
-#ifndef FALSE_COLOUR_H
-#define FALSE_COLOUR_H
-
-char fc_map[255][3] = {
-  {0,2,36},
-  {1,2,37},
-  {3,3,38},
-  {3,3,39},
-  {5,3,41},
-  {6,3,42},
-  {8,4,44},
-  {8,4,46},
-  {10,4,47},
-  {12,5,49},
-  {14,5,51},
-  {15,5,53},
-  {17,6,56},
-  {18,6,58},
-  {20,7,61},
-  {22,6,62},
-  {24,7,66},
-  {26,7,68},
-  {28,8,70},
-  {30,8,73},
-  {32,9,75},
-  {35,9,78},
-  {36,9,81},
-  {39,10,84},
-  {41,10,86},
-  {43,11,89},
-  {46,11,91},
-  {47,11,95},
-  {50,13,97},
-  {52,13,101},
-  {55,13,103},
-  {57,13,106},
-  {59,14,109},
-  {61,14,111},
-  {64,16,114},
-  {66,16,116},
-  {68,16,119},
-  {71,16,121},
-  {74,18,123},
-  {76,18,127},
-  {79,18,129},
-  {81,19,131},
-  {83,20,134},
-  {86,21,135},
-  {88,21,137},
-  {90,22,139},
-  {93,22,141},
-  {95,23,143},
-  {97,24,145},
-  {100,24,147},
-  {102,25,147},
-  {104,26,149},
-  {107,26,151},
-  {109,27,151},
-  {111,28,152},
-  {114,29,153},
-  {116,29,154},
-  {117,30,155},
-  {120,31,155},
-  {122,32,155},
-  {124,33,155},
-  {126,34,155},
-  {128,34,155},
-  {130,36,155},
-  {133,36,154},
-  {134,37,153},
-  {137,38,152},
-  {139,39,151},
-  {141,40,150},
-  {144,41,148},
-  {145,42,147},
-  {147,42,145},
-  {150,43,142},
-  {152,44,141},
-  {154,45,139},
-  {156,46,136},
-  {158,47,134},
-  {161,48,131},
-  {163,49,129},
-  {166,51,126},
-  {168,51,124},
-  {170,52,121},
-  {172,53,118},
-  {175,54,115},
-  {177,55,111},
-  {179,56,108},
-  {182,58,105},
-  {184,59,102},
-  {186,60,99},
-  {188,61,95},
-  {191,62,92},
-  {192,63,89},
-  {195,64,86},
-  {197,66,82},
-  {200,67,79},
-  {202,68,75},
-  {203,69,72},
-  {206,70,69},
-  {207,71,66},
-  {210,72,62},
-  {211,74,59},
-  {214,75,56},
-  {216,76,52},
-  {218,77,49},
-  {219,79,47},
-  {222,80,44},
-  {223,82,41},
-  {225,82,37},
-  {227,85,34},
-  {229,86,32},
-  {231,87,29},
-  {232,89,27},
-  {234,90,25},
-  {236,92,22},
-  {236,93,20},
-  {239,94,18},
-  {240,95,16},
-  {241,98,14},
-  {243,99,12},
-  {244,100,10},
-  {245,102,9},
-  {246,103,8},
-  {247,105,6},
-  {248,107,6},
-  {249,107,6},
-  {250,110,6},
-  {251,111,6},
-  {251,112,6},
-  {252,114,6},
-  {253,115,6},
-  {253,117,6},
-  {253,119,6},
-  {253,120,6},
-  {253,122,6},
-  {253,124,6},
-  {253,125,6},
-  {253,127,6},
-  {253,129,6},
-  {253,130,6},
-  {253,133,6},
-  {253,134,6},
-  {253,136,6},
-  {253,138,6},
-  {253,140,6},
-  {253,141,6},
-  {253,144,6},
-  {253,146,6},
-  {253,147,6},
-  {253,149,6},
-  {253,151,6},
-  {253,154,6},
-  {253,156,6},
-  {253,158,6},
-  {253,160,6},
-  {253,162,6},
-  {253,164,6},
-  {253,166,6},
-  {253,168,6},
-  {253,170,6},
-  {253,171,6},
-  {253,174,6},
-  {253,175,6},
-  {253,178,6},
-  {253,180,6},
-  {253,181,6},
-  {253,184,7},
-  {253,186,7},
-  {253,187,8},
-  {253,189,10},
-  {253,191,10},
-  {253,193,11},
-  {253,195,12},
-  {253,196,13},
-  {253,199,14},
-  {253,200,15},
-  {253,202,16},
-  {253,204,18},
-  {253,205,19},
-  {253,207,20},
-  {253,209,22},
-  {253,210,22},
-  {253,211,24},
-  {253,214,25},
-  {253,215,26},
-  {253,216,28},
-  {253,218,29},
-  {253,219,31},
-  {253,221,31},
-  {253,223,33},
-  {253,223,35},
-  {253,225,36},
-  {253,225,38},
-  {253,227,39},
-  {253,229,42},
-  {253,230,43},
-  {253,230,44},
-  {253,232,47},
-  {253,233,49},
-  {253,233,52},
-  {253,235,54},
-  {253,236,57},
-  {254,236,60},
-  {253,237,62},
-  {253,239,65},
-  {253,239,68},
-  {254,240,72},
-  {253,241,75},
-  {254,242,78},
-  {254,242,82},
-  {253,243,86},
-  {253,244,89},
-  {253,244,93},
-  {253,245,96},
-  {254,245,100},
-  {253,246,104},
-  {254,247,108},
-  {254,247,112},
-  {254,248,115},
-  {254,248,119},
-  {254,248,124},
-  {254,248,128},
-  {254,249,132},
-  {254,249,136},
-  {253,250,141},
-  {253,250,144},
-  {254,250,149},
-  {254,250,153},
-  {254,251,157},
-  {254,251,161},
-  {254,251,165},
-  {254,251,169},
-  {253,252,173},
-  {254,252,177},
-  {254,252,181},
-  {254,252,185},
-  {254,252,189},
-  {254,252,192},
-  {254,252,196},
-  {254,253,200},
-  {254,252,204},
-  {254,253,207},
-  {254,253,211},
-  {254,253,215},
-  {254,253,218},
-  {254,253,221},
-  {254,253,224},
-  {254,254,227},
-  {254,254,230},
-  {254,254,233},
-  {254,254,236},
-  {254,254,238},
-  {254,254,240},
-  {254,255,243},
-  {254,255,245},
-  {254,254,248}
-};
-
-#endif
@@ -1,40 +1,39 @@
 #include "log.h"
 #include "vospi.h"
-#include "falsecolour.h"
+#include "unpack.h"
+#include "render.h"
+#include "fanout.h"
+#include "arena.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <assert.h>
 #include <string.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
-/* The Lepton resolution */
-#define LEP_WIDTH 160
-#define LEP_HEIGHT 120
-
-/* Faux-AGC parameters */
-#define MIN_AGC_RANGE 200
-
 // The size of the circular frame buffer
 #define FRAME_BUF_SIZE 8
 
-// Positions of the reader and writer in the frame buffer
-int reader = 0, writer = 0;
+// The frame buffer, shared with the drawing thread
+fanout_t frames;
+fanout_consumer_t* draw_consumer;
+
+// The arena the frame slots and the pixel plane are allocated from at startup
+arena_t arena;
 
-// semaphore tracking the number of frames available
-sem_t count_sem;
+// The plane each frame's pixel values are unpacked into for drawing
+uint16_t* pix_values;
 
-// a lock protecting accesses to the frame buffer
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// The geometry of the camera's frames
+const vospi_geometry_t* geometry = &vospi_geometry_lepton3;
 
-// The frame buffer
-vospi_frame_t* frame_buf[FRAME_BUF_SIZE];
+// Renders frames in the framebuffer's pixel format (24-bit BGR)
+renderer_t renderer;
 
 /**
  * Read frames from the device into the circular buffer.
@@ -42,16 +41,11 @@ vospi_frame_t* frame_buf[FRAME_BUF_SIZE];
 void* get_frames_from_device(void* spidev_path_ptr)
 {
     char* spidev_path = (char*)spidev_path_ptr;
+    vospi_device_t dev;
     int spi_fd;
 
-    // Declare a static frame to use as a scratch space to avoid locking the framebuffer while
-    // we're waiting for a new frame
-    vospi_frame_t frame;
-
-    // Initialise the segments
-    for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-      frame.segments[seg].packet_count = VOSPI_PACKETS_PER_SEGMENT_NORMAL;
-    }
+    // Frames are received straight into a free slot that this thread owns until it's published
+    vospi_frame_t* frame = fanout_producer_slot(&frames);
 
     // Open the spidev device
     log_info("opening SPI device... %s", spidev_path);
@@ -61,17 +55,18 @@ void* get_frames_from_device(void* spidev_path_ptr)
     }
 
     // Initialise the VoSPI interface
-    if (vospi_init(spi_fd, 20000000) == -1) {
+    if (vospi_init(&dev, spi_fd, 20000000) == -1) {
         log_fatal("SPI: failed to condition SPI device for VoSPI use.");
         exit(-1);
     }
+    dev.geometry = geometry;
 
     // Synchronise, then receive frames forever
     do {
 
       log_info("aquiring VoSPI synchronisation");
 
-      if (0 == sync_and_transfer_frame(spi_fd, &frame)) {
+      if (0 == sync_and_transfer_frame(&dev, frame)) {
         log_error("failed to obtain frame from device.");
         exit(-10);
       }
@@ -80,25 +75,32 @@ void* get_frames_from_device(void* spidev_path_ptr)
 
       do {
 
-          if (!transfer_frame(spi_fd, &frame)) {
+          if (!transfer_frame(&dev, frame)) {
             break;
           }
 
-          pthread_mutex_lock(&lock);
+          // Hand the frame over and carry on with a free slot
+          frame = fanout_publish(&frames);
 
-          // Copy the newly-received frame into place
-          memcpy(frame_buf[writer], &frame, sizeof(vospi_frame_t));
+      } while (1); // While synchronised
+    } while (1);  // Forever
 
-          // Move the writer ahead
-          writer = (writer + 1) & (FRAME_BUF_SIZE - 1);
+}
 
-          // Unlock and post the space semaphore
-          pthread_mutex_unlock(&lock);
-          sem_post(&count_sem);
+/**
+ * Draw a frame to the framebuffer.
+ */
+void draw_frame(vospi_frame_t* frame, char* fb_ptr, long int line_length)
+{
+  // Produce a linear list of pixel values
+  uint16_t max, min;
+  unpack_frame(frame, geometry, pix_values, &min, &max);
 
-      } while (1); // While synchronised
-    } while (1);  // Forever
+  // Make sure our thread doesn't advance too fast to avoid blocking waiting for frames
+  usleep(1000);
 
+  // Scale the values onto the palette and draw them straight into the fb
+  render_frame(&renderer, pix_values, geometry->width, geometry->height, min, max, (uint8_t*)fb_ptr, line_length);
 }
 
 /**
@@ -134,8 +136,8 @@ void* draw_frames_to_fb(void* fb_dev_path_ptr)
 
     // Change variable info
     v_info.bits_per_pixel = 24;
-    v_info.xres = LEP_WIDTH;
-    v_info.yres = LEP_HEIGHT;
+    v_info.xres = geometry->width;
+    v_info.yres = geometry->height;
     if (ioctl(fb_fd, FBIOPUT_VSCREENINFO, &v_info)) {
       log_error("cannot write fb variable information.");
       return NULL;
@@ -169,78 +171,29 @@ void* draw_frames_to_fb(void* fb_dev_path_ptr)
       exit(1);
     }
 
-    // Declare a frame on the stack to copy data into and use to render from
-    vospi_frame_t next_frame;
+    // The slot holding the frame being drawn, read in place
+    vospi_frame_t* next_frame;
 
     while (1) {
 
-      // Wait if there are no new frames to transmit
-      sem_wait(&count_sem);
-
-      // Lock the data structure to prevent new frames being added while we're reading this one
-      pthread_mutex_lock(&lock);
-
-      // Copy the next frame out ready to transmit
-      memcpy(&next_frame, frame_buf[reader], sizeof(vospi_frame_t));
-
-      // Unlock data structure
-      pthread_mutex_unlock(&lock);
-
-      // Move the reader ahead
-      reader = (reader + 1) & (FRAME_BUF_SIZE - 1);
-
-      // Produce a linear list of pixel values
-      uint16_t pix_values[LEP_HEIGHT * LEP_WIDTH];
-      uint16_t offset = 0, max = 0, min = UINT16_MAX;
-      for (uint8_t seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-        for (uint8_t pkt = 0; pkt < VOSPI_PACKETS_PER_SEGMENT_NORMAL; pkt ++) {
-          for (uint8_t sym = 0; sym < VOSPI_PACKET_SYMBOLS; sym += 2) {
-            pix_values[offset] = next_frame.segments[seg].packets[pkt].symbols[sym] << 8 |
-              next_frame.segments[seg].packets[pkt].symbols[sym + 1];
-
-            if (pix_values[offset] > max) {
-              max = pix_values[offset];
-            }
-
-            if (pix_values[offset] < min) {
-              min = pix_values[offset];
-            }
+      // Take the newest frame, releasing the one we drew last time
+      next_frame = fanout_acquire(draw_consumer);
 
-            offset ++;
-          }
-        }
-      }
-
-      uint16_t range = max - min;
-
-      // Minimum range
-      if (range < MIN_AGC_RANGE) {
-        range = MIN_AGC_RANGE;
-      }
-
-      // Scale the values appropriately
-      for (uint16_t index = 0; index < LEP_HEIGHT * LEP_WIDTH; index ++) {
-        pix_values[index] = (uint16_t)(((double)pix_values[index] - min) / range * 254.0);
-      }
-
-      // Make sure our thread doesn't advance too fast to avoid blocking waiting for frames
-      usleep(1000);
-
-      // Draw the frame to the fb
-      uint16_t fb_offset = 0;
-      for (int line = 0; line < LEP_HEIGHT; line ++) {
-        for(int col = 0; col < LEP_WIDTH; col ++) {
-          fb_ptr[line_length * line + (col * 3)] = fc_map[pix_values[fb_offset]][2];
-          fb_ptr[line_length * line + (col * 3) + 1] = fc_map[pix_values[fb_offset]][1];
-          fb_ptr[line_length * line + (col * 3) + 2] = fc_map[pix_values[fb_offset]][0];
-          fb_offset ++;
-        }
-      }
+      // Draw it
+      draw_frame(next_frame, fb_ptr, line_length);
     }
 
     munmap(fb_ptr, screen_size);
 }
 
+/**
+ * Allocate a frame slot.
+ */
+void* allocate_slot()
+{
+  return arena_alloc(&arena, sizeof(vospi_frame_t));
+}
+
 /**
  * Main entry point for the Framebuffer example.
  */
@@ -251,23 +204,30 @@ int main(int argc, char *argv[])
   // Set the log level
   log_set_level(LOG_INFO);
 
-  // Setup semaphores
-  sem_init(&count_sem, 0, 0);
-
   // Check we have enough arguments to work
   if (argc < 2) {
     log_error("Can't start - SPI device file path must be specified.");
     exit(-1);
   }
 
+  // Optionally select the camera model
+  if (argc > 2 && (geometry = vospi_geometry_for_model(atoi(argv[2]))) == NULL) {
+    log_error("Can't start - unsupported Lepton version: %s", argv[2]);
+    exit(-1);
+  }
+
   // Allocate space to receive the segments in the circular buffer
   log_info("preallocating space for segments...");
-  for (int frame = 0; frame < FRAME_BUF_SIZE; frame ++) {
-    frame_buf[frame] = malloc(sizeof(vospi_frame_t));
-    for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-      frame_buf[frame]->segments[seg].packet_count = VOSPI_PACKETS_PER_SEGMENT_NORMAL;
-    }
+  if (arena_init(&arena, arena_size_for(sizeof(vospi_frame_t), FANOUT_SLOTS(FRAME_BUF_SIZE, 1, 0)) +
+      arena_size_for(UNPACK_MAX_PIXELS * sizeof(uint16_t), 1)) == -1) {
+    log_error("Can't start - failed to set up the arena");
+    exit(-1);
   }
+  pix_values = arena_alloc(&arena, UNPACK_MAX_PIXELS * sizeof(uint16_t));
+  fanout_init(&frames, FRAME_BUF_SIZE, 1, 0, allocate_slot);
+  arena_seal(&arena);
+  draw_consumer = fanout_add_consumer(&frames, FANOUT_LATEST);
+  render_init(&renderer, RENDER_BGR, RENDER_PALETTE_FUSION, RENDER_DEFAULT_MIN_RANGE);
 
   log_info("Creating get_frames_from_device_thread thread");
   if (pthread_create(&get_frames_thread, NULL, get_frames_from_device, argv[1])) {
@@ -0,0 +1,93 @@
+#include "log.h"
+#include "unpack.h"
+#include "render.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The number of times to render the frame each way, unless given
+#define DEFAULT_ITERATIONS 5000
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Render a frame to RGB the way the examples always have, with a divide per pixel.
+ */
+static void render_frame_by_hand(const renderer_t* renderer, const uint16_t* pixels, uint16_t min, uint16_t max,
+  uint8_t* out)
+{
+  uint16_t range = max - min;
+  if (range < renderer->min_range) {
+    range = renderer->min_range;
+  }
+
+  for (int index = 0; index < UNPACK_MAX_PIXELS; index ++) {
+    uint16_t value = (uint16_t)(((double)pixels[index] - min) / range * (RENDER_PALETTE_SIZE - 1));
+    out[index * 3] = renderer->colours[value][0];
+    out[index * 3 + 1] = renderer->colours[value][1];
+    out[index * 3 + 2] = renderer->colours[value][2];
+  }
+}
+
+/**
+ * Main entry point for example.
+ *
+ * This example renders a synthetic Lepton 3.x frame to RGB repeatedly, both by hand and with the
+ * library's renderer, checks they agree and reports the time each takes per frame.
+ */
+int main(int argc, char *argv[])
+{
+  log_set_level(LOG_INFO);
+  int iterations = argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  static uint16_t pixels[UNPACK_MAX_PIXELS];
+  static uint8_t expected[UNPACK_MAX_PIXELS * 3], rendered[UNPACK_MAX_PIXELS * 3];
+  uint16_t min = UINT16_MAX, max = 0;
+  uint64_t start_ns, by_hand_ns, library_ns;
+  renderer_t renderer;
+
+  // Fill the frame with 14-bit pixel values
+  srand(1);
+  for (int i = 0; i < UNPACK_MAX_PIXELS; i ++) {
+    pixels[i] = 7000 + rand() % 2000;
+    min = pixels[i] < min ? pixels[i] : min;
+    max = pixels[i] > max ? pixels[i] : max;
+  }
+  render_init(&renderer, RENDER_RGB, RENDER_PALETTE_FUSION, RENDER_DEFAULT_MIN_RANGE);
+
+  start_ns = monotonic_ns();
+  for (int i = 0; i < iterations; i ++) {
+    render_frame_by_hand(&renderer, pixels, min, max, expected);
+    __asm__ volatile("" : : "r"(expected) : "memory");
+  }
+  by_hand_ns = monotonic_ns() - start_ns;
+
+  start_ns = monotonic_ns();
+  for (int i = 0; i < iterations; i ++) {
+    render_frame(&renderer, pixels, 160, 120, min, max, rendered, 0);
+    __asm__ volatile("" : : "r"(rendered) : "memory");
+  }
+  library_ns = monotonic_ns() - start_ns;
+
+  if (memcmp(expected, rendered, sizeof(rendered)) != 0) {
+    log_error("rendered frames differ");
+    exit(-1);
+  }
+
+  log_info("by hand: %llu ns/frame", (unsigned long long)(by_hand_ns / iterations));
+  log_info(
+    "render_frame: %llu ns/frame, %.1fx faster",
+    (unsigned long long)(library_ns / iterations), (double)by_hand_ns / library_ns
+  );
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include "log.h"
+#include "shm.h"
+#include "metadata.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <time.h>
+
+// How long to wait for a frame before giving up
+#define READ_TIMEOUT_MS 5000
+
+/**
+ * Main entry point for example.
+ *
+ * This example follows the frames leptonic publishes to shared memory (with --shm), reading each
+ * one in place, and logs each frame's metadata and how long after its capture it was read.
+ */
+int main(int argc, char *argv[])
+{
+  log_set_level(LOG_INFO);
+  shm_reader_t reader;
+  const shm_slot_t* slot;
+  int count = argc > 2 ? atoi(argv[2]) : 0;
+  uint32_t torn = 0;
+
+  // Check we have enough arguments to work
+  if (argc < 2) {
+    log_error("Can't start - the shared-memory ring's name must be specified (I.e. /leptonic).");
+    exit(-1);
+  }
+  if (shm_reader_open(&reader, argv[1]) == -1) {
+    exit(-1);
+  }
+
+  // Read frames until asked to stop, or leptonic does
+  for (int frames = 0; count == 0 || frames < count; frames ++) {
+    if ((slot = shm_read(&reader, READ_TIMEOUT_MS)) == NULL) {
+      if (shm_reader_closed(&reader)) {
+        log_info("leptonic has stopped");
+      } else {
+        log_error("no frame within %d ms", READ_TIMEOUT_MS);
+      }
+      break;
+    }
+
+    // The pixels are read in place; copy out anything that's needed once the slot's checked
+    frame_metadata_t metadata;
+    memcpy(&metadata, slot->metadata, sizeof(metadata));
+    const uint16_t* pixels = (const uint16_t*)slot->payload;
+    uint16_t centre = pixels[le16toh(metadata.height) / 2 * le16toh(metadata.width) + le16toh(metadata.width) / 2];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!shm_read_intact(&reader, slot)) {
+      torn ++;
+      continue;
+    }
+
+    log_info(
+      "camera %u frame %u (%ux%u): min %u, max %u, mean %u, centre %u, ffc %u, read %.3f ms after capture",
+      metadata.camera, le32toh(metadata.frame_sequence), le16toh(metadata.width), le16toh(metadata.height),
+      le16toh(metadata.min), le16toh(metadata.max), le16toh(metadata.mean), centre, metadata.ffc_state,
+      ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - le64toh(metadata.timestamp_ns)) / 1e6
+    );
+  }
+
+  log_info("%u frames missed, %u overwritten while being read", reader.missed, torn);
+  shm_reader_close(&reader);
+  return 0;
+}
@@ -16,6 +16,7 @@
 int main(int argc, char *argv[])
 {
   log_set_level(LOG_INFO);
+  vospi_device_t dev;
   int spi_fd, i2c_fd;
 
   // Check we have enough arguments to work
@@ -41,7 +42,7 @@ int main(int argc, char *argv[])
   }
 
   // Initialise the VoSPI interface
-  if (vospi_init(spi_fd, 18000000) == -1) {
+  if (vospi_init(&dev, spi_fd, 18000000) == -1) {
       log_fatal("SPI: failed condition SPI device for VoSPI use.");
       exit(-1);
   }
@@ -60,23 +61,23 @@ int main(int argc, char *argv[])
   log_info("CCI telemetry enable state: %d", cci_get_telemetry_enable_state(i2c_fd));
   log_info("CCI telemetry location: %d", cci_get_telemetry_location(i2c_fd));
 
-  // Allocate space to receive the segments
-  log_debug("allocating space for segments...");
+  // Allocate space to receive the frame
   vospi_frame_t frame;
-  for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-    frame.segments[seg].packet_count = VOSPI_PACKETS_PER_SEGMENT_TELEMETRY;
-  }
 
   // Synchronise and transfer a single frame
   log_info("aquiring VoSPI synchronisation");
-  if (0 == sync_and_transfer_frame(spi_fd, &frame)) {
+  if (0 == sync_and_transfer_frame(&dev, &frame)) {
     log_error("failed to obtain frame from device.");
     exit(-10);
   }
   log_info("VoSPI stream synchronised");
 
-  // Parse the telemetry data
-  telemetry_data_t data = parse_telemetry_packet(&(frame.segments[0].packets[0]));
+  // Parse the telemetry data, which the VoSPI layer has moved out of the segments
+  if (frame.telemetry_packet_count == 0) {
+    log_error("no telemetry was received");
+    exit(-11);
+  }
+  telemetry_data_t data = parse_telemetry_packet(&frame.telemetry[0]);
 
   log_info("Telmetry data decoded:");
   log_info("Msec since boot: %02x", data.msec_since_boot);
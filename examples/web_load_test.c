@@ -0,0 +1,314 @@
+#include "log.h"
+#include "metadata.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+// The room each client has for what it's received and not yet parsed: a frame, and then some
+#define CLIENT_BUF_SIZE (128 * 1024)
+
+// The largest number of clients that can be simulated at once
+#define MAX_CLIENTS 1024
+
+// A simulated browser, following a stream of frames
+typedef struct {
+  int fd;
+  // Whether the response to the request has been received (and whether it was a WebSocket's)
+  int started;
+  int websocket;
+  uint8_t buf[CLIENT_BUF_SIZE];
+  size_t size;
+  uint32_t frames;
+  uint64_t bytes;
+  // The time from capture to receipt of the frames received over a WebSocket (from their metadata)
+  double latency_sum_ms;
+  double latency_max_ms;
+} client_t;
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Get the CPU time a process has used so far, in seconds, from /proc.
+ * Returns the CPU time, or -1 if it can't be read.
+ */
+static double process_cpu_seconds(int pid)
+{
+  char path[64], stat[1024];
+  unsigned long utime, stime;
+  FILE* file;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((file = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  size_t size = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[size] = '\0';
+
+  // The command name may contain spaces, so the fields are counted from the end of it
+  char* fields = strrchr(stat, ')');
+  if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+    return -1;
+  }
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Connect a client to the server and send its request, for a WebSocket if the path is a WebSocket
+ * stream's (I.e. /stream/0), or else a plain GET (I.e. for /mjpeg/0).
+ * Returns 1 on success or -1 on failure.
+ */
+static int connect_client(client_t* client, struct addrinfo* address, const char* host, const char* path)
+{
+  char request[512];
+  int length;
+
+  if ((client->fd = socket(address->ai_family, SOCK_STREAM, 0)) == -1 ||
+      connect(client->fd, address->ai_addr, address->ai_addrlen) == -1) {
+    log_error("failed to connect - %s", strerror(errno));
+    return -1;
+  }
+
+  client->websocket = strncmp(path, "/stream/", 8) == 0;
+  if (client->websocket) {
+    length = snprintf(
+      request, sizeof(request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+      path, host
+    );
+  } else {
+    length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+  }
+  if (send(client->fd, request, length, 0) != length) {
+    log_error("failed to send request - %s", strerror(errno));
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * Parse whatever whole frames a client has received: WebSocket messages, or the parts of an MJPEG
+ * stream, counting them.
+ * Returns 1 on success, or -1 if the server responded with anything unexpected.
+ */
+static int parse_frames(client_t* client)
+{
+  uint8_t* end;
+  size_t used = 0;
+
+  // The response comes first
+  if (!client->started) {
+    client->buf[client->size < CLIENT_BUF_SIZE ? client->size : CLIENT_BUF_SIZE - 1] = '\0';
+    if ((end = (uint8_t*)strstr((char*)client->buf, "\r\n\r\n")) == NULL) {
+      return 1;
+    }
+    if (strncmp((char*)client->buf, client->websocket ? "HTTP/1.1 101" : "HTTP/1.1 200", 12) != 0) {
+      log_error("unexpected response: %.*s", (int)strcspn((char*)client->buf, "\r\n"), client->buf);
+      return -1;
+    }
+    client->started = 1;
+    used = end + 4 - client->buf;
+  }
+
+  while (used < client->size) {
+    uint8_t* data = client->buf + used;
+    size_t available = client->size - used, header_size, length;
+
+    if (client->websocket) {
+      // Frames from the server are never masked
+      if (available < 2) {
+        break;
+      }
+      length = data[1] & 0x7f;
+      header_size = 2;
+      if (length == 126) {
+        if (available < 4) {
+          break;
+        }
+        length = data[2] << 8 | data[3];
+        header_size = 4;
+      } else if (length == 127) {
+        if (available < 10) {
+          break;
+        }
+        length = 0;
+        for (int i = 0; i < 8; i ++) {
+          length = length << 8 | data[2 + i];
+        }
+        header_size = 10;
+      }
+      if (header_size + length > CLIENT_BUF_SIZE) {
+        log_error("frame of %zu bytes is too large", length);
+        return -1;
+      }
+      if (available < header_size + length) {
+        break;
+      }
+
+      // Each message starts with the frame's metadata, which gives when it was captured
+      if (length >= sizeof(frame_metadata_t)) {
+        frame_metadata_t metadata;
+        memcpy(&metadata, data + header_size, sizeof(metadata));
+        double latency_ms = (monotonic_ns() - le64toh(metadata.timestamp_ns)) / 1e6;
+        client->latency_sum_ms += latency_ms;
+        client->latency_max_ms = latency_ms > client->latency_max_ms ? latency_ms : client->latency_max_ms;
+      }
+    } else {
+      // Each part has headers giving the length of the JPEG that follows, then a CRLF
+      char headers[256];
+      size_t headers_size = available < sizeof(headers) - 1 ? available : sizeof(headers) - 1;
+      memcpy(headers, data, headers_size);
+      headers[headers_size] = '\0';
+      char* headers_end = strstr(headers, "\r\n\r\n");
+      char* content_length = strstr(headers, "Content-Length: ");
+      if (headers_end == NULL || content_length == NULL) {
+        break;
+      }
+      header_size = headers_end + 4 - headers;
+      length = strtoul(content_length + 16, NULL, 10) + 2;
+      if (header_size + length > CLIENT_BUF_SIZE) {
+        log_error("JPEG of %zu bytes is too large", length);
+        return -1;
+      }
+      if (available < header_size + length) {
+        break;
+      }
+    }
+
+    client->frames ++;
+    client->bytes += length;
+    used += header_size + length;
+  }
+
+  client->size -= used;
+  memmove(client->buf, client->buf + used, client->size);
+  return 1;
+}
+
+/**
+ * Main entry point for example.
+ *
+ * This example simulates browsers following a stream of frames from leptonic's HTTP server
+ * (--http), over WebSockets (/stream/<camera>) or as MJPEG (/mjpeg/<camera>), for a number of
+ * seconds. It reports the rate each client received frames at, how long after capture they
+ * arrived and, given leptonic's pid, how much CPU leptonic used to serve them.
+ */
+int main(int argc, char *argv[])
+{
+  log_set_level(LOG_INFO);
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *address;
+  struct epoll_event events[64];
+  int client_count, seconds, pid, epoll_fd, connected = 0;
+  double cpu_start = -1, cpu_end = -1;
+
+  // Check we have enough arguments to work
+  if (argc < 6) {
+    log_error("Usage: %s <host> <port> <path> <clients> <seconds> [leptonic pid]", argv[0]);
+    exit(-1);
+  }
+  client_count = atoi(argv[4]);
+  seconds = atoi(argv[5]);
+  pid = argc > 6 ? atoi(argv[6]) : 0;
+  if (client_count < 1 || client_count > MAX_CLIENTS || seconds < 1) {
+    log_error("Can't start - there must be 1 to %d clients, for at least a second", MAX_CLIENTS);
+    exit(-1);
+  }
+  if (getaddrinfo(argv[1], argv[2], &hints, &address) != 0) {
+    log_error("Can't start - can't resolve %s", argv[1]);
+    exit(-1);
+  }
+
+  client_t* clients = calloc(client_count, sizeof(client_t));
+  if (clients == NULL || (epoll_fd = epoll_create1(0)) == -1) {
+    log_error("Can't start - out of memory");
+    exit(-1);
+  }
+
+  // Connect every client before timing anything
+  for (int i = 0; i < client_count; i ++) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = i };
+    if (connect_client(&clients[i], address, argv[1], argv[3]) == -1) {
+      break;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].fd, &event);
+    connected ++;
+  }
+  freeaddrinfo(address);
+  log_info("%d of %d clients connected to %s:%s%s", connected, client_count, argv[1], argv[2], argv[3]);
+
+  // Receive for as long as asked, each client reading everything it's sent as soon as it's sent
+  if (pid > 0) {
+    cpu_start = process_cpu_seconds(pid);
+  }
+  uint64_t start_ns = monotonic_ns(), end_ns = start_ns + (uint64_t)seconds * 1000000000;
+  int open_clients = connected;
+  while (open_clients > 0 && monotonic_ns() < end_ns) {
+    int count = epoll_wait(epoll_fd, events, 64, 100);
+    for (int e = 0; e < count; e ++) {
+      client_t* client = &clients[events[e].data.u32];
+      ssize_t size = recv(client->fd, client->buf + client->size, CLIENT_BUF_SIZE - 1 - client->size, 0);
+      if (size > 0) {
+        client->size += size;
+      } else if (size == 0) {
+        log_warn("client %u was disconnected (or turned away)", events[e].data.u32);
+      }
+      if (size <= 0 || parse_frames(client) == -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        close(client->fd);
+        client->fd = -1;
+        open_clients --;
+      }
+    }
+  }
+  double elapsed = (monotonic_ns() - start_ns) / 1e9;
+  if (pid > 0) {
+    cpu_end = process_cpu_seconds(pid);
+  }
+
+  // Summarise what the clients received
+  double min_fps = -1, max_fps = 0, total_frames = 0, total_bytes = 0, latency_sum_ms = 0, latency_max_ms = 0;
+  for (int i = 0; i < connected; i ++) {
+    double fps = clients[i].frames / elapsed;
+    min_fps = min_fps < 0 || fps < min_fps ? fps : min_fps;
+    max_fps = fps > max_fps ? fps : max_fps;
+    total_frames += clients[i].frames;
+    total_bytes += clients[i].bytes;
+    latency_sum_ms += clients[i].latency_sum_ms;
+    latency_max_ms = clients[i].latency_max_ms > latency_max_ms ? clients[i].latency_max_ms : latency_max_ms;
+    if (clients[i].fd >= 0) {
+      close(clients[i].fd);
+    }
+  }
+  if (connected > 0) {
+    log_info(
+      "%d clients over %.1f s: %.1f/%.1f/%.1f fps (min/mean/max), %.1f KiB/s in all",
+      connected, elapsed, min_fps, total_frames / connected / elapsed, max_fps, total_bytes / elapsed / 1024
+    );
+  }
+  if (total_frames > 0 && latency_sum_ms > 0) {
+    log_info("%.1f ms mean, %.1f ms max from capture to receipt", latency_sum_ms / total_frames, latency_max_ms);
+  }
+  if (cpu_start >= 0 && cpu_end >= 0) {
+    log_info("leptonic used %.1f%% of a CPU", (cpu_end - cpu_start) / elapsed * 100);
+  }
+
+  free(clients);
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Decodes frames delta-encoded by leptonic (see include/api/delta.h & src/api/delta.c).
+// Works in the browser (as DeltaDecoder) and in Node (as the module's export).
+(function (root) {
+
+  var HEADER_SIZE = 16;
+  var VERSION = 1;
+  var KEYFRAME = 0;
+
+  function DeltaDecoder() {
+    this.width = 0;
+    this.height = 0;
+    // The frame decoded last, and its sequence number
+    this.pixels = null;
+    this.sequence = 0;
+    this.hasFrame = false;
+    this.residuals = null;
+  }
+
+  // Map a zigzagged residual back to the (wrapping) difference
+  function unzigzag(residual) {
+    return (residual >>> 1) ^ -(residual & 1);
+  }
+
+  // Decode the residuals coded in data (after the header), which must fill residuals exactly
+  function decodeResiduals(data, residuals) {
+    var count = residuals.length, i = 0, pos = HEADER_SIZE, token, run;
+
+    while (pos < data.length && i < count) {
+      token = data[pos ++];
+      if (token == 0xff) {
+        if (pos + 2 > data.length) return false;
+        residuals[i ++] = data[pos] | data[pos + 1] << 8;
+        pos += 2;
+      } else if (token >= 0xc0) {
+        if (token >= 0xe0) {
+          if (pos == data.length) return false;
+          run = 34 + ((token & 0x1f) << 8 | data[pos ++]);
+        } else {
+          run = 2 + (token & 0x1f);
+        }
+        if (i + run > count) return false;
+        residuals.fill(0, i, i + run);
+        i += run;
+      } else if (token >= 0x80) {
+        if (i + 2 > count) return false;
+        residuals[i ++] = token >> 3 & 7;
+        residuals[i ++] = token & 7;
+      } else if (token >= 0x40) {
+        if (pos == data.length) return false;
+        residuals[i ++] = 64 + ((token & 0x3f) << 8 | data[pos ++]);
+      } else {
+        residuals[i ++] = token;
+      }
+    }
+
+    return i == count && pos == data.length;
+  }
+
+  // Decode an encoded frame (a Uint8Array) into this.pixels (a Uint16Array).
+  // Returns true on success, or false if the frame is a difference from a frame other than the one
+  // decoded last, in which case a keyframe is needed. Throws if the frame is malformed.
+  DeltaDecoder.prototype.decode = function (data) {
+    var view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+    if (data.length < HEADER_SIZE || data[0] != VERSION) {
+      throw new Error('unsupported delta-encoded frame');
+    }
+
+    var keyframe = data[1] == KEYFRAME;
+    var width = view.getUint16(2, true), height = view.getUint16(4, true);
+    var sequence = view.getUint32(8, true), baseSequence = view.getUint32(12, true);
+
+    if (width != this.width || height != this.height) {
+      if (!keyframe) return false;
+      this.width = width;
+      this.height = height;
+      this.pixels = new Uint16Array(width * height);
+      this.residuals = new Uint16Array(width * height);
+      this.hasFrame = false;
+    }
+    if (!keyframe && (!this.hasFrame || baseSequence != this.sequence)) {
+      return false;
+    }
+
+    var residuals = this.residuals, pixels = this.pixels;
+    if (!decodeResiduals(data, residuals)) {
+      throw new Error('malformed delta-encoded frame ' + sequence);
+    }
+
+    // Apply the residuals: to the frame decoded last, or along each row of a keyframe
+    if (keyframe) {
+      for (var row = 0; row < height; row ++) {
+        var start = row * width;
+        pixels[start] = (row > 0 ? pixels[start - width] : 0) + unzigzag(residuals[start]);
+        for (var x = 1; x < width; x ++) {
+          pixels[start + x] = pixels[start + x - 1] + unzigzag(residuals[start + x]);
+        }
+      }
+    } else {
+      for (var i = 0; i < pixels.length; i ++) {
+        pixels[i] += unzigzag(residuals[i]);
+      }
+    }
+
+    this.sequence = sequence;
+    this.hasFrame = true;
+    return true;
+  };
+
+  if (typeof module !== 'undefined' && module.exports) {
+    module.exports = DeltaDecoder;
+  } else {
+    root.DeltaDecoder = DeltaDecoder;
+  }
+
+})(this);
@@ -1,24 +1,57 @@
 (function($) {
   $(function () {
 
-      var socket = io();
       var canvas = document.getElementById('canvas');
       var ctx = canvas.getContext('2d');
       ctx.fillRect(0, 0, canvas.width, canvas.height);
       var imageData = ctx.getImageData(0, 0, canvas.width, canvas.height);
+      var decoder = new DeltaDecoder();
+      var awaitingKeyframe = false;
 
-      socket.on('frame', function (msg) {
+      // Frames come over socket.io when the page is served by the Node bridge (index.js), or
+      // straight from leptonic's own server (--http) over a WebSocket, each message holding the
+      // frame's metadata followed by the delta-encoded frame
+      var requestKeyframe;
+      if (typeof io !== 'undefined') {
+        var socket = io();
+        socket.on('frame', showFrame);
+        requestKeyframe = function () { socket.emit('keyframe'); };
+      } else {
+        var ws = new WebSocket((location.protocol == 'https:' ? 'wss://' : 'ws://') + location.host + '/stream/0');
+        ws.binaryType = 'arraybuffer';
+        ws.onmessage = function (event) {
+          var metadataSize = new DataView(event.data).getUint16(2, true);
+          showFrame(event.data.slice(metadataSize), event.data.slice(0, metadataSize));
+        };
+        requestKeyframe = function () { ws.send('keyframe'); };
+      }
 
-        // Inflate the data
-        var inflatedData = pako.inflate(msg).buffer;
+      function showFrame(msg, metadata) {
 
-        // Create an array of unsigned integers from the array
-        var intData = new Uint16Array(inflatedData);
+        // Decode the frame, asking for a keyframe if it's a difference from a frame we haven't got
+        if (!decoder.decode(new Uint8Array(msg))) {
+          if (!awaitingKeyframe) {
+            awaitingKeyframe = true;
+            requestKeyframe();
+          }
+          return;
+        }
+        awaitingKeyframe = false;
+        var intData = decoder.pixels;
+
+        // Lepton 2.x cameras produce 80x60 frames rather than 160x120
+        var width = intData.length == 80 * 60 ? 80 : 160;
+        if (canvas.width != width) {
+          canvas.width = width;
+          canvas.height = width * 3 / 4;
+          imageData = ctx.getImageData(0, 0, canvas.width, canvas.height);
+        }
 
-        // Take the range of the values
-        var max = Math.max.apply(Math, intData);
-        var min = Math.min.apply(Math, intData);
-        var range = max - min;
+        // Take the range of the values from the frame's metadata (see frame_metadata_t in leptonic.c)
+        var view = new DataView(metadata);
+        var min = view.getUint16(32, true);
+        var max = view.getUint16(34, true);
+        var range = max - min || 1;
 
         // Build some image data with the integers
         for (var c = 0; c < intData.length; c ++) {
@@ -32,7 +65,7 @@
 
         ctx.putImageData(imageData, 0, 0);
 
-      });
+      }
 
   });
 })(jQuery);
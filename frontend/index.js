@@ -4,30 +4,39 @@ const path = require('path');
 const http = require('http').Server(app);
 const io = require('socket.io')(http);
 const zmq = require('zeromq');
-const pako = require('pako');
 const process = require('process');
 
-// Define a requester
-let requester = zmq.socket('req');
-requester.connect(process.argv[2] ? process.argv[2] : 'tcp://127.0.0.1:5555')
+// Subscribe to the first camera's frames, which are pushed delta-encoded as soon as they're captured
+let subscriber = zmq.socket('sub');
+subscriber.connect(process.argv[2] ? process.argv[2] : 'tcp://127.0.0.1:5555');
+subscriber.subscribe('delta 0');
 
-// Upon Lepton data arriving, build up a frame
-requester.on('message', (data) => {
-  data.swap16();
-  let compressedData = Buffer.from(pako.deflate(data));
-  io.volatile.emit('frame', compressedData, {for: 'everyone'});
+// Upon Lepton data arriving (after the topic and the frame's metadata), send the frame and its
+// metadata on as they are, for each browser to decode
+subscriber.on('message', (topic, metadata, data) => {
+  io.volatile.emit('frame', data, metadata);
 });
 
-// Request a single frame now
-setInterval(() => {
-  requester.send('hello');
-}, 1000/9);
+// Subscribing again gets a keyframe, for browsers that have just connected or lost their place
+let keyframeRequested = false;
+function requestKeyframe() {
+  if (!keyframeRequested) {
+    keyframeRequested = true;
+    subscriber.unsubscribe('delta 0');
+    subscriber.subscribe('delta 0');
+    setTimeout(() => { keyframeRequested = false; }, 250);
+  }
+}
+
+io.on('connection', (socket) => {
+  requestKeyframe();
+  socket.on('keyframe', requestKeyframe);
+});
 
 app.get('/', (req, res) => {
   res.sendFile(__dirname + '/index.html');
 });
 
 app.use('/assets', express.static(path.join(__dirname, 'assets')))
-app.use('/pako', express.static(__dirname + '/node_modules/pako/dist/'));
 
 http.listen(3000);
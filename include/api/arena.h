@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The alignment of every allocation: a cache line, and enough for any SIMD load or store
+#define ARENA_ALIGNMENT 64
+
+// The size of a huge page, which arenas are rounded up to when backed by them
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// A region of memory set up once at startup, that everything long-lived is carved out of.
+// Allocations are never freed individually; the arena lives as long as the process.
+typedef struct {
+  uint8_t* base;
+  size_t size;
+  size_t used;
+  // Whether the arena is backed by huge pages (explicitly, or transparently if the kernel obliges),
+  // and whether it's locked in memory
+  int huge_pages;
+  int locked;
+  // Set once startup is complete, after which allocating is an error
+  int sealed;
+} arena_t;
+
+/* Setup */
+int arena_init(arena_t* arena, size_t size);
+void arena_seal(arena_t* arena);
+
+/* Allocation */
+size_t arena_size_for(size_t size, int count);
+void* arena_alloc(arena_t* arena, size_t size);
+
+#endif /* ARENA_H */
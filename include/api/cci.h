@@ -26,9 +26,16 @@
 #define CCI_CMD_RAD_GET_RADIOMETRY_TLINEAR_ENABLE_STATE 0x0EC0
 #define CCI_CMD_RAD_SET_RADIOMETRY_TLINEAR_ENABLE_STATE 0x0EC1
 
+#define CCI_CMD_OEM_GET_PART_NUMBER 0x481C
+#define CCI_CMD_OEM_GET_GPIO_MODE 0x4854
+#define CCI_CMD_OEM_SET_GPIO_MODE 0x4855
+
 #define CCI_CMD_AGC_GET_AGC_ENABLE_STATE 0x0100
 #define CCI_CMD_AGC_SET_AGC_ENABLE_STATE 0x0101
 
+/* The length of the part number string returned by CCI_CMD_OEM_GET_PART_NUMBER */
+#define CCI_PART_NUMBER_LENGTH 32
+
 #define WAIT_FOR_BUSY_DEASSERT() while (cci_read_register(fd, CCI_REG_STATUS) & 0x01) ;
 
 /* Telemetry Modes for use with CCI_CMD_SYS_SET_TELEMETRY_* */
@@ -59,6 +66,16 @@ typedef enum {
   CCI_AGC_ENABLED,
 } cci_agc_enable_state_t;
 
+/* GPIO Modes for use with CCI_CMD_OEM_SET_GPIO_MODE */
+typedef enum {
+  CCI_GPIO_MODE_GPIO,
+  CCI_GPIO_MODE_I2C_MASTER,
+  CCI_GPIO_MODE_SPI_MASTER_VLB_DATA,
+  CCI_GPIO_MODE_SPIO_MASTER_REG_DATA,
+  CCI_GPIO_MODE_SPI_SLAVE_VLB_DATA,
+  CCI_GPIO_MODE_VSYNC,
+} cci_gpio_mode_t;
+
 /* Setup */
 int cci_init(int fd);
 
@@ -80,6 +97,11 @@ uint32_t cci_get_radiometry_enable_state(int fd);
 void cci_set_radiometry_tlinear_enable_state(int fd, cci_radiometry_tlinear_enable_state_t state);
 uint32_t cci_get_radiometry_tlinear_enable_state(int fd);
 
+/* Module: OEM */
+void cci_get_part_number(int fd, char part_number[CCI_PART_NUMBER_LENGTH + 1]);
+void cci_set_gpio_mode(int fd, cci_gpio_mode_t mode);
+uint32_t cci_get_gpio_mode(int fd);
+
 /* Module: AGC */
 void cci_set_agc_enable_state(int fd, cci_agc_enable_state_t state);
 uint32_t cci_get_agc_enable_state(int fd);
@@ -0,0 +1,16 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The CRC-16-CCITT generator polynomial, x^16 + x^12 + x^5 + 1
+#define CRC16_CCITT_POLY 0x1021
+
+/* Setup */
+void crc16_init(void);
+
+/* Calculation */
+uint16_t crc16_ccitt(uint16_t crc, const uint8_t* buf, size_t len);
+
+#endif /* CRC16_H */
@@ -0,0 +1,80 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The version of the encoding, carried in every encoded frame's header
+#define DELTA_VERSION 1
+
+// The largest number of pixels in a frame that can be encoded (Lepton 3.x, 160x120)
+#define DELTA_MAX_PIXELS (160 * 120)
+
+// The types of encoded frame
+typedef enum {
+  // Encoded on its own, each pixel predicted from its neighbours
+  DELTA_KEYFRAME = 0,
+  // Encoded as the difference from the frame with the base sequence number
+  DELTA_DIFFERENCE = 1
+} delta_frame_type_t;
+
+// The header at the start of every encoded frame (all fields little-endian), followed by the
+// frame's residuals coded as described in delta.c
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t type;
+  uint16_t width;
+  uint16_t height;
+  uint16_t reserved;
+  // The sequence number of the frame, and of the frame a difference is taken from (0 for keyframes)
+  uint32_t sequence;
+  uint32_t base_sequence;
+} delta_header_t;
+
+// The largest size of an encoded frame of width x height pixels
+#define DELTA_MAX_ENCODED_SIZE(width, height) (sizeof(delta_header_t) + 3 * (size_t)(width) * (height))
+
+// The state of an encoder: the frame encoded last, which the next difference is taken from
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  // The pixels of the frame encoded last, and its sequence number
+  uint16_t* previous;
+  uint32_t previous_sequence;
+  // The residuals of the frame being encoded
+  uint16_t* residuals;
+  int has_previous;
+  // Encode a keyframe after every keyframe_interval differences (never if 0), or the next frame if requested
+  int keyframe_interval;
+  int since_keyframe;
+  int keyframe_requested;
+  // The number of frames of each type encoded, and the number of bytes in and out
+  uint32_t keyframes;
+  uint32_t differences;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+} delta_encoder_t;
+
+// The state of a decoder: the frame decoded last, which the next difference applies to
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  uint16_t* pixels;
+  uint32_t sequence;
+  int has_frame;
+  // The residuals of the frame being decoded
+  uint16_t* residuals;
+} delta_decoder_t;
+
+/* Encoding */
+int delta_encoder_init(delta_encoder_t* encoder, uint16_t width, uint16_t height, int keyframe_interval,
+  uint16_t* previous, uint16_t* residuals);
+void delta_request_keyframe(delta_encoder_t* encoder);
+size_t delta_encode(delta_encoder_t* encoder, const uint16_t* pixels, uint32_t sequence, uint8_t* out);
+
+/* Decoding */
+int delta_decoder_init(delta_decoder_t* decoder, uint16_t width, uint16_t height, uint16_t* pixels,
+  uint16_t* residuals);
+int delta_decode(delta_decoder_t* decoder, const uint8_t* data, size_t size);
+
+#endif /* DELTA_H */
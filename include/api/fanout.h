@@ -0,0 +1,91 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "ring.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+// The largest number of consumers a fan-out can serve
+#define FANOUT_MAX_CONSUMERS 8
+
+// The largest number of slots the consumers of a fan-out can retain between them (see fanout_retain())
+#define FANOUT_MAX_RETAINED 16
+
+// The number of slots a fan-out needs: one per position, two per consumer (the slot it's reading
+// and one it may briefly hold a reference to while acquiring), one per retained slot and one for
+// the producer
+#define FANOUT_SLOTS(capacity, max_consumers, max_retained) \
+  ((capacity) + 2 * (max_consumers) + (max_retained) + 1)
+#define FANOUT_MAX_SLOTS FANOUT_SLOTS(RING_MAX_CAPACITY, FANOUT_MAX_CONSUMERS, FANOUT_MAX_RETAINED)
+
+// How a consumer reads from a fan-out
+typedef enum {
+  // Skip straight to the newest slot each time (for live view)
+  FANOUT_LATEST,
+  // Read every slot in order, resuming from the oldest slot still held if lapped by the producer
+  FANOUT_IN_ORDER,
+  // Read every slot in order, making the producer wait rather than lap the consumer (for recording)
+  FANOUT_BLOCK
+} fanout_policy_t;
+
+// A consumer of a fan-out, with its own read cursor
+typedef struct {
+  // The sequence number of the next slot to read
+  _Alignas(RING_CACHE_LINE) _Atomic uint32_t cursor;
+  fanout_policy_t policy;
+  // The slot being read, or -1
+  int held;
+  // An eventfd to notify when there's something new, if any, and whether a notification is wanted
+  _Atomic int event_fd;
+  _Atomic int armed;
+  // The number of slots read, and the number skipped (by lapping or by skipping to the newest)
+  _Atomic uint32_t received;
+  _Atomic uint32_t dropped;
+  struct fanout* fanout;
+} fanout_consumer_t;
+
+// Slots published by a single producer and shared between any number of consumers without copying.
+// Each position holds a reference to the slot published into it, and each consumer holds a
+// reference to the slot it's reading; a slot is only refilled once nothing refers to it, so a slow
+// consumer only ever loses its own frames.
+typedef struct fanout {
+  // The sequence number of the newest slot published (from 1), only advanced by the producer
+  _Alignas(RING_CACHE_LINE) _Atomic uint32_t head;
+  // The number of consumers (about to be) asleep waiting for a slot
+  _Alignas(RING_CACHE_LINE) _Atomic int consumers_waiting;
+  // Set while the producer is (about to be) asleep waiting for a blocking consumer
+  _Alignas(RING_CACHE_LINE) _Atomic int producer_waiting;
+  // The sequence number (high 32 bits) and slot (low 32 bits) published into each position
+  _Alignas(RING_CACHE_LINE) _Atomic uint64_t positions[RING_MAX_CAPACITY];
+  _Atomic uint32_t refs[FANOUT_MAX_SLOTS];
+  void* slots[FANOUT_MAX_SLOTS];
+  uint32_t capacity;
+  int slot_count;
+  // The number of slots retained by consumers beyond those they're reading, and the most allowed
+  _Atomic int retained;
+  int max_retained;
+  // The slot being filled by the producer
+  int producing;
+  _Alignas(RING_CACHE_LINE) fanout_consumer_t consumers[FANOUT_MAX_CONSUMERS];
+  _Atomic int consumer_count;
+} fanout_t;
+
+/* Setup */
+int fanout_init(fanout_t* fanout, int capacity, int max_consumers, int max_retained, void* (*allocate)());
+int fanout_policy_for_name(const char* name, fanout_policy_t* policy);
+fanout_consumer_t* fanout_add_consumer(fanout_t* fanout, fanout_policy_t policy);
+
+/* Producing */
+void* fanout_producer_slot(fanout_t* fanout);
+void* fanout_publish(fanout_t* fanout);
+
+/* Consuming */
+void* fanout_acquire(fanout_consumer_t* consumer);
+void* fanout_try_acquire(fanout_consumer_t* consumer);
+int fanout_consumer_event_fd(fanout_consumer_t* consumer);
+
+/* Retaining slots beyond the next acquire */
+void* fanout_retain(fanout_consumer_t* consumer);
+void fanout_release(fanout_t* fanout, void* slot);
+
+#endif /* FANOUT_H */
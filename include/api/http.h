@@ -0,0 +1,94 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// The largest number of clients connected at once; any more are turned away
+#define HTTP_MAX_CLIENTS 32
+
+// The largest request (or run of WebSocket messages from a client) that's read at once
+#define HTTP_REQUEST_SIZE 2048
+
+// The room each client has for output its socket hasn't taken yet: a frame, and its headers. A
+// client that hasn't taken all of one frame by the time the next is streamed misses the next.
+#define HTTP_QUEUE_SIZE (64 * 1024)
+
+// The streams clients can follow, each of which has a channel per camera
+typedef enum {
+  // WebSocket binary messages (/stream/<channel>)
+  HTTP_STREAM_WEBSOCKET,
+  // A multipart/x-mixed-replace stream of JPEGs, which browsers show as video in an <img> (/mjpeg/<channel>)
+  HTTP_STREAM_MJPEG,
+  HTTP_STREAM_COUNT
+} http_stream_t;
+
+// What a client is doing
+typedef enum {
+  HTTP_CLIENT_FREE,
+  // Sending its request
+  HTTP_CLIENT_REQUEST,
+  // Being sent a response (I.e. a file), after which it's disconnected
+  HTTP_CLIENT_RESPONSE,
+  // Following a stream
+  HTTP_CLIENT_STREAMING
+} http_client_state_t;
+
+// A client connected to a server
+typedef struct {
+  int fd;
+  http_client_state_t state;
+  http_stream_t stream;
+  int channel;
+  // What's been read from the client and not yet handled
+  char input[HTTP_REQUEST_SIZE];
+  size_t input_size;
+  // Output the client's socket hasn't taken yet, followed by any part of a file still to send
+  uint8_t* queue;
+  size_t queue_start;
+  size_t queue_end;
+  int file_fd;
+  off_t file_offset;
+  off_t file_size;
+  // Whether the server's waiting for the client's socket to take more output
+  int waiting_to_write;
+  // Whether the next frame streamed to the client must be a keyframe (after joining or missing one)
+  int needs_keyframe;
+  uint32_t frames_sent;
+  uint32_t frames_missed;
+} http_client_t;
+
+// Counts of what a server has done
+typedef struct {
+  uint32_t requests;
+  uint32_t rejected;
+  uint32_t frames_sent;
+  uint32_t frames_missed;
+} http_stats_t;
+
+// An event-driven HTTP server, serving files from a directory and streaming frames to any number of
+// clients, all from the thread that calls http_server_handle() whenever its fd is readable
+typedef struct {
+  int listen_fd;
+  int epoll_fd;
+  char root[256];
+  int channel_count;
+  http_client_t clients[HTTP_MAX_CLIENTS];
+  http_stats_t stats;
+} http_server_t;
+
+/* Setup */
+int http_server_init(http_server_t* server, int port, const char* root, int channel_count,
+  void* (*allocate)(size_t));
+int http_server_fd(http_server_t* server);
+
+/* Serving */
+void http_server_handle(http_server_t* server);
+
+/* Streaming */
+int http_stream_clients(http_server_t* server, http_stream_t stream, int channel, int* keyframe_wanted);
+void http_stream_frame(http_server_t* server, http_stream_t stream, int channel, const void* header,
+  size_t header_size, const void* data, size_t size, int keyframe);
+
+#endif /* HTTP_H */
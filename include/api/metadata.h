@@ -0,0 +1,40 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stdint.h>
+
+// The version of the metadata sent ahead of frames
+#define FRAME_METADATA_VERSION 1
+
+// The FFC state given in a frame's metadata when telemetry is disabled
+#define FFC_STATE_UNKNOWN 0xff
+
+// The metadata leptonic sends ahead of each frame published or requested from a particular camera,
+// and keeps alongside each frame in shared memory (all fields little-endian). Fields are only ever
+// added at the end, so clients should use the size given rather than their own.
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  // The camera's index, in the order the cameras were given
+  uint8_t camera;
+  // The size of the metadata
+  uint16_t size;
+  uint32_t frame_sequence;
+  // When the frame's first segment started, on CLOCK_MONOTONIC and CLOCK_REALTIME (ns since the epoch)
+  uint64_t timestamp_ns;
+  uint64_t wall_clock_ns;
+  // The number of frames the camera has dropped (I.e. for CRC errors) since capture started, which
+  // along with the sequence number shows any gaps
+  uint32_t dropped_frames;
+  uint16_t width;
+  uint16_t height;
+  // The range and mean of the frame's pixel values
+  uint16_t min;
+  uint16_t max;
+  uint16_t mean;
+  // The state of flat-field correction (0 never commanded, 1 imminent, 2 in progress, 3 complete)
+  // and whether it's desired, from telemetry; FFC_STATE_UNKNOWN if telemetry is disabled
+  uint8_t ffc_state;
+  uint8_t ffc_desired;
+} frame_metadata_t;
+
+#endif /* METADATA_H */
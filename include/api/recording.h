@@ -0,0 +1,70 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include "vospi.h"
+#include <stdint.h>
+#include <stdio.h>
+
+// Recordings begin with this magic, followed by the rest of a recording_header_t
+#define RECORDING_MAGIC "VOSPIREC"
+#define RECORDING_MAGIC_BYTES 8
+#define RECORDING_VERSION 1
+
+// The size of the buffer that records are written through, so the capture thread rarely blocks
+#define RECORDING_WRITE_BUFFER_BYTES (1024 * 1024)
+
+// The largest number of packets a single record may hold when replayed
+#define RECORDING_MAX_RECORD_PACKETS 64
+
+// The header at the start of a recording (all fields little-endian)
+typedef struct __attribute__((packed)) {
+  char magic[RECORDING_MAGIC_BYTES];
+  uint16_t version;
+  // The size of each packet in the recording, as on the wire
+  uint16_t packet_bytes;
+  uint32_t reserved;
+} recording_header_t;
+
+// The header of each record, which holds the packets of one transfer exactly as they were received
+// (discard packets included), followed by the packets themselves
+typedef struct __attribute__((packed)) {
+  // When the transfer completed, on CLOCK_MONOTONIC
+  uint64_t timestamp_ns;
+  uint32_t packet_count;
+} recording_record_t;
+
+// A recording being written
+typedef struct recording_writer {
+  FILE* fp;
+  uint64_t records;
+} recording_writer_t;
+
+// A recording being replayed
+typedef struct recording_reader {
+  int fd;
+  // Whether to deliver packets at the pace they were recorded, rather than as fast as possible
+  int paced;
+  // The timestamp of the first record, and when it was replayed
+  uint64_t first_record_ns;
+  uint64_t first_replay_ns;
+  // The packets of the current record, and how many of them have been delivered
+  uint8_t packets[RECORDING_MAX_RECORD_PACKETS * VOSPI_PACKET_BYTES];
+  int packet_count;
+  int packets_delivered;
+  uint64_t records;
+  // Set once the end of the recording has been reached
+  int ended;
+} recording_reader_t;
+
+/* Writing */
+recording_writer_t* recording_open_writer(int fd);
+int recording_write(recording_writer_t* writer, uint64_t timestamp_ns, const void* packets, int count);
+void recording_close_writer(recording_writer_t* writer);
+
+/* Reading */
+int recording_detect(int fd);
+recording_reader_t* recording_open_reader(int fd);
+int recording_read(recording_reader_t* reader, void* packets, int count);
+void recording_close_reader(recording_reader_t* reader);
+
+#endif /* RECORDING_H */
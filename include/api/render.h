@@ -0,0 +1,51 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The number of colours in a palette, which pixels are scaled onto
+#define RENDER_PALETTE_SIZE 255
+
+// The AGC range below which frames aren't stretched any further, so noise isn't amplified
+#define RENDER_DEFAULT_MIN_RANGE 200
+
+// The largest number of bytes a rendered pixel takes
+#define RENDER_MAX_BYTES_PER_PIXEL 4
+
+// The pixel formats frames can be rendered to
+typedef enum {
+  // 8 bits per channel, in byte order
+  RENDER_RGB,
+  RENDER_BGR,
+  RENDER_RGBA,
+  RENDER_BGRA,
+  // 5, 6 and 5 bits of red, green and blue in a little-endian uint16_t, for framebuffers
+  RENDER_RGB565
+} render_format_t;
+
+// The palettes frames can be rendered with
+typedef enum {
+  RENDER_PALETTE_FUSION,
+  RENDER_PALETTE_GREY
+} render_palette_t;
+
+// How to render frames: the palette laid out in the format rendered to, so that each pixel is
+// scaled onto it and copied straight out
+typedef struct {
+  render_format_t format;
+  int bytes_per_pixel;
+  uint16_t min_range;
+  uint8_t colours[RENDER_PALETTE_SIZE][RENDER_MAX_BYTES_PER_PIXEL];
+} renderer_t;
+
+/* Setup */
+void render_init(renderer_t* renderer, render_format_t format, render_palette_t palette, uint16_t min_range);
+int render_format_for_name(const char* name, render_format_t* format);
+int render_palette_for_name(const char* name, render_palette_t* palette);
+
+/* Rendering */
+size_t render_frame(const renderer_t* renderer, const uint16_t* pixels, int width, int height,
+  uint16_t min, uint16_t max, uint8_t* out, size_t stride);
+
+#endif /* RENDER_H */
@@ -0,0 +1,80 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// The largest number of slots a ring can hold for its consumer (must be a power of 2)
+#define RING_MAX_CAPACITY 64
+
+// The size of a cache line, which the indices of each queue are padded out to
+#define RING_CACHE_LINE 64
+
+// What happens when a slot is published while the consumer is holding every other slot
+typedef enum {
+  // Drop the oldest unread slot, and have the consumer skip straight to the newest (for live view)
+  RING_LATEST,
+  // Wait for the consumer to release a slot (for recording, where every frame matters)
+  RING_BLOCK,
+  // Drop the slot being published, keeping the unread ones
+  RING_DROP_NEWEST
+} ring_policy_t;
+
+// A bounded queue of slot pointers with a single producer. Slots are popped by compare-and-swap,
+// so that the producer of a ring can take back its oldest unread slot from under the consumer.
+typedef struct {
+  // The next position to write, only advanced by the producer
+  _Alignas(RING_CACHE_LINE) _Atomic uint32_t head;
+  // The next position to read
+  _Alignas(RING_CACHE_LINE) _Atomic uint32_t tail;
+  _Alignas(RING_CACHE_LINE) void* _Atomic slots[RING_MAX_CAPACITY];
+} ring_queue_t;
+
+// Counts of what's happened to the slots published into a ring
+typedef struct {
+  uint32_t published;
+  // Slots dropped to make way for newer ones, or skipped over by the consumer (RING_LATEST)
+  uint32_t dropped_oldest;
+  // Slots dropped as they were published (RING_DROP_NEWEST)
+  uint32_t dropped_newest;
+  // The number of times the producer had to wait for the consumer (RING_BLOCK)
+  uint32_t producer_waits;
+} ring_stats_t;
+
+// A ring of slots handed from a producer thread to a consumer thread without locks.
+// Filled slots are passed to the consumer, and slots it has finished with are passed back to be
+// filled again, so only pointers ever change hands.
+typedef struct {
+  // Slots filled by the producer waiting to be read, and slots released by the consumer
+  ring_queue_t filled;
+  ring_queue_t released;
+  uint32_t capacity;
+  ring_policy_t policy;
+  // Set while the consumer or producer is (about to be) asleep waiting for the other
+  _Alignas(RING_CACHE_LINE) _Atomic int consumer_waiting;
+  _Alignas(RING_CACHE_LINE) _Atomic int producer_waiting;
+  // An eventfd to notify when a slot is published, if any, and whether a notification is wanted
+  _Alignas(RING_CACHE_LINE) _Atomic int event_fd;
+  _Atomic int consumer_armed;
+  _Alignas(RING_CACHE_LINE) _Atomic uint32_t published;
+  _Atomic uint32_t dropped_oldest;
+  _Atomic uint32_t dropped_newest;
+  _Atomic uint32_t producer_waits;
+} ring_t;
+
+/* Setup */
+int ring_init(ring_t* ring, int capacity, ring_policy_t policy, void* (*allocate)());
+int ring_policy_for_name(const char* name, ring_policy_t* policy);
+
+/* Producing */
+void* ring_publish(ring_t* ring, void* slot);
+
+/* Consuming */
+void* ring_acquire(ring_t* ring, void* released_slot);
+void* ring_try_acquire(ring_t* ring, void* released_slot);
+int ring_event_fd(ring_t* ring);
+
+/* Statistics */
+void ring_get_stats(ring_t* ring, ring_stats_t* stats);
+
+#endif /* RING_H */
@@ -0,0 +1,86 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Identifies a shared-memory frame ring, and the version of its layout
+#define SHM_MAGIC 0x4d48534c // "LSHM"
+#define SHM_VERSION 2
+
+// The size of a cache line, which the header and every slot are aligned to
+#define SHM_CACHE_LINE 64
+
+// The room in each slot for metadata describing its payload, defined by the publisher
+#define SHM_METADATA_SIZE 64
+
+// The largest number of slots in a shared-memory ring
+#define SHM_MAX_SLOTS 64
+
+// The suffix of the name of a ring's waiter count, which readers (unlike the ring) can write to
+#define SHM_WAITERS_SUFFIX ".waiters"
+
+// The header at the start of a shared-memory ring, followed by its slots
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t header_size;
+  uint32_t slot_count;
+  // The size of each slot (header, metadata and payload), and the largest payload it holds
+  uint32_t slot_size;
+  uint32_t payload_capacity;
+  // Set once the publisher has stopped, after which nothing more is published
+  _Atomic uint32_t closed;
+  // The number of the publication made last (0 before the first); readers wait on it with a futex
+  _Alignas(SHM_CACHE_LINE) _Atomic uint32_t published;
+} shm_header_t;
+
+// A slot in a shared-memory ring. The publication number is a sequence lock: it's 0 while the
+// slot is being written, so a reader knows what it read is intact if the number hasn't changed.
+typedef struct {
+  _Atomic uint32_t publication;
+  // The size of the payload
+  uint32_t size;
+  _Alignas(SHM_CACHE_LINE) uint8_t metadata[SHM_METADATA_SIZE];
+  _Alignas(SHM_CACHE_LINE) uint8_t payload[];
+} shm_slot_t;
+
+// The publishing side of a shared-memory ring, owned by a single thread
+typedef struct {
+  char name[64];
+  shm_header_t* header;
+  size_t size;
+  // The number of readers (about to be) asleep waiting for a publication, so that a publication
+  // nobody's waiting for costs no syscall
+  char waiters_name[64 + sizeof(SHM_WAITERS_SUFFIX)];
+  _Atomic uint32_t* waiters;
+  // The slot being written, if any
+  shm_slot_t* slot;
+} shm_publisher_t;
+
+// A reader of a shared-memory ring, which it maps read-only so it can never hold up the publisher
+typedef struct {
+  const shm_header_t* header;
+  size_t size;
+  // The ring's count of waiting readers, which the reader adds itself to while it sleeps
+  _Atomic uint32_t* waiters;
+  // The number of the publication read last, and the number of publications overwritten unread
+  uint32_t publication;
+  uint32_t missed;
+} shm_reader_t;
+
+/* Publishing */
+int shm_publisher_init(shm_publisher_t* publisher, const char* name, int slot_count, size_t payload_capacity);
+shm_slot_t* shm_begin_publish(shm_publisher_t* publisher);
+void shm_publish(shm_publisher_t* publisher);
+void shm_publisher_close(shm_publisher_t* publisher);
+
+/* Reading */
+int shm_reader_open(shm_reader_t* reader, const char* name);
+const shm_slot_t* shm_read(shm_reader_t* reader, int timeout_ms);
+int shm_read_intact(shm_reader_t* reader, const shm_slot_t* slot);
+int shm_reader_closed(shm_reader_t* reader);
+void shm_reader_close(shm_reader_t* reader);
+
+#endif /* SHM_H */
@@ -0,0 +1,18 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include "vospi.h"
+#include <stdint.h>
+
+// The largest number of pixels in a frame of any supported geometry (Lepton 3.x, 160x120)
+#define UNPACK_MAX_PIXELS (160 * 120)
+
+/* Unpacking */
+int unpack_frame(const vospi_frame_t* frame, const vospi_geometry_t* geometry, uint16_t* pixels,
+  uint16_t* min, uint16_t* max);
+void unpack_packets(const vospi_packet_t* packets, int count, uint16_t* pixels, uint16_t* min, uint16_t* max);
+
+/* Introspection */
+const char* unpack_implementation(void);
+
+#endif /* UNPACK_H */
@@ -2,6 +2,7 @@
 #define VOSPI_H
 
 #include <stdint.h>
+#include <linux/spi/spidev.h>
 
 // Flip byte order of a word
 #define FLIP_WORD_BYTES(word) (word >> 8) | (word << 8)
@@ -10,20 +11,48 @@
 #define VOSPI_PACKET_BYTES 164
 #define VOSPI_PACKET_SYMBOLS 160
 
-// The maximum number of packets per segment, sufficient to include telemetry
-#define VOSPI_MAX_PACKETS_PER_SEGMENT 61
-// The number of packets in segments with and without telemetry lines present
+// The maximum number of packets per segment, sufficient to include telemetry (Lepton 2.x frames
+// with telemetry are a single segment of 63 packets)
+#define VOSPI_MAX_PACKETS_PER_SEGMENT 63
+// The number of packets in Lepton 3.x segments with and without telemetry lines present
 #define VOSPI_PACKETS_PER_SEGMENT_NORMAL 60
 #define VOSPI_PACKETS_PER_SEGMENT_TELEMETRY 61
+// The maximum number of telemetry packets per frame (Lepton 3.x frames have 4, Lepton 2.x have 3)
+#define VOSPI_MAX_TELEMETRY_PACKETS 4
 
-// The number of segments per frame
+// The maximum number of segments per frame (Lepton 3.x frames have 4, Lepton 2.x frames have 1)
 #define VOSPI_SEGMENTS_PER_FRAME 4
 
+// The number of pixels carried by each packet
+#define VOSPI_PACKET_PIXELS (VOSPI_PACKET_SYMBOLS / 2)
+
+// Where to find spidev's bufsiz module parameter, which bounds the size of a single SPI message
+#define VOSPI_SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+// The bufsiz spidev uses if the parameter hasn't been changed
+#define VOSPI_SPIDEV_DEFAULT_BUFSIZ 4096
+
+// The interval between segments is learned, but must fall within these bounds (in nanoseconds)
+#define VOSPI_MIN_SEGMENT_PERIOD_NS 5000000
+#define VOSPI_MAX_SEGMENT_PERIOD_NS 50000000
+// How far ahead of a segment's predicted arrival to wake and start polling, and the limits the
+// guard window adapts between
+#define VOSPI_SCHEDULE_GUARD_NS 1000000
+#define VOSPI_SCHEDULE_MIN_GUARD_NS 250000
+// The number of segment intervals to observe before the period estimate is trusted
+#define VOSPI_SCHEDULE_LEARN_SEGMENTS 8
+
+// The histogram of intervals between segments has this many bins of this width (in nanoseconds),
+// the last of which collects everything longer
+#define VOSPI_INTERVAL_HISTOGRAM_BINS 64
+#define VOSPI_INTERVAL_HISTOGRAM_BIN_NS 1000000
+
 // The maximum number of resets allowed before giving up on synchronising
 #define VOSPI_MAX_SYNC_RESETS 30
 // The maximum number of invalid frames before giving up and assuming we've lost sync
 // FFC duration is nominally 23 frames, so we should never exceed that
 #define VOSPI_MAX_INVALID_FRAMES 25
+// The maximum number of attempts to realign with a segment boundary while receiving a segment
+#define VOSPI_MAX_REALIGNS 8
 
 // A single VoSPI packet
 typedef struct {
@@ -41,10 +70,135 @@ typedef struct {
 // A single VoSPI frame
 typedef struct {
   vospi_segment_t segments[VOSPI_SEGMENTS_PER_FRAME];
+  // When the frame's first segment started, on CLOCK_MONOTONIC (from VSYNC where available)
+  uint64_t timestamp_ns;
+  // The sequence number of the frame, counting from 1 for the first frame a device started on.
+  // Every attempt at a frame takes a number, so frames dropped or restarted part-way leave gaps
+  uint32_t sequence;
+  // Telemetry rows, moved out of the segments by transfer_frame() so they only hold video
+  vospi_packet_t telemetry[VOSPI_MAX_TELEMETRY_PACKETS];
+  int telemetry_packet_count;
 } vospi_frame_t;
 
-int vospi_init(int fd, uint32_t speed);
-int sync_and_transfer_frame(int fd, vospi_frame_t* frame);
-int transfer_frame(int fd, vospi_frame_t* frame);
+// The ways in which packets can be moved from the device
+typedef enum {
+  VOSPI_TRANSFER_IOCTL,  // Batched SPI_IOC_MESSAGE transfers from a spidev device
+  VOSPI_TRANSFER_READ,   // Plain read()s from a file or pipe standing in for a spidev device
+  VOSPI_TRANSFER_REPLAY, // Packets replayed from a recording standing in for a spidev device
+} vospi_transfer_mode_t;
+
+typedef enum {
+  VOSPI_TELEMETRY_UNKNOWN, // Not yet detected, or present but not yet located
+  VOSPI_TELEMETRY_NONE,    // Telemetry is disabled
+  VOSPI_TELEMETRY_HEADER,  // Telemetry rows precede the video rows
+  VOSPI_TELEMETRY_FOOTER,  // Telemetry rows follow the video rows
+} vospi_telemetry_t;
+
+// Counters describing the traffic on a VoSPI stream
+typedef struct {
+  uint32_t frames;
+  uint32_t transfers;
+  uint32_t discard_packets;
+  uint32_t crc_errors;
+  uint32_t dropped_frames;
+  uint32_t syncs;
+  // Sleeps taken while waiting for segments, their total duration, and how many woke too late
+  uint32_t sleeps;
+  uint64_t slept_ns;
+  uint32_t late_wakeups;
+  // VSYNC pulses seen, and those that were missed because we were busy
+  uint32_t vsync_pulses;
+  uint32_t missed_vsync_pulses;
+  // Intervals between the starts of consecutive segments, and segments that arrived so late that
+  // at least one segment period was skipped
+  uint32_t segment_intervals[VOSPI_INTERVAL_HISTOGRAM_BINS];
+  uint32_t late_segments;
+  // Recovery from misnumbered packets: segments that were realigned with a segment starting
+  // part-way through a transfer, partial segments skipped to reach the next boundary, and
+  // segments that couldn't be recovered
+  uint32_t realigned_segments;
+  uint32_t skipped_segments;
+  uint32_t misnumbered_segments;
+  // Frames completed despite a realigned segment, a skipped partial segment, or restarting
+  // part-way through - each would otherwise have been lost to a resync
+  uint32_t realigned_frames;
+  uint32_t skipped_frames;
+  uint32_t restarted_frames;
+} vospi_stats_t;
+
+// State for predicting when segments will arrive, so the wait can be slept through
+typedef struct {
+  int enabled;
+  // The estimated time at which the last valid segment started, on CLOCK_MONOTONIC
+  uint64_t last_segment_ns;
+  // The interval between segments: as first learned, as currently tracked, and the number of
+  // intervals observed
+  uint64_t learned_period_ns;
+  uint64_t period_ns;
+  uint32_t samples;
+  // How long before a segment is due to stop sleeping and start polling
+  uint64_t guard_ns;
+} vospi_schedule_t;
+
+struct vospi_device;
+struct recording_writer;
+struct recording_reader;
+
+// The geometry of the frames produced by a particular camera model
+typedef struct {
+  const char* name;
+  uint16_t width;
+  uint16_t height;
+  // The number of segments per frame; Lepton 2.x frames are a single segment with no TTT bits
+  uint8_t segments_per_frame;
+  // The number of telemetry packets added to each frame when telemetry is enabled
+  uint8_t telemetry_packets;
+  // The frame transfer routine compiled for this geometry
+  int (*transfer_frame)(struct vospi_device* dev, vospi_frame_t* frame);
+} vospi_geometry_t;
+
+extern const vospi_geometry_t vospi_geometry_lepton2;
+extern const vospi_geometry_t vospi_geometry_lepton3;
+
+// A VoSPI device
+typedef struct vospi_device {
+  int fd;
+  // The geometry of the camera, Lepton 3.x unless changed after vospi_init()
+  const vospi_geometry_t* geometry;
+  vospi_transfer_mode_t transfer_mode;
+  // The largest number of packets that may be moved by a single transfer
+  int packets_per_transfer;
+  // Transfer descriptors, one per packet, set up once by vospi_init()
+  struct spi_ioc_transfer transfers[VOSPI_MAX_PACKETS_PER_SEGMENT];
+  // The recording being replayed in place of a spidev device, set up by vospi_init()
+  struct recording_reader* replay;
+  // A recording to write every transfer to (see recording_open_writer()), if set
+  struct recording_writer* recorder;
+  // Whether to check each packet's CRC, dropping frames containing corrupt packets
+  int verify_crc;
+  // Segment scheduling, enabled by setting schedule.enabled after vospi_init()
+  vospi_schedule_t schedule;
+  // A GPIO line event fd (see vsync_init()) to wait on before each segment, or -1 to poll
+  int vsync_fd;
+  // Whether telemetry is enabled and where it is, and so how many packets make up a segment (0 until
+  // detected from the numbering of the packets received when synchronising)
+  vospi_telemetry_t telemetry;
+  int packets_per_segment;
+  // Packets received past the end of a segment while finding out whether telemetry is enabled,
+  // which belong to whatever follows it and so are handed out first by the next transfer
+  vospi_packet_t carried_packets[VOSPI_MAX_TELEMETRY_PACKETS];
+  int carried_packet_count;
+  // Called by transfer_frame() as each valid segment of a frame is received, if set (with
+  // telemetry enabled, only once the whole frame has been received and its telemetry split off)
+  void (*segment_received)(struct vospi_device* dev, vospi_frame_t* frame, int segment);
+  // The number of frames started on, restarts included, which frames are numbered by
+  uint32_t frames_started;
+  vospi_stats_t stats;
+} vospi_device_t;
+
+int vospi_init(vospi_device_t* dev, int fd, uint32_t speed);
+const vospi_geometry_t* vospi_geometry_for_model(int lepton_version);
+int sync_and_transfer_frame(vospi_device_t* dev, vospi_frame_t* frame);
+int transfer_frame(vospi_device_t* dev, vospi_frame_t* frame);
 
 #endif /* VOSPI_H */
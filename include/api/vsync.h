@@ -0,0 +1,15 @@
+#ifndef VSYNC_H
+#define VSYNC_H
+
+#include <stdint.h>
+
+// The number of VSYNC events read from the kernel at once
+#define VSYNC_EVENT_BATCH 16
+
+/* Setup */
+int vsync_init(int chip_fd, unsigned int line);
+
+/* Waiting */
+int vsync_wait(int line_fd, uint64_t* timestamp_ns);
+
+#endif /* VSYNC_H */
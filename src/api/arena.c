@@ -0,0 +1,105 @@
+#include "arena.h"
+#include "log.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * Round a size up to a multiple of an alignment (a power of 2).
+ */
+static size_t round_up(size_t size, size_t alignment)
+{
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Get the size of an arena needed for count allocations of size bytes each.
+ */
+size_t arena_size_for(size_t size, int count)
+{
+  return round_up(size, ARENA_ALIGNMENT) * count;
+}
+
+/**
+ * Set up an arena of (at least) size bytes.
+ * Explicit huge pages are used if any are reserved, falling back to asking for transparent huge
+ * pages. The arena is locked in memory if the RLIMIT_MEMLOCK allows, and every page is faulted in
+ * up front so that nothing allocated from it ever waits on a page fault.
+ * Returns 1 on success or -1 on failure.
+ */
+int arena_init(arena_t* arena, size_t size)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  memset(arena, 0, sizeof(arena_t));
+
+  arena->size = round_up(size, ARENA_HUGE_PAGE_SIZE);
+  arena->base = mmap(
+    NULL, arena->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+  );
+  if (arena->base != MAP_FAILED) {
+    arena->huge_pages = 1;
+  } else {
+    arena->size = round_up(size, page_size);
+    arena->base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->base == MAP_FAILED) {
+      log_error("arena: failed to map %zu bytes - %s", arena->size, strerror(errno));
+      return -1;
+    }
+    arena->huge_pages = arena->size >= ARENA_HUGE_PAGE_SIZE && madvise(arena->base, arena->size, MADV_HUGEPAGE) == 0;
+  }
+
+  if (mlock(arena->base, arena->size) == 0) {
+    arena->locked = 1;
+  } else {
+    log_warn("arena: failed to lock %zu bytes in memory - check RLIMIT_MEMLOCK (%s)", arena->size, strerror(errno));
+  }
+
+  // Fault every page in now (locking may already have, but not if it failed)
+  for (size_t offset = 0; offset < arena->size; offset += page_size) {
+    ((volatile uint8_t*)arena->base)[offset] = 0;
+  }
+
+  log_info(
+    "arena: %zu KiB%s%s", arena->size / 1024,
+    arena->huge_pages ? ", huge pages" : "", arena->locked ? ", locked" : ""
+  );
+  return 1;
+}
+
+/**
+ * Seal an arena once startup is complete, so that any later allocation is caught.
+ */
+void arena_seal(arena_t* arena)
+{
+  arena->sealed = 1;
+}
+
+/**
+ * Allocate zeroed, ARENA_ALIGNMENT-aligned memory from an arena.
+ * Returns the memory, or NULL if the arena is exhausted or sealed.
+ */
+void* arena_alloc(arena_t* arena, size_t size)
+{
+  void* memory;
+
+  if (arena->sealed) {
+    log_error("arena: allocation of %zu bytes after startup", size);
+    return NULL;
+  }
+
+  size = round_up(size, ARENA_ALIGNMENT);
+  if (size > arena->size - arena->used) {
+    log_error("arena: out of space allocating %zu bytes (%zu of %zu used)", size, arena->used, arena->size);
+    return NULL;
+  }
+
+  // Mappings are page-aligned, so every allocation is aligned too
+  memory = arena->base + arena->used;
+  arena->used += size;
+  return memory;
+}
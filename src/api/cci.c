@@ -194,6 +194,53 @@ uint32_t cci_get_radiometry_tlinear_enable_state(int fd)
   return ms_word << 16 | ls_word;
 }
 
+/**
+ * Get the part number of the camera (I.e. 500-0726-01), as a null-terminated string.
+ */
+void cci_get_part_number(int fd, char part_number[CCI_PART_NUMBER_LENGTH + 1])
+{
+  WAIT_FOR_BUSY_DEASSERT()
+  cci_write_register(fd, CCI_REG_DATA_LENGTH, CCI_PART_NUMBER_LENGTH / CCI_WORD_LENGTH);
+  cci_write_register(fd, CCI_REG_COMMAND, CCI_CMD_OEM_GET_PART_NUMBER);
+  WAIT_FOR_BUSY_DEASSERT()
+
+  // Each word holds two characters, the first in the least significant byte
+  for (int i = 0; i < CCI_PART_NUMBER_LENGTH; i += CCI_WORD_LENGTH) {
+    uint16_t word = cci_read_register(fd, CCI_REG_DATA_0 + i);
+    part_number[i] = word & 0xff;
+    part_number[i + 1] = word >> 8;
+  }
+  part_number[CCI_PART_NUMBER_LENGTH] = '\0';
+}
+
+/**
+ * Change the GPIO mode - CCI_GPIO_MODE_VSYNC makes GPIO3 pulse as each segment becomes available.
+ */
+void cci_set_gpio_mode(int fd, cci_gpio_mode_t mode)
+{
+  uint32_t value = mode;
+  WAIT_FOR_BUSY_DEASSERT()
+  cci_write_register(fd, CCI_REG_DATA_0, value & 0xffff);
+  cci_write_register(fd, CCI_REG_DATA_0 + CCI_WORD_LENGTH, value >> 16 & 0xffff);
+  cci_write_register(fd, CCI_REG_COMMAND, CCI_CMD_OEM_SET_GPIO_MODE);
+  cci_write_register(fd, CCI_REG_DATA_LENGTH, 2);
+  WAIT_FOR_BUSY_DEASSERT()
+}
+
+/**
+ * Get the GPIO mode.
+ */
+uint32_t cci_get_gpio_mode(int fd)
+{
+  WAIT_FOR_BUSY_DEASSERT()
+  cci_write_register(fd, CCI_REG_DATA_LENGTH, 2);
+  cci_write_register(fd, CCI_REG_COMMAND, CCI_CMD_OEM_GET_GPIO_MODE);
+  WAIT_FOR_BUSY_DEASSERT()
+  uint16_t ls_word = cci_read_register(fd, CCI_REG_DATA_0);
+  uint16_t ms_word = cci_read_register(fd, CCI_REG_DATA_0 + CCI_WORD_LENGTH);
+  return ms_word << 16 | ls_word;
+}
+
 /**
  * Get the AGC enable state.
  */
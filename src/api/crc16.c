@@ -0,0 +1,64 @@
+#include "crc16.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Slice-by-8 tables - crc16_table[k][b] is the CRC of byte b followed by k zero bytes
+static uint16_t crc16_table[8][256];
+static int crc16_table_ready = 0;
+
+/**
+ * Build the CRC lookup tables.
+ * Must be called before crc16_ccitt(); calling it again is harmless.
+ */
+void crc16_init(void)
+{
+  if (crc16_table_ready) {
+    return;
+  }
+
+  for (int byte = 0; byte < 256; byte ++) {
+    uint16_t crc = byte << 8;
+    for (int bit = 0; bit < 8; bit ++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ CRC16_CCITT_POLY : crc << 1;
+    }
+    crc16_table[0][byte] = crc;
+  }
+
+  for (int slice = 1; slice < 8; slice ++) {
+    for (int byte = 0; byte < 256; byte ++) {
+      uint16_t prev = crc16_table[slice - 1][byte];
+      crc16_table[slice][byte] = (prev << 8) ^ crc16_table[0][prev >> 8];
+    }
+  }
+
+  crc16_table_ready = 1;
+}
+
+/**
+ * Continue a CRC-16-CCITT (MSB-first, no final XOR) calculation over a buffer.
+ * Pass 0 as the initial CRC to match the VoSPI packet CRC.
+ */
+uint16_t crc16_ccitt(uint16_t crc, const uint8_t* buf, size_t len)
+{
+  // Eight bytes at a time, folding the running CRC into the first two
+  while (len >= 8) {
+    crc = crc16_table[7][buf[0] ^ (crc >> 8)] ^
+          crc16_table[6][buf[1] ^ (crc & 0xff)] ^
+          crc16_table[5][buf[2]] ^
+          crc16_table[4][buf[3]] ^
+          crc16_table[3][buf[4]] ^
+          crc16_table[2][buf[5]] ^
+          crc16_table[1][buf[6]] ^
+          crc16_table[0][buf[7]];
+    buf += 8;
+    len -= 8;
+  }
+
+  // Then whatever remains a byte at a time
+  while (len--) {
+    crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *buf++];
+  }
+
+  return crc;
+}
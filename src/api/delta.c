@@ -0,0 +1,333 @@
+#include "delta.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Each pixel is predicted (from the same pixel of the base frame in a difference, or from the pixel
+ * to its left, or above at the start of a row, in a keyframe), and the residuals are zigzagged so
+ * that small differences either way are small numbers. Thermal frames change very little between
+ * frames, so most residuals are zero or tiny, and they're coded a byte (or less) at a time:
+ *
+ *   0x00-0x3f                 one residual of 0-63
+ *   0x40-0x7f, 1 byte         one residual of 64-16447 (64 plus 14 bits, high bits first)
+ *   0x80-0xbf                 two residuals of 0-7 (3 bits each, first in the high bits)
+ *   0xc0-0xdf                 a run of 2-33 zero residuals
+ *   0xe0-0xfe, 1 byte         a run of 34-7969 zero residuals (34 plus 13 bits, high bits first)
+ *   0xff, 2 bytes             one residual of any value (little-endian)
+ */
+
+#define TOKEN_SMALL_MAX 0x3f
+#define TOKEN_MEDIUM 0x40
+#define TOKEN_MEDIUM_MAX (64 + 0x3fff)
+#define TOKEN_PAIR 0x80
+#define TOKEN_PAIR_MAX 7
+#define TOKEN_RUN 0xc0
+#define TOKEN_RUN_MIN 2
+#define TOKEN_RUN_MAX 33
+#define TOKEN_LONG_RUN 0xe0
+#define TOKEN_LONG_RUN_MAX (34 + 30 * 256 + 255)
+#define TOKEN_LITERAL 0xff
+
+/**
+ * Map a signed difference to an unsigned one, interleaving positive and negative values.
+ */
+static inline uint16_t zigzag(uint16_t difference)
+{
+  return (uint16_t)(difference << 1) ^ (uint16_t)-(difference >> 15);
+}
+
+/**
+ * Map a zigzagged difference back to the (wrapping) difference.
+ */
+static inline uint16_t unzigzag(uint16_t residual)
+{
+  return (residual >> 1) ^ (uint16_t)-(residual & 1);
+}
+
+/**
+ * Work out the residuals of a frame: the zigzagged difference of each pixel from the same pixel
+ * of the base frame, or for a keyframe (base NULL) from the pixel to its left, or above it at the
+ * start of a row.
+ */
+static void compute_residuals(const uint16_t* pixels, const uint16_t* base, int width, int height,
+  uint16_t* residuals)
+{
+  int count = width * height;
+
+  if (base != NULL) {
+    for (int i = 0; i < count; i ++) {
+      residuals[i] = zigzag(pixels[i] - base[i]);
+    }
+    return;
+  }
+
+  for (int row = 0; row < height; row ++) {
+    const uint16_t* line = pixels + row * width;
+    residuals[row * width] = zigzag(line[0] - (row > 0 ? line[-width] : 0));
+    for (int x = 1; x < width; x ++) {
+      residuals[row * width + x] = zigzag(line[x] - line[x - 1]);
+    }
+  }
+}
+
+/**
+ * Rebuild a frame from its residuals, the inverse of compute_residuals(). A difference is applied
+ * to the base frame in place.
+ */
+static void apply_residuals(const uint16_t* residuals, int keyframe, int width, int height, uint16_t* pixels)
+{
+  int count = width * height;
+
+  if (!keyframe) {
+    for (int i = 0; i < count; i ++) {
+      pixels[i] += unzigzag(residuals[i]);
+    }
+    return;
+  }
+
+  for (int row = 0; row < height; row ++) {
+    uint16_t* line = pixels + row * width;
+    line[0] = (row > 0 ? line[-width] : 0) + unzigzag(residuals[row * width]);
+    for (int x = 1; x < width; x ++) {
+      line[x] = line[x - 1] + unzigzag(residuals[row * width + x]);
+    }
+  }
+}
+
+/**
+ * Code residuals into out.
+ * Returns the number of bytes written.
+ */
+static size_t encode_residuals(const uint16_t* residuals, int count, uint8_t* out)
+{
+  uint8_t* start = out;
+  int i = 0;
+
+  while (i < count) {
+    uint16_t value = residuals[i];
+
+    if (value == 0) {
+      int run = 1;
+      while (i + run < count && run < TOKEN_LONG_RUN_MAX && residuals[i + run] == 0) {
+        run ++;
+      }
+      if (run > TOKEN_RUN_MAX) {
+        *out ++ = TOKEN_LONG_RUN | (run - 34) >> 8;
+        *out ++ = (run - 34) & 0xff;
+        i += run;
+        continue;
+      }
+      if (run >= TOKEN_RUN_MIN) {
+        *out ++ = TOKEN_RUN | (run - TOKEN_RUN_MIN);
+        i += run;
+        continue;
+      }
+    }
+
+    if (value <= TOKEN_PAIR_MAX && i + 1 < count && residuals[i + 1] <= TOKEN_PAIR_MAX) {
+      *out ++ = TOKEN_PAIR | value << 3 | residuals[i + 1];
+      i += 2;
+      continue;
+    }
+
+    if (value <= TOKEN_SMALL_MAX) {
+      *out ++ = value;
+    } else if (value <= TOKEN_MEDIUM_MAX) {
+      *out ++ = TOKEN_MEDIUM | (value - 64) >> 8;
+      *out ++ = (value - 64) & 0xff;
+    } else {
+      *out ++ = TOKEN_LITERAL;
+      *out ++ = value & 0xff;
+      *out ++ = value >> 8;
+    }
+    i ++;
+  }
+
+  return out - start;
+}
+
+/**
+ * Decode coded residuals, which must fill residuals exactly.
+ * Returns 1 on success or -1 if they're malformed.
+ */
+static int decode_residuals(const uint8_t* data, const uint8_t* end, int count, uint16_t* residuals)
+{
+  int i = 0;
+
+  while (data < end && i < count) {
+    uint8_t token = *data ++;
+    int run;
+
+    if (token == TOKEN_LITERAL) {
+      if (end - data < 2) {
+        return -1;
+      }
+      residuals[i ++] = data[0] | data[1] << 8;
+      data += 2;
+    } else if (token >= TOKEN_RUN) {
+      if (token >= TOKEN_LONG_RUN) {
+        if (data == end) {
+          return -1;
+        }
+        run = 34 + ((token & 0x1f) << 8 | *data ++);
+      } else {
+        run = TOKEN_RUN_MIN + (token & 0x1f);
+      }
+      if (i + run > count) {
+        return -1;
+      }
+      memset(residuals + i, 0, run * sizeof(uint16_t));
+      i += run;
+    } else if (token >= TOKEN_PAIR) {
+      if (i + 2 > count) {
+        return -1;
+      }
+      residuals[i ++] = token >> 3 & 7;
+      residuals[i ++] = token & 7;
+    } else if (token >= TOKEN_MEDIUM) {
+      if (data == end) {
+        return -1;
+      }
+      residuals[i ++] = 64 + ((token & 0x3f) << 8 | *data ++);
+    } else {
+      residuals[i ++] = token;
+    }
+  }
+
+  return i == count && data == end ? 1 : -1;
+}
+
+/**
+ * Set up an encoder for frames of width x height pixels.
+ * The previous buffer (width x height pixels) holds the frame encoded last, and the residuals buffer
+ * (as large) each frame's residuals while it's encoded; both are owned by the caller.
+ * Returns 1 on success or -1 on failure.
+ */
+int delta_encoder_init(delta_encoder_t* encoder, uint16_t width, uint16_t height, int keyframe_interval,
+  uint16_t* previous, uint16_t* residuals)
+{
+  if (width * height > DELTA_MAX_PIXELS) {
+    log_error("delta: frames of at most %d pixels can be encoded", DELTA_MAX_PIXELS);
+    return -1;
+  }
+
+  memset(encoder, 0, sizeof(delta_encoder_t));
+  encoder->width = width;
+  encoder->height = height;
+  encoder->keyframe_interval = keyframe_interval;
+  encoder->previous = previous;
+  encoder->residuals = residuals;
+  return 1;
+}
+
+/**
+ * Have the next frame encoded as a keyframe, I.e. for a client that's joined or lost its place.
+ */
+void delta_request_keyframe(delta_encoder_t* encoder)
+{
+  encoder->keyframe_requested = 1;
+}
+
+/**
+ * Encode a frame into out, which must have room for DELTA_MAX_ENCODED_SIZE(width, height) bytes.
+ * The frame is encoded as the difference from the frame encoded last unless a keyframe is due.
+ * Returns the size of the encoded frame.
+ */
+size_t delta_encode(delta_encoder_t* encoder, const uint16_t* pixels, uint32_t sequence, uint8_t* out)
+{
+  delta_header_t* header = (delta_header_t*)out;
+  uint16_t* residuals = encoder->residuals;
+  int count = encoder->width * encoder->height;
+  int keyframe = !encoder->has_previous || encoder->keyframe_requested ||
+    (encoder->keyframe_interval > 0 && encoder->since_keyframe >= encoder->keyframe_interval);
+  size_t size;
+
+  header->version = DELTA_VERSION;
+  header->type = keyframe ? DELTA_KEYFRAME : DELTA_DIFFERENCE;
+  header->width = htole16(encoder->width);
+  header->height = htole16(encoder->height);
+  header->reserved = 0;
+  header->sequence = htole32(sequence);
+  header->base_sequence = htole32(keyframe ? 0 : encoder->previous_sequence);
+
+  compute_residuals(pixels, keyframe ? NULL : encoder->previous, encoder->width, encoder->height, residuals);
+  size = encode_residuals(residuals, count, out + sizeof(delta_header_t));
+  if (keyframe) {
+    encoder->keyframes ++;
+    encoder->since_keyframe = 0;
+    encoder->keyframe_requested = 0;
+  } else {
+    encoder->differences ++;
+    encoder->since_keyframe ++;
+  }
+
+  memcpy(encoder->previous, pixels, count * sizeof(uint16_t));
+  encoder->previous_sequence = sequence;
+  encoder->has_previous = 1;
+
+  size += sizeof(delta_header_t);
+  encoder->bytes_in += count * sizeof(uint16_t);
+  encoder->bytes_out += size;
+  return size;
+}
+
+/**
+ * Set up a decoder for frames of width x height pixels.
+ * The pixels buffer (width x height pixels) holds the frame decoded last, and the residuals buffer
+ * (as large) each frame's residuals while it's decoded; both are owned by the caller.
+ * Returns 1 on success or -1 on failure.
+ */
+int delta_decoder_init(delta_decoder_t* decoder, uint16_t width, uint16_t height, uint16_t* pixels,
+  uint16_t* residuals)
+{
+  if (width * height > DELTA_MAX_PIXELS) {
+    log_error("delta: frames of at most %d pixels can be decoded", DELTA_MAX_PIXELS);
+    return -1;
+  }
+
+  memset(decoder, 0, sizeof(delta_decoder_t));
+  decoder->width = width;
+  decoder->height = height;
+  decoder->pixels = pixels;
+  decoder->residuals = residuals;
+  return 1;
+}
+
+/**
+ * Decode an encoded frame into the decoder's pixels.
+ * Returns 1 on success, 0 if the frame is a difference from a frame other than the one decoded last
+ * (so a keyframe is needed), or -1 if the frame is malformed.
+ */
+int delta_decode(delta_decoder_t* decoder, const uint8_t* data, size_t size)
+{
+  const delta_header_t* header = (const delta_header_t*)data;
+  uint16_t* residuals = decoder->residuals;
+  int count = decoder->width * decoder->height;
+  int keyframe;
+
+  if (size < sizeof(delta_header_t) || header->version != DELTA_VERSION ||
+      le16toh(header->width) != decoder->width || le16toh(header->height) != decoder->height) {
+    log_error("delta: unsupported or mismatched frame");
+    return -1;
+  }
+
+  keyframe = header->type == DELTA_KEYFRAME;
+  if (!keyframe && (!decoder->has_frame || le32toh(header->base_sequence) != decoder->sequence)) {
+    return 0;
+  }
+
+  // Residuals are decoded in full before they're applied, so a malformed frame leaves the last intact
+  if (decode_residuals(data + sizeof(delta_header_t), data + size, count, residuals) == -1) {
+    log_error("delta: malformed frame %u", le32toh(header->sequence));
+    return -1;
+  }
+  apply_residuals(residuals, keyframe, decoder->width, decoder->height, decoder->pixels);
+
+  decoder->sequence = le32toh(header->sequence);
+  decoder->has_frame = 1;
+  return 1;
+}
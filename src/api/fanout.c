@@ -0,0 +1,383 @@
+#include "fanout.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+
+// Positions pack the sequence number published into them with the slot's index
+#define POSITION(sequence, slot) ((uint64_t)(sequence) << 32 | (uint32_t)(slot))
+#define POSITION_SEQUENCE(position) ((uint32_t)((position) >> 32))
+#define POSITION_SLOT(position) ((int)((position) & 0xffffffff))
+
+/**
+ * Sleep until the value at addr is no longer expected (or a spurious wakeup).
+ */
+static void futex_wait(_Atomic uint32_t* addr, uint32_t expected)
+{
+  syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+/**
+ * Wake every thread sleeping on addr.
+ */
+static void futex_wake(_Atomic uint32_t* addr)
+{
+  syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Find a slot nothing refers to and claim it for the producer.
+ * There are enough slots that one is always free, bar consumers' brief speculative references.
+ */
+static int claim_free_slot(fanout_t* fanout)
+{
+  uint32_t free = 0;
+
+  while (1) {
+    for (int slot = 0; slot < fanout->slot_count; slot ++) {
+      if (atomic_load_explicit(&fanout->refs[slot], memory_order_relaxed) == 0 &&
+          atomic_compare_exchange_strong(&fanout->refs[slot], &free, 1)) {
+        return slot;
+      }
+      free = 0;
+    }
+  }
+}
+
+/**
+ * Initialise a fan-out of capacity positions, for up to max_consumers consumers retaining up to
+ * max_retained slots between them, allocating every slot it will ever use up front.
+ * Returns 1 on success or -1 on failure.
+ */
+int fanout_init(fanout_t* fanout, int capacity, int max_consumers, int max_retained, void* (*allocate)())
+{
+  if (capacity < 1 || capacity > RING_MAX_CAPACITY || (capacity & (capacity - 1)) != 0) {
+    log_error("fanout: capacity must be a power of 2 no larger than %d", RING_MAX_CAPACITY);
+    return -1;
+  }
+  if (max_consumers < 1 || max_consumers > FANOUT_MAX_CONSUMERS) {
+    log_error("fanout: at most %d consumers are supported", FANOUT_MAX_CONSUMERS);
+    return -1;
+  }
+  if (max_retained < 0 || max_retained > FANOUT_MAX_RETAINED) {
+    log_error("fanout: at most %d slots can be retained", FANOUT_MAX_RETAINED);
+    return -1;
+  }
+
+  fanout->capacity = capacity;
+  fanout->slot_count = FANOUT_SLOTS(capacity, max_consumers, max_retained);
+  fanout->max_retained = max_retained;
+  atomic_init(&fanout->retained, 0);
+  atomic_init(&fanout->head, 0);
+  atomic_init(&fanout->consumers_waiting, 0);
+  atomic_init(&fanout->producer_waiting, 0);
+  atomic_init(&fanout->consumer_count, 0);
+
+  for (int position = 0; position < capacity; position ++) {
+    atomic_init(&fanout->positions[position], POSITION(0, 0));
+  }
+  for (int slot = 0; slot < fanout->slot_count; slot ++) {
+    atomic_init(&fanout->refs[slot], 0);
+    fanout->slots[slot] = allocate();
+  }
+
+  fanout->producing = claim_free_slot(fanout);
+  return 1;
+}
+
+/**
+ * Find the policy with the given name ("latest", "in-order" or "block").
+ * Returns 1 on success, or -1 if there's no such policy.
+ */
+int fanout_policy_for_name(const char* name, fanout_policy_t* policy)
+{
+  if (strcmp(name, "latest") == 0) {
+    *policy = FANOUT_LATEST;
+  } else if (strcmp(name, "in-order") == 0) {
+    *policy = FANOUT_IN_ORDER;
+  } else if (strcmp(name, "block") == 0) {
+    *policy = FANOUT_BLOCK;
+  } else {
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * Add a consumer to a fan-out, which will read slots published from now on.
+ * May be called while the producer is running, but not concurrently with other calls to add.
+ * Returns the consumer, or NULL if there are too many.
+ */
+fanout_consumer_t* fanout_add_consumer(fanout_t* fanout, fanout_policy_t policy)
+{
+  int count = atomic_load(&fanout->consumer_count);
+  fanout_consumer_t* consumer;
+
+  if (count == FANOUT_MAX_CONSUMERS ||
+      FANOUT_SLOTS(fanout->capacity, count + 1, fanout->max_retained) > fanout->slot_count) {
+    log_error("fanout: too many consumers");
+    return NULL;
+  }
+
+  consumer = &fanout->consumers[count];
+  atomic_init(&consumer->cursor, atomic_load(&fanout->head) + 1);
+  atomic_init(&consumer->received, 0);
+  atomic_init(&consumer->dropped, 0);
+  atomic_init(&consumer->armed, 0);
+  atomic_init(&consumer->event_fd, -1);
+  consumer->policy = policy;
+  consumer->held = -1;
+  consumer->fanout = fanout;
+
+  // Publish the consumer only once it's ready, for the producer to check if it's blocking
+  atomic_store(&fanout->consumer_count, count + 1);
+  return consumer;
+}
+
+/**
+ * Get the slot the producer is to fill first.
+ */
+void* fanout_producer_slot(fanout_t* fanout)
+{
+  return fanout->slots[fanout->producing];
+}
+
+/**
+ * Wait until no blocking consumer has yet to read the given sequence number.
+ */
+static void wait_for_blocking_consumers(fanout_t* fanout, uint32_t sequence)
+{
+  int count = atomic_load_explicit(&fanout->consumer_count, memory_order_acquire);
+
+  for (int i = 0; i < count; i ++) {
+    fanout_consumer_t* consumer = &fanout->consumers[i];
+    uint32_t cursor;
+
+    if (consumer->policy != FANOUT_BLOCK) {
+      continue;
+    }
+
+    while ((int32_t)((cursor = atomic_load(&consumer->cursor)) - sequence) <= 0) {
+      atomic_store(&fanout->producer_waiting, 1);
+      if (atomic_load(&consumer->cursor) == cursor) {
+        futex_wait(&consumer->cursor, cursor);
+      }
+      atomic_store(&fanout->producer_waiting, 0);
+    }
+  }
+}
+
+/**
+ * Notify consumers waiting in event loops that there's something new, once per batch.
+ */
+static void notify_consumers(fanout_t* fanout)
+{
+  int count = atomic_load_explicit(&fanout->consumer_count, memory_order_acquire);
+  uint64_t one = 1;
+
+  for (int i = 0; i < count; i ++) {
+    fanout_consumer_t* consumer = &fanout->consumers[i];
+    int event_fd = atomic_load_explicit(&consumer->event_fd, memory_order_relaxed);
+    if (event_fd >= 0 && atomic_load(&consumer->armed) && atomic_exchange(&consumer->armed, 0)) {
+      if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+        log_warn("fanout: failed to notify consumer %d", i);
+      }
+    }
+  }
+}
+
+/**
+ * Publish the slot the producer has filled to every consumer.
+ * The oldest slot is dropped from the fan-out to make room, though consumers still reading it keep
+ * it. Only waits if a blocking consumer hasn't yet read the slot being dropped.
+ * Returns a free slot for the producer to fill next.
+ */
+void* fanout_publish(fanout_t* fanout)
+{
+  uint32_t sequence = atomic_load_explicit(&fanout->head, memory_order_relaxed) + 1;
+  _Atomic uint64_t* position = &fanout->positions[sequence & (fanout->capacity - 1)];
+  uint64_t dropped = atomic_load(position);
+
+  if (POSITION_SEQUENCE(dropped) != 0) {
+    wait_for_blocking_consumers(fanout, POSITION_SEQUENCE(dropped));
+  }
+
+  // Replace the position before letting go of the slot it held, so that a consumer that manages to
+  // take a reference to the dropped slot will see it's gone
+  atomic_store(position, POSITION(sequence, fanout->producing));
+  if (POSITION_SEQUENCE(dropped) != 0) {
+    atomic_fetch_sub(&fanout->refs[POSITION_SLOT(dropped)], 1);
+  }
+  atomic_store(&fanout->head, sequence);
+
+  // Only make a system call if a consumer is asleep, or has asked to be notified
+  if (atomic_load(&fanout->consumers_waiting) > 0) {
+    futex_wake(&fanout->head);
+  }
+  notify_consumers(fanout);
+
+  fanout->producing = claim_free_slot(fanout);
+  return fanout->slots[fanout->producing];
+}
+
+/**
+ * Take a reference to the next slot for a consumer, releasing the slot it read last.
+ * Which slot is next depends on the consumer's policy; any it skips are counted as dropped.
+ * If there's nothing new, either sleeps (on a futex) until there is, or arms the consumer's
+ * notification and gives up.
+ * Returns the slot, or NULL if not waiting and there's nothing new.
+ */
+static void* take_next_slot(fanout_consumer_t* consumer, int wait)
+{
+  fanout_t* fanout = consumer->fanout;
+  uint32_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+  uint32_t head, oldest;
+  uint64_t position;
+  int slot;
+
+  while (1) {
+    head = atomic_load(&fanout->head);
+
+    if ((int32_t)(cursor - head) > 0) {
+      if (!wait) {
+        // Ask to be notified of the next slot, then check again in case it was published meanwhile
+        if (atomic_load(&consumer->armed)) {
+          return NULL;
+        }
+        atomic_store(&consumer->armed, 1);
+        continue;
+      }
+
+      // Sleep until something new is published; the futex only sleeps if the head hasn't moved
+      atomic_fetch_add(&fanout->consumers_waiting, 1);
+      futex_wait(&fanout->head, head);
+      atomic_fetch_sub(&fanout->consumers_waiting, 1);
+      continue;
+    }
+
+    // Catch up if lapped, or skip straight to the newest slot
+    oldest = head >= fanout->capacity ? head - fanout->capacity + 1 : 1;
+    if ((int32_t)(cursor - oldest) < 0) {
+      atomic_fetch_add_explicit(&consumer->dropped, oldest - cursor, memory_order_relaxed);
+      cursor = oldest;
+    }
+    if (consumer->policy == FANOUT_LATEST && cursor != head) {
+      atomic_fetch_add_explicit(&consumer->dropped, head - cursor, memory_order_relaxed);
+      cursor = head;
+    }
+
+    // Take a reference to the slot, and keep it only if it's still in place afterwards
+    position = atomic_load(&fanout->positions[cursor & (fanout->capacity - 1)]);
+    if (POSITION_SEQUENCE(position) != cursor) {
+      continue;
+    }
+    slot = POSITION_SLOT(position);
+    atomic_fetch_add(&fanout->refs[slot], 1);
+    if (atomic_load(&fanout->positions[cursor & (fanout->capacity - 1)]) == position) {
+      break;
+    }
+    atomic_fetch_sub(&fanout->refs[slot], 1);
+  }
+
+  if (consumer->held >= 0) {
+    atomic_fetch_sub(&fanout->refs[consumer->held], 1);
+  }
+  consumer->held = slot;
+  atomic_fetch_add_explicit(&consumer->received, 1, memory_order_relaxed);
+  atomic_store(&consumer->cursor, cursor + 1);
+
+  // Let the producer go if it's waiting for this consumer
+  if (consumer->policy == FANOUT_BLOCK && atomic_load(&fanout->producer_waiting)) {
+    futex_wake(&consumer->cursor);
+  }
+
+  return fanout->slots[slot];
+}
+
+/**
+ * Wait for the next slot for a consumer and take a reference to it, releasing the slot it read
+ * last. Only sleeps (on a futex) if there's nothing new.
+ */
+void* fanout_acquire(fanout_consumer_t* consumer)
+{
+  return take_next_slot(consumer, 1);
+}
+
+/**
+ * Take the next slot for a consumer if there is one, releasing the slot it read last; otherwise
+ * keep the slot it read last. Never waits.
+ * Once this returns NULL, the consumer's event fd is notified when there's something new.
+ * Returns the slot, or NULL if there's nothing new.
+ */
+void* fanout_try_acquire(fanout_consumer_t* consumer)
+{
+  return take_next_slot(consumer, 0);
+}
+
+/**
+ * Get an eventfd that becomes readable when there's something new for a consumer, so that it can
+ * wait for slots in an event loop (I.e. with epoll) rather than a thread of its own.
+ * Notifications are edge-triggered and batched: the producer only writes to the eventfd once
+ * fanout_try_acquire() has returned NULL, so a consumer should read the eventfd (or use EPOLLET)
+ * and then take slots until there are none left each time it's woken.
+ * Returns the eventfd, or -1 on failure.
+ */
+int fanout_consumer_event_fd(fanout_consumer_t* consumer)
+{
+  int event_fd = atomic_load(&consumer->event_fd);
+
+  if (event_fd < 0) {
+    if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      log_error("fanout: failed to create eventfd - %s", strerror(errno));
+      return -1;
+    }
+    atomic_store(&consumer->event_fd, event_fd);
+  }
+
+  return event_fd;
+}
+
+/**
+ * Take an extra reference to the slot a consumer is reading, so that it's kept after the consumer
+ * moves on until released with fanout_release() (from any thread). This lets a slot be handed to
+ * something that finishes with it later, such as a zero-copy send, without copying it.
+ * Returns the slot, or NULL if the consumer isn't reading one or the fan-out's consumers already
+ * retain as many slots as they're allowed.
+ */
+void* fanout_retain(fanout_consumer_t* consumer)
+{
+  fanout_t* fanout = consumer->fanout;
+
+  if (consumer->held < 0) {
+    return NULL;
+  }
+  if (atomic_fetch_add(&fanout->retained, 1) >= fanout->max_retained) {
+    atomic_fetch_sub(&fanout->retained, 1);
+    return NULL;
+  }
+
+  atomic_fetch_add(&fanout->refs[consumer->held], 1);
+  return fanout->slots[consumer->held];
+}
+
+/**
+ * Release a slot retained with fanout_retain(). May be called from any thread.
+ */
+void fanout_release(fanout_t* fanout, void* slot)
+{
+  for (int i = 0; i < fanout->slot_count; i ++) {
+    if (fanout->slots[i] == slot) {
+      atomic_fetch_sub(&fanout->refs[i], 1);
+      atomic_fetch_sub(&fanout->retained, 1);
+      return;
+    }
+  }
+  log_error("fanout: released a slot that isn't part of the fan-out");
+}
@@ -0,0 +1,753 @@
+#define _GNU_SOURCE
+
+#include "http.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * Everything happens on the thread that calls http_server_handle(), driven by an epoll set of the
+ * listening socket and every client's socket, all non-blocking. Frames are written straight to
+ * each client's socket from the caller's buffer; only what a socket won't take at once is copied,
+ * into the client's queue, and sent as the socket drains. Files are sent with sendfile().
+ * Writing to a client that's gone raises SIGPIPE, which the process should ignore.
+ */
+
+// The epoll data of the listening socket (clients are identified by their index)
+#define LISTENER HTTP_MAX_CLIENTS
+
+// The number of epoll events handled at once
+#define MAX_EVENTS 16
+
+// The GUID a WebSocket handshake's key is hashed with (RFC 6455)
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// WebSocket opcodes
+#define WEBSOCKET_TEXT 0x1
+#define WEBSOCKET_BINARY 0x2
+#define WEBSOCKET_CLOSE 0x8
+#define WEBSOCKET_PING 0x9
+#define WEBSOCKET_PONG 0xa
+
+// The boundary between the parts of an MJPEG stream
+#define MJPEG_BOUNDARY "frame"
+
+// The content types of the files served, by extension
+static const struct {
+  const char* extension;
+  const char* content_type;
+} content_types[] = {
+  {".html", "text/html; charset=utf-8"},
+  {".js", "application/javascript"},
+  {".css", "text/css"},
+  {".json", "application/json"},
+  {".png", "image/png"},
+  {".svg", "image/svg+xml"},
+  {".ico", "image/x-icon"},
+};
+
+/**
+ * Rotate a 32-bit value left.
+ */
+static inline uint32_t rotate_left(uint32_t value, int bits)
+{
+  return value << bits | value >> (32 - bits);
+}
+
+/**
+ * Hash data with SHA-1, as the WebSocket handshake needs (and for nothing else).
+ */
+static void sha1(const uint8_t* data, size_t size, uint8_t digest[20])
+{
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  uint8_t block[64];
+  uint64_t bits = (uint64_t)size * 8;
+  size_t blocks = (size + 8) / 64 + 1;
+
+  for (size_t b = 0; b < blocks; b ++) {
+    uint32_t w[80], a, bb, c, d, e;
+
+    // The last block (or two) ends with a 1 bit, padding and the length in bits
+    for (int i = 0; i < 64; i ++) {
+      size_t offset = b * 64 + i;
+      block[i] = offset < size ? data[offset] : offset == size ? 0x80 : 0;
+    }
+    if (b == blocks - 1) {
+      for (int i = 0; i < 8; i ++) {
+        block[63 - i] = bits >> (i * 8);
+      }
+    }
+
+    for (int i = 0; i < 16; i ++) {
+      w[i] = block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i ++) {
+      w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i ++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (bb & c) | (~bb & d), k = 0x5a827999;
+      } else if (i < 40) {
+        f = bb ^ c ^ d, k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (bb & c) | (bb & d) | (c & d), k = 0x8f1bbcdc;
+      } else {
+        f = bb ^ c ^ d, k = 0xca62c1d6;
+      }
+      uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+      e = d, d = c, c = rotate_left(bb, 30), bb = a, a = temp;
+    }
+    h[0] += a, h[1] += bb, h[2] += c, h[3] += d, h[4] += e;
+  }
+
+  for (int i = 0; i < 20; i ++) {
+    digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+  }
+}
+
+/**
+ * Encode data as (padded) base64 into out, which must have room for 4 * ((size + 2) / 3) + 1 chars.
+ */
+static void base64_encode(const uint8_t* data, size_t size, char* out)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t group = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0) | (i + 2 < size ? data[i + 2] : 0);
+    *out ++ = alphabet[group >> 18 & 0x3f];
+    *out ++ = alphabet[group >> 12 & 0x3f];
+    *out ++ = i + 1 < size ? alphabet[group >> 6 & 0x3f] : '=';
+    *out ++ = i + 2 < size ? alphabet[group & 0x3f] : '=';
+  }
+  *out = '\0';
+}
+
+/**
+ * Find the value of a header in a request (the name matched without regard to case).
+ * Returns 1 if found, or 0 if not.
+ */
+static int find_header(const char* request, const char* name, char* value, size_t value_size)
+{
+  size_t name_length = strlen(name);
+
+  for (const char* line = strstr(request, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+    line += 2;
+    if (strncasecmp(line, name, name_length) == 0 && line[name_length] == ':') {
+      const char* start = line + name_length + 1;
+      while (*start == ' ') {
+        start ++;
+      }
+      size_t length = strcspn(start, "\r\n");
+      if (length >= value_size) {
+        return 0;
+      }
+      memcpy(value, start, length);
+      value[length] = '\0';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Find the content type of a file from its extension.
+ */
+static const char* content_type_for(const char* path)
+{
+  const char* extension = strrchr(path, '.');
+
+  for (int i = 0; extension != NULL && i < sizeof(content_types) / sizeof(content_types[0]); i ++) {
+    if (strcmp(extension, content_types[i].extension) == 0) {
+      return content_types[i].content_type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+/**
+ * Disconnect a client, freeing its place.
+ */
+static void close_client(http_server_t* server, http_client_t* client)
+{
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+  close(client->fd);
+  if (client->file_fd >= 0) {
+    close(client->file_fd);
+  }
+  client->fd = -1;
+  client->file_fd = -1;
+  client->state = HTTP_CLIENT_FREE;
+}
+
+/**
+ * Wait (or stop waiting) for a client's socket to take more output.
+ */
+static void wait_to_write(http_server_t* server, http_client_t* client, int waiting)
+{
+  struct epoll_event event = { .events = EPOLLIN | (waiting ? EPOLLOUT : 0), .data.u32 = client - server->clients };
+
+  if (client->waiting_to_write != waiting) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+    client->waiting_to_write = waiting;
+  }
+}
+
+/**
+ * Send as much of a client's queued output (then the rest of any file) as its socket will take.
+ * A client sent a response is disconnected once it's all been sent.
+ * Returns 1 if everything's been sent, 0 if there's more to send, or -1 if the client's gone.
+ */
+static int flush_client(http_server_t* server, http_client_t* client)
+{
+  ssize_t sent;
+
+  while (client->queue_start < client->queue_end) {
+    sent = send(client->fd, client->queue + client->queue_start, client->queue_end - client->queue_start,
+      MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        wait_to_write(server, client, 1);
+        return 0;
+      }
+      close_client(server, client);
+      return -1;
+    }
+    client->queue_start += sent;
+  }
+  client->queue_start = client->queue_end = 0;
+
+  while (client->file_fd >= 0 && client->file_offset < client->file_size) {
+    sent = sendfile(client->fd, client->file_fd, &client->file_offset, client->file_size - client->file_offset);
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      wait_to_write(server, client, 1);
+      return 0;
+    }
+    if (sent <= 0) {
+      close_client(server, client);
+      return -1;
+    }
+  }
+
+  if (client->state == HTTP_CLIENT_RESPONSE) {
+    close_client(server, client);
+    return -1;
+  }
+  wait_to_write(server, client, 0);
+  return 1;
+}
+
+/**
+ * Send output to a client: straight to its socket if nothing's waiting to go before it, queueing
+ * whatever the socket won't take at once.
+ * Returns 1 on success, 0 if there isn't room to queue it all (so none of it's sent), or -1 if the
+ * client's gone.
+ */
+static int send_output(http_server_t* server, http_client_t* client, struct iovec* iov, int count)
+{
+  size_t total = 0, sent = 0;
+  ssize_t written;
+
+  for (int i = 0; i < count; i ++) {
+    total += iov[i].iov_len;
+  }
+  if (total > HTTP_QUEUE_SIZE - client->queue_end) {
+    return 0;
+  }
+
+  if (client->queue_start == client->queue_end) {
+    struct msghdr message = { .msg_iov = iov, .msg_iovlen = count };
+    if ((written = sendmsg(client->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_client(server, client);
+        return -1;
+      }
+      written = 0;
+    }
+    sent = written;
+  }
+
+  // Queue the rest
+  for (int i = 0; i < count; i ++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+    memcpy(client->queue + client->queue_end, (uint8_t*)iov[i].iov_base + sent, iov[i].iov_len - sent);
+    client->queue_end += iov[i].iov_len - sent;
+    sent = 0;
+  }
+
+  if (client->queue_start < client->queue_end) {
+    wait_to_write(server, client, 1);
+  }
+  return 1;
+}
+
+/**
+ * Send a response of headers alone to a client, then disconnect it once sent.
+ */
+static void respond(http_server_t* server, http_client_t* client, const char* status)
+{
+  char headers[128];
+  struct iovec iov = { .iov_base = headers };
+
+  iov.iov_len = snprintf(headers, sizeof(headers), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+  client->state = HTTP_CLIENT_RESPONSE;
+  if (send_output(server, client, &iov, 1) == 1) {
+    flush_client(server, client);
+  }
+}
+
+/**
+ * Find the channel at the end of a stream's path (I.e. "/stream/1"), if it's one of the server's.
+ * Returns the channel, or -1 if there's no such channel.
+ */
+static int channel_for_path(http_server_t* server, const char* path)
+{
+  char* end;
+  long channel = strtol(path, &end, 10);
+
+  return end != path && *end == '\0' && channel >= 0 && channel < server->channel_count ? channel : -1;
+}
+
+/**
+ * Start streaming to a client that's asked to upgrade to a WebSocket, completing the handshake.
+ */
+static void start_websocket(http_server_t* server, http_client_t* client, int channel)
+{
+  char key[64], accept_key[64], headers[256];
+  uint8_t digest[20];
+  struct iovec iov = { .iov_base = headers };
+
+  if (!find_header(client->input, "Sec-WebSocket-Key", key, sizeof(key) - sizeof(WEBSOCKET_GUID))) {
+    respond(server, client, "400 Bad Request");
+    return;
+  }
+  strcat(key, WEBSOCKET_GUID);
+  sha1((uint8_t*)key, strlen(key), digest);
+  base64_encode(digest, sizeof(digest), accept_key);
+
+  iov.iov_len = snprintf(
+    headers, sizeof(headers),
+    "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+    accept_key
+  );
+  client->state = HTTP_CLIENT_STREAMING;
+  client->stream = HTTP_STREAM_WEBSOCKET;
+  client->channel = channel;
+  client->needs_keyframe = 1;
+  send_output(server, client, &iov, 1);
+}
+
+/**
+ * Start streaming JPEGs to a client, as the parts of a never-ending multipart response.
+ */
+static void start_mjpeg(http_server_t* server, http_client_t* client, int channel)
+{
+  static const char headers[] =
+    "HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+    "Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+  struct iovec iov = { .iov_base = (void*)headers, .iov_len = sizeof(headers) - 1 };
+
+  client->state = HTTP_CLIENT_STREAMING;
+  client->stream = HTTP_STREAM_MJPEG;
+  client->channel = channel;
+  send_output(server, client, &iov, 1);
+}
+
+/**
+ * Send a client a file from the server's root.
+ */
+static void send_file(http_server_t* server, http_client_t* client, const char* url_path)
+{
+  char path[1024], headers[256];
+  struct stat st;
+  struct iovec iov = { .iov_base = headers };
+
+  // Nothing outside the root is served
+  if (strstr(url_path, "..") != NULL) {
+    respond(server, client, "403 Forbidden");
+    return;
+  }
+  snprintf(path, sizeof(path), "%s%s%s", server->root, url_path, url_path[strlen(url_path) - 1] == '/' ? "index.html" : "");
+  if ((client->file_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(client->file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    if (client->file_fd >= 0) {
+      close(client->file_fd);
+      client->file_fd = -1;
+    }
+    respond(server, client, "404 Not Found");
+    return;
+  }
+
+  client->state = HTTP_CLIENT_RESPONSE;
+  client->file_offset = 0;
+  client->file_size = st.st_size;
+  iov.iov_len = snprintf(
+    headers, sizeof(headers),
+    "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n",
+    content_type_for(path), (long long)st.st_size
+  );
+  if (send_output(server, client, &iov, 1) == 1) {
+    flush_client(server, client);
+  }
+}
+
+/**
+ * Handle a client's request once it's been read in full: a stream (over a WebSocket or as MJPEG)
+ * or a file.
+ */
+static void handle_request(http_server_t* server, http_client_t* client)
+{
+  char method[8], url_path[256], upgrade[32];
+  int channel;
+
+  server->stats.requests ++;
+  if (sscanf(client->input, "%7s %255s HTTP/1.%*c", method, url_path) != 2 || url_path[0] != '/') {
+    respond(server, client, "400 Bad Request");
+    return;
+  }
+  if (strcmp(method, "GET") != 0) {
+    respond(server, client, "405 Method Not Allowed");
+    return;
+  }
+  url_path[strcspn(url_path, "?#")] = '\0';
+
+  if (strncmp(url_path, "/stream/", 8) == 0) {
+    if ((channel = channel_for_path(server, url_path + 8)) == -1) {
+      respond(server, client, "404 Not Found");
+    } else if (!find_header(client->input, "Upgrade", upgrade, sizeof(upgrade)) || strcasecmp(upgrade, "websocket") != 0) {
+      respond(server, client, "426 Upgrade Required");
+    } else {
+      start_websocket(server, client, channel);
+    }
+  } else if (strncmp(url_path, "/mjpeg/", 7) == 0) {
+    if ((channel = channel_for_path(server, url_path + 7)) == -1) {
+      respond(server, client, "404 Not Found");
+    } else {
+      start_mjpeg(server, client, channel);
+    }
+  } else {
+    send_file(server, client, url_path);
+  }
+}
+
+/**
+ * Handle the (masked) messages a WebSocket client has sent: "keyframe" asks for a keyframe (I.e.
+ * after losing its place), and pings and closes are answered. Anything else is ignored.
+ */
+static void handle_websocket_input(http_server_t* server, http_client_t* client)
+{
+  uint8_t* input = (uint8_t*)client->input;
+
+  while (client->input_size >= 2) {
+    uint8_t opcode = input[0] & 0x0f;
+    size_t length = input[1] & 0x7f, offset = 2;
+
+    // Clients must mask what they send, and nothing they send need be long
+    if (!(input[1] & 0x80) || length == 127) {
+      close_client(server, client);
+      return;
+    }
+    if (length == 126) {
+      if (client->input_size < 4) {
+        return;
+      }
+      length = input[2] << 8 | input[3];
+      offset = 4;
+    }
+    if (offset + 4 + length > sizeof(client->input)) {
+      close_client(server, client);
+      return;
+    }
+    if (client->input_size < offset + 4 + length) {
+      return;
+    }
+
+    uint8_t* mask = input + offset;
+    uint8_t* payload = mask + 4;
+    for (size_t i = 0; i < length; i ++) {
+      payload[i] ^= mask[i & 3];
+    }
+
+    if (opcode == WEBSOCKET_CLOSE) {
+      close_client(server, client);
+      return;
+    } else if (opcode == WEBSOCKET_TEXT && length == 8 && memcmp(payload, "keyframe", 8) == 0) {
+      client->needs_keyframe = 1;
+    } else if (opcode == WEBSOCKET_PING && length <= 125) {
+      uint8_t pong[2] = { 0x80 | WEBSOCKET_PONG, length };
+      struct iovec iov[2] = { { pong, 2 }, { payload, length } };
+      if (send_output(server, client, iov, 2) == -1) {
+        return;
+      }
+    }
+
+    client->input_size -= offset + 4 + length;
+    memmove(input, payload + length, client->input_size);
+  }
+}
+
+/**
+ * Read whatever a client has sent, handling its request once it's all arrived.
+ */
+static void read_client(http_server_t* server, http_client_t* client)
+{
+  ssize_t size;
+
+  while (1) {
+    // A client being sent a response has nothing more to say, so anything it sends is discarded
+    if (client->state == HTTP_CLIENT_RESPONSE || (client->state == HTTP_CLIENT_STREAMING && client->stream == HTTP_STREAM_MJPEG)) {
+      client->input_size = 0;
+    }
+    if (client->input_size == sizeof(client->input) - 1) {
+      respond(server, client, "431 Request Header Fields Too Large");
+      return;
+    }
+
+    size = recv(client->fd, client->input + client->input_size, sizeof(client->input) - 1 - client->input_size, MSG_DONTWAIT);
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (size <= 0) {
+      close_client(server, client);
+      return;
+    }
+    client->input_size += size;
+    client->input[client->input_size] = '\0';
+
+    if (client->state == HTTP_CLIENT_REQUEST && strstr(client->input, "\r\n\r\n") != NULL) {
+      handle_request(server, client);
+      client->input_size = 0;
+    } else if (client->state == HTTP_CLIENT_STREAMING && client->stream == HTTP_STREAM_WEBSOCKET) {
+      handle_websocket_input(server, client);
+    }
+    if (client->state == HTTP_CLIENT_FREE) {
+      return;
+    }
+  }
+}
+
+/**
+ * Accept every client waiting to connect, turning away any there isn't room for.
+ */
+static void accept_clients(http_server_t* server)
+{
+  int fd, client_index, one = 1;
+
+  while ((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    for (client_index = 0; client_index < HTTP_MAX_CLIENTS; client_index ++) {
+      if (server->clients[client_index].state == HTTP_CLIENT_FREE) {
+        break;
+      }
+    }
+    if (client_index == HTTP_MAX_CLIENTS) {
+      server->stats.rejected ++;
+      close(fd);
+      continue;
+    }
+
+    http_client_t* client = &server->clients[client_index];
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = client_index };
+    client->fd = fd;
+    client->state = HTTP_CLIENT_REQUEST;
+    client->input_size = 0;
+    client->queue_start = client->queue_end = 0;
+    client->file_fd = -1;
+    client->file_offset = client->file_size = 0;
+    client->waiting_to_write = 0;
+    client->needs_keyframe = 0;
+    client->frames_sent = client->frames_missed = 0;
+
+    // Frames are sent whole, so there's nothing to gain by waiting to fill packets
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+      log_error("http: failed to watch client - %s", strerror(errno));
+      close(fd);
+      client->state = HTTP_CLIENT_FREE;
+    }
+  }
+}
+
+/**
+ * Set up a server listening on a TCP port, serving files from the root directory and streams with
+ * channel_count channels. Each client's output queue is allocated up front.
+ * Returns 1 on success or -1 on failure.
+ */
+int http_server_init(http_server_t* server, int port, const char* root, int channel_count,
+  void* (*allocate)(size_t))
+{
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY) };
+  struct epoll_event event = { .events = EPOLLIN, .data.u32 = LISTENER };
+  int one = 1;
+
+  memset(server, 0, sizeof(http_server_t));
+  snprintf(server->root, sizeof(server->root), "%s", root);
+  server->channel_count = channel_count;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i ++) {
+    server->clients[i].fd = -1;
+    server->clients[i].file_fd = -1;
+    server->clients[i].queue = allocate(HTTP_QUEUE_SIZE);
+  }
+
+  if ((server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ||
+      setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+      bind(server->listen_fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+      listen(server->listen_fd, HTTP_MAX_CLIENTS) == -1) {
+    log_error("http: failed to listen on port %d - %s", port, strerror(errno));
+    return -1;
+  }
+  if ((server->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+      epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) == -1) {
+    log_error("http: failed to set up epoll - %s", strerror(errno));
+    return -1;
+  }
+
+  log_info("http: serving %s on port %d", server->root, port);
+  return 1;
+}
+
+/**
+ * Get an fd that becomes readable whenever the server has something to handle, so that it can be
+ * waited on along with anything else (I.e. with poll).
+ */
+int http_server_fd(http_server_t* server)
+{
+  return server->epoll_fd;
+}
+
+/**
+ * Handle everything the server has to do (new clients, requests and output clients' sockets are
+ * ready to take) without waiting.
+ */
+void http_server_handle(http_server_t* server)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+
+  while ((count = epoll_wait(server->epoll_fd, events, MAX_EVENTS, 0)) > 0) {
+    for (int i = 0; i < count; i ++) {
+      if (events[i].data.u32 == LISTENER) {
+        accept_clients(server);
+        continue;
+      }
+
+      http_client_t* client = &server->clients[events[i].data.u32];
+      if (client->state != HTTP_CLIENT_FREE && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+        close_client(server, client);
+        continue;
+      }
+      if (client->state != HTTP_CLIENT_FREE && (events[i].events & EPOLLOUT)) {
+        flush_client(server, client);
+      }
+      if (client->state != HTTP_CLIENT_FREE && (events[i].events & EPOLLIN)) {
+        read_client(server, client);
+      }
+    }
+    if (count < MAX_EVENTS) {
+      break;
+    }
+  }
+}
+
+/**
+ * Count the clients following a stream's channel, so that nothing's prepared for streams nobody's
+ * following, and find whether any of them is waiting for a keyframe.
+ */
+int http_stream_clients(http_server_t* server, http_stream_t stream, int channel, int* keyframe_wanted)
+{
+  int count = 0;
+
+  *keyframe_wanted = 0;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i ++) {
+    http_client_t* client = &server->clients[i];
+    if (client->state == HTTP_CLIENT_STREAMING && client->stream == stream && client->channel == channel) {
+      count ++;
+      *keyframe_wanted |= client->needs_keyframe;
+    }
+  }
+  return count;
+}
+
+/**
+ * Stream a frame to every client following a stream's channel: as a WebSocket binary message of the
+ * header followed by the data, or as the next part of an MJPEG stream (the data alone).
+ * A client that hasn't taken the whole of the last frame yet misses this one, and then (over a
+ * WebSocket) waits for a keyframe; only keyframes are sent to clients waiting for one.
+ */
+void http_stream_frame(http_server_t* server, http_stream_t stream, int channel, const void* header,
+  size_t header_size, const void* data, size_t size, int keyframe)
+{
+  uint8_t framing[128];
+  struct iovec iov[4];
+  int count = 0;
+
+  // Frame it for the stream
+  if (stream == HTTP_STREAM_WEBSOCKET) {
+    size_t length = header_size + size, framing_size = 2;
+    framing[0] = 0x80 | WEBSOCKET_BINARY;
+    if (length < 126) {
+      framing[1] = length;
+    } else if (length <= 0xffff) {
+      framing[1] = 126;
+      framing[2] = length >> 8;
+      framing[3] = length & 0xff;
+      framing_size = 4;
+    } else {
+      framing[1] = 127;
+      for (int i = 0; i < 8; i ++) {
+        framing[9 - i] = (uint64_t)length >> (i * 8);
+      }
+      framing_size = 10;
+    }
+    iov[count ++] = (struct iovec){ framing, framing_size };
+    iov[count ++] = (struct iovec){ (void*)header, header_size };
+    iov[count ++] = (struct iovec){ (void*)data, size };
+  } else {
+    size_t framing_size = snprintf(
+      (char*)framing, sizeof(framing), "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", size
+    );
+    iov[count ++] = (struct iovec){ framing, framing_size };
+    iov[count ++] = (struct iovec){ (void*)data, size };
+    iov[count ++] = (struct iovec){ "\r\n", 2 };
+  }
+
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i ++) {
+    http_client_t* client = &server->clients[i];
+    if (client->state != HTTP_CLIENT_STREAMING || client->stream != stream || client->channel != channel) {
+      continue;
+    }
+    if (stream == HTTP_STREAM_WEBSOCKET && client->needs_keyframe && !keyframe) {
+      continue;
+    }
+
+    // Frames are never queued behind one another, so a slow client gets the newest it can take
+    int sent = client->queue_start == client->queue_end ? send_output(server, client, iov, count) : 0;
+    if (sent == 1) {
+      client->frames_sent ++;
+      client->needs_keyframe = 0;
+      server->stats.frames_sent ++;
+    } else if (sent == 0) {
+      client->frames_missed ++;
+      client->needs_keyframe = 1;
+      server->stats.frames_missed ++;
+    }
+  }
+}
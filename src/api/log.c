@@ -97,7 +97,8 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
 
   /* Get current time */
   time_t t = time(NULL);
-  struct tm *lt = localtime(&t);
+  struct tm lt_buf;
+  struct tm *lt = localtime_r(&t, &lt_buf);
 
   /* Log to stderr */
   if (!L.quiet) {
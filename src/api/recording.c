@@ -0,0 +1,239 @@
+#include "log.h"
+#include "recording.h"
+#include "vospi.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Start writing a recording to a file, writing its header.
+ * Returns the writer, or NULL on failure.
+ */
+recording_writer_t* recording_open_writer(int fd)
+{
+  recording_header_t header = {
+    .magic = RECORDING_MAGIC,
+    .version = htole16(RECORDING_VERSION),
+    .packet_bytes = htole16(VOSPI_PACKET_BYTES),
+    .reserved = 0
+  };
+  recording_writer_t* writer = malloc(sizeof(recording_writer_t));
+
+  if (writer == NULL || (writer->fp = fdopen(fd, "w")) == NULL) {
+    log_error("recording: failed to open for writing");
+    free(writer);
+    return NULL;
+  }
+  setvbuf(writer->fp, NULL, _IOFBF, RECORDING_WRITE_BUFFER_BYTES);
+  writer->records = 0;
+
+  if (fwrite(&header, sizeof(header), 1, writer->fp) != 1) {
+    log_error("recording: failed to write header");
+    fclose(writer->fp);
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+/**
+ * Write a record of the packets received by a single transfer, exactly as they were received.
+ * Returns 1 on success or 0 on failure.
+ */
+int recording_write(recording_writer_t* writer, uint64_t timestamp_ns, const void* packets, int count)
+{
+  recording_record_t record = {
+    .timestamp_ns = htole64(timestamp_ns),
+    .packet_count = htole32(count)
+  };
+
+  if (fwrite(&record, sizeof(record), 1, writer->fp) != 1 ||
+      fwrite(packets, VOSPI_PACKET_BYTES, count, writer->fp) != count) {
+    log_error("recording: failed to write record - %s", strerror(errno));
+    return 0;
+  }
+
+  writer->records ++;
+  return 1;
+}
+
+/**
+ * Flush and close a recording.
+ */
+void recording_close_writer(recording_writer_t* writer)
+{
+  log_info("recording: closing after %llu records", (unsigned long long)writer->records);
+  fclose(writer->fp);
+  free(writer);
+}
+
+/**
+ * Check whether a file is a recording, without disturbing its offset.
+ * Only files that can be read at an offset (I.e. not pipes) can be recognised.
+ * Returns 1 if it is, otherwise 0.
+ */
+int recording_detect(int fd)
+{
+  char magic[RECORDING_MAGIC_BYTES];
+
+  return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+    memcmp(magic, RECORDING_MAGIC, RECORDING_MAGIC_BYTES) == 0;
+}
+
+/**
+ * Read exactly len bytes from a recording.
+ * Returns 1 on success or 0 on failure or at the end of the recording.
+ */
+static int read_fully(int fd, void* buf, size_t len)
+{
+  ssize_t count;
+
+  while (len > 0) {
+    if ((count = read(fd, buf, len)) < 1) {
+      if (count == -1 && errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += count;
+    len -= count;
+  }
+
+  return 1;
+}
+
+/**
+ * Start replaying a recording from the beginning, checking its header.
+ * Packets are delivered at the pace they were recorded unless paced is cleared.
+ * Returns the reader, or NULL on failure.
+ */
+recording_reader_t* recording_open_reader(int fd)
+{
+  recording_header_t header;
+  recording_reader_t* reader;
+
+  if (lseek(fd, 0, SEEK_SET) == -1 || !read_fully(fd, &header, sizeof(header))) {
+    log_error("recording: failed to read header");
+    return NULL;
+  }
+
+  if (memcmp(header.magic, RECORDING_MAGIC, RECORDING_MAGIC_BYTES) != 0 ||
+      le16toh(header.version) != RECORDING_VERSION ||
+      le16toh(header.packet_bytes) != VOSPI_PACKET_BYTES) {
+    log_error(
+      "recording: unsupported recording (version %d, %d-byte packets)",
+      le16toh(header.version), le16toh(header.packet_bytes)
+    );
+    return NULL;
+  }
+
+  if ((reader = malloc(sizeof(recording_reader_t))) == NULL) {
+    return NULL;
+  }
+  memset(reader, 0, sizeof(recording_reader_t));
+  reader->fd = fd;
+  reader->paced = 1;
+
+  return reader;
+}
+
+/**
+ * Read the next record, waiting until it's due if the replay is paced.
+ * Returns 1 on success, or 0 at the end of the recording (including a truncated final record).
+ */
+static int read_record(recording_reader_t* reader)
+{
+  recording_record_t record;
+  uint64_t timestamp_ns, due_ns;
+  struct timespec due;
+
+  if (reader->ended) {
+    return 0;
+  }
+
+  if (!read_fully(reader->fd, &record, sizeof(record))) {
+    log_info("recording: end of recording after %llu records", (unsigned long long)reader->records);
+    reader->ended = 1;
+    return 0;
+  }
+
+  reader->packet_count = le32toh(record.packet_count);
+  if (reader->packet_count < 1 || reader->packet_count > RECORDING_MAX_RECORD_PACKETS) {
+    log_error("recording: record %llu has %d packets", (unsigned long long)reader->records, reader->packet_count);
+    reader->ended = 1;
+    return 0;
+  }
+
+  if (!read_fully(reader->fd, reader->packets, reader->packet_count * VOSPI_PACKET_BYTES)) {
+    log_info("recording: end of recording after %llu records (the last truncated)", (unsigned long long)reader->records);
+    reader->ended = 1;
+    return 0;
+  }
+
+  // Line the recording's clock up with ours at the first record, and keep to it from then on
+  timestamp_ns = le64toh(record.timestamp_ns);
+  if (reader->records ++ == 0) {
+    reader->first_record_ns = timestamp_ns;
+    reader->first_replay_ns = monotonic_ns();
+  } else if (reader->paced && timestamp_ns > reader->first_record_ns) {
+    due_ns = reader->first_replay_ns + (timestamp_ns - reader->first_record_ns);
+    due.tv_sec = due_ns / 1000000000;
+    due.tv_nsec = due_ns % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+  }
+
+  reader->packets_delivered = 0;
+  return 1;
+}
+
+/**
+ * Read packets from a recording, exactly as they were received from the camera.
+ * Packets are delivered in the order they were recorded, regardless of how they were batched.
+ * Returns 1 on success, or 0 at the end of the recording.
+ */
+int recording_read(recording_reader_t* reader, void* packets, int count)
+{
+  int batch;
+
+  while (count > 0) {
+    if (reader->packets_delivered == reader->packet_count && !read_record(reader)) {
+      return 0;
+    }
+
+    batch = reader->packet_count - reader->packets_delivered;
+    batch = count < batch ? count : batch;
+    memcpy(
+      packets, reader->packets + reader->packets_delivered * VOSPI_PACKET_BYTES, batch * VOSPI_PACKET_BYTES
+    );
+    reader->packets_delivered += batch;
+    packets += batch * VOSPI_PACKET_BYTES;
+    count -= batch;
+  }
+
+  return 1;
+}
+
+/**
+ * Stop replaying a recording.
+ */
+void recording_close_reader(recording_reader_t* reader)
+{
+  free(reader);
+}
@@ -0,0 +1,288 @@
+#include "ring.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+
+/**
+ * Push a slot onto a queue. Only ever called by the queue's producer.
+ * Returns 1 on success, or 0 if the queue is full.
+ */
+static int queue_push(ring_queue_t* queue, uint32_t capacity, void* slot)
+{
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == capacity) {
+    return 0;
+  }
+
+  atomic_store_explicit(&queue->slots[head & (capacity - 1)], slot, memory_order_relaxed);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return 1;
+}
+
+/**
+ * Pop the oldest slot from a queue. May be called by both sides of a ring at once.
+ * A position is only rewritten by the producer once the tail has moved past it, so a slot read
+ * from it is only kept if the tail can then be moved past it from where it was.
+ * Returns the slot, or NULL if the queue is empty.
+ */
+static void* queue_pop(ring_queue_t* queue, uint32_t capacity)
+{
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  void* slot;
+
+  do {
+    if (tail == atomic_load_explicit(&queue->head, memory_order_acquire)) {
+      return NULL;
+    }
+    slot = atomic_load_explicit(&queue->slots[tail & (capacity - 1)], memory_order_relaxed);
+  } while (!atomic_compare_exchange_weak_explicit(
+    &queue->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire
+  ));
+
+  return slot;
+}
+
+/**
+ * Sleep until the value at addr is no longer expected (or a spurious wakeup).
+ */
+static void futex_wait(_Atomic uint32_t* addr, uint32_t expected)
+{
+  syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+/**
+ * Wake every thread sleeping on addr.
+ */
+static void futex_wake(_Atomic uint32_t* addr)
+{
+  syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Push a slot onto one of a ring's queues, waking the other side if it's asleep waiting for it.
+ * The fence orders the head update before the check, pairing with the one made before sleeping.
+ */
+static void ring_push(ring_queue_t* queue, uint32_t capacity, void* slot, _Atomic int* waiting)
+{
+  queue_push(queue, capacity, slot);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed)) {
+    futex_wake(&queue->head);
+  }
+}
+
+/**
+ * Pop a slot from one of a ring's queues, sleeping on a futex until there is one.
+ * The futex only sleeps if the head is still where it was seen, so a push can't be missed.
+ */
+static void* ring_pop_wait(ring_queue_t* queue, uint32_t capacity, _Atomic int* waiting)
+{
+  void* slot;
+
+  while ((slot = queue_pop(queue, capacity)) == NULL) {
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    atomic_store_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_relaxed)) {
+      futex_wait(&queue->head, head);
+    }
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+  }
+
+  return slot;
+}
+
+/**
+ * Initialise a ring, filling it with capacity (stale) slots for the producer to fill.
+ * The producer and consumer each allocate one more slot of their own to start with.
+ * Returns 1 on success or -1 on failure.
+ */
+int ring_init(ring_t* ring, int capacity, ring_policy_t policy, void* (*allocate)())
+{
+  if (capacity < 1 || capacity > RING_MAX_CAPACITY || (capacity & (capacity - 1)) != 0) {
+    log_error("ring: capacity must be a power of 2 no larger than %d", RING_MAX_CAPACITY);
+    return -1;
+  }
+
+  ring->capacity = capacity;
+  ring->policy = policy;
+  atomic_init(&ring->filled.head, 0);
+  atomic_init(&ring->filled.tail, 0);
+  atomic_init(&ring->released.head, 0);
+  atomic_init(&ring->released.tail, 0);
+  atomic_init(&ring->consumer_waiting, 0);
+  atomic_init(&ring->producer_waiting, 0);
+  atomic_init(&ring->consumer_armed, 0);
+  atomic_init(&ring->event_fd, -1);
+  atomic_init(&ring->published, 0);
+  atomic_init(&ring->dropped_oldest, 0);
+  atomic_init(&ring->dropped_newest, 0);
+  atomic_init(&ring->producer_waits, 0);
+
+  for (int slot = 0; slot < capacity; slot ++) {
+    queue_push(&ring->released, capacity, allocate());
+  }
+
+  return 1;
+}
+
+/**
+ * Find the policy with the given name ("latest", "block" or "drop-newest").
+ * Returns 1 on success, or -1 if there's no such policy.
+ */
+int ring_policy_for_name(const char* name, ring_policy_t* policy)
+{
+  if (strcmp(name, "latest") == 0) {
+    *policy = RING_LATEST;
+  } else if (strcmp(name, "block") == 0) {
+    *policy = RING_BLOCK;
+  } else if (strcmp(name, "drop-newest") == 0) {
+    *policy = RING_DROP_NEWEST;
+  } else {
+    return -1;
+  }
+  return 1;
+}
+
+/**
+ * Publish a filled slot into a ring.
+ * Ownership of the slot passes to the ring, and a free slot is returned to the caller to fill next.
+ * If the consumer is holding every other slot, the ring's policy decides which slot is dropped,
+ * or whether to wait; only RING_BLOCK ever waits.
+ */
+void* ring_publish(ring_t* ring, void* slot)
+{
+  // Taking a free slot first guarantees there's room for the filled one
+  void* free_slot = queue_pop(&ring->released, ring->capacity);
+
+  if (free_slot == NULL) {
+    switch (ring->policy) {
+      case RING_LATEST:
+        // Take back the oldest unread slot, unless the consumer has just taken it
+        if ((free_slot = queue_pop(&ring->filled, ring->capacity)) != NULL) {
+          atomic_fetch_add_explicit(&ring->dropped_oldest, 1, memory_order_relaxed);
+          break;
+        }
+        free_slot = ring_pop_wait(&ring->released, ring->capacity, &ring->producer_waiting);
+        break;
+      case RING_BLOCK:
+        atomic_fetch_add_explicit(&ring->producer_waits, 1, memory_order_relaxed);
+        free_slot = ring_pop_wait(&ring->released, ring->capacity, &ring->producer_waiting);
+        break;
+      case RING_DROP_NEWEST:
+        atomic_fetch_add_explicit(&ring->dropped_newest, 1, memory_order_relaxed);
+        return slot;
+    }
+  }
+
+  atomic_fetch_add_explicit(&ring->published, 1, memory_order_relaxed);
+  ring_push(&ring->filled, ring->capacity, slot, &ring->consumer_waiting);
+
+  // Notify the consumer if it's waiting in an event loop, once per batch
+  int event_fd = atomic_load_explicit(&ring->event_fd, memory_order_relaxed);
+  uint64_t one = 1;
+  if (event_fd >= 0 && atomic_load_explicit(&ring->consumer_armed, memory_order_relaxed) &&
+      atomic_exchange(&ring->consumer_armed, 0)) {
+    if (write(event_fd, &one, sizeof(one)) != sizeof(one)) {
+      log_warn("ring: failed to notify the consumer");
+    }
+  }
+  return free_slot;
+}
+
+/**
+ * Take ownership of a filled slot popped from a ring, releasing the slot the consumer finished
+ * reading in exchange. Under RING_LATEST the newest filled slot is taken instead, releasing any
+ * older ones unread, so that the consumer catches straight up after falling behind.
+ */
+static void* take_filled_slot(ring_t* ring, void* slot, void* released_slot)
+{
+  void* newer_slot;
+
+  while (ring->policy == RING_LATEST && (newer_slot = queue_pop(&ring->filled, ring->capacity)) != NULL) {
+    atomic_fetch_add_explicit(&ring->dropped_oldest, 1, memory_order_relaxed);
+    ring_push(&ring->released, ring->capacity, slot, &ring->producer_waiting);
+    slot = newer_slot;
+  }
+
+  ring_push(&ring->released, ring->capacity, released_slot, &ring->producer_waiting);
+  return slot;
+}
+
+/**
+ * Wait for the next filled slot in a ring and take ownership of it.
+ * The caller releases the slot it finished reading in exchange; that slot is reused by the producer.
+ * Only sleeps (on a futex) if the ring is empty.
+ */
+void* ring_acquire(ring_t* ring, void* released_slot)
+{
+  void* slot = ring_pop_wait(&ring->filled, ring->capacity, &ring->consumer_waiting);
+  return take_filled_slot(ring, slot, released_slot);
+}
+
+/**
+ * Take the next filled slot in a ring if there is one, releasing the slot the caller finished
+ * reading in exchange; otherwise the caller keeps it. Never waits.
+ * Once this returns NULL, the ring's event fd is notified when a slot is published.
+ * Returns the slot, or NULL if the ring is empty.
+ */
+void* ring_try_acquire(ring_t* ring, void* released_slot)
+{
+  void* slot = queue_pop(&ring->filled, ring->capacity);
+
+  // Ask to be notified of the next slot, then check again in case it was published meanwhile
+  if (slot == NULL && !atomic_load(&ring->consumer_armed)) {
+    atomic_store(&ring->consumer_armed, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    slot = queue_pop(&ring->filled, ring->capacity);
+  }
+  if (slot == NULL) {
+    return NULL;
+  }
+
+  return take_filled_slot(ring, slot, released_slot);
+}
+
+/**
+ * Get an eventfd that becomes readable when a slot is published into a ring, so that the consumer
+ * can wait for slots in an event loop (I.e. with epoll) rather than a thread of its own.
+ * Notifications are edge-triggered and batched: the producer only writes to the eventfd once
+ * ring_try_acquire() has returned NULL, so the consumer should read the eventfd (or use EPOLLET)
+ * and then take slots until there are none left each time it's woken.
+ * Returns the eventfd, or -1 on failure.
+ */
+int ring_event_fd(ring_t* ring)
+{
+  int event_fd = atomic_load(&ring->event_fd);
+
+  if (event_fd < 0) {
+    if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      log_error("ring: failed to create eventfd - %s", strerror(errno));
+      return -1;
+    }
+    atomic_store(&ring->event_fd, event_fd);
+  }
+
+  return event_fd;
+}
+
+/**
+ * Take a snapshot of a ring's statistics. May be called from any thread.
+ */
+void ring_get_stats(ring_t* ring, ring_stats_t* stats)
+{
+  stats->published = atomic_load_explicit(&ring->published, memory_order_relaxed);
+  stats->dropped_oldest = atomic_load_explicit(&ring->dropped_oldest, memory_order_relaxed);
+  stats->dropped_newest = atomic_load_explicit(&ring->dropped_newest, memory_order_relaxed);
+  stats->producer_waits = atomic_load_explicit(&ring->producer_waits, memory_order_relaxed);
+}
@@ -0,0 +1,351 @@
+#include "shm.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * A shared-memory ring is a header followed by a fixed number of slots, published into in turn.
+ * Readers map it read-only and read each slot in place, so any number of them can follow along
+ * without copying and without the publisher knowing they're there. Since a reader can't hold a
+ * slot, each slot's publication number works as a sequence lock: the publisher zeroes it before
+ * rewriting the slot, so a reader checks it's unchanged once it's finished with what it read.
+ * Readers sleep on a (process-shared) futex on the header's publication count. Since they can't write
+ * to the ring, they count themselves in and out of sleep in a separate, writable object alongside
+ * it (see SHM_WAITERS_SUFFIX), so the publisher only wakes them when one might be asleep. A reader
+ * that dies asleep leaves the count too high, which only costs the publisher a needless wake.
+ */
+
+/**
+ * Round a size up to a multiple of an alignment (a power of 2).
+ */
+static size_t round_up(size_t size, size_t alignment)
+{
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * Find the slot a publication goes in.
+ */
+static shm_slot_t* slot_for(const shm_header_t* header, uint32_t publication)
+{
+  return (shm_slot_t*)((uint8_t*)header + header->header_size + (publication % header->slot_count) * header->slot_size);
+}
+
+/**
+ * Sleep until the value at addr is no longer expected, a spurious wakeup or the timeout (if not NULL).
+ * Returns -1 on timeout.
+ */
+static int futex_wait(const _Atomic uint32_t* addr, uint32_t expected, const struct timespec* timeout)
+{
+  if (syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT, expected, timeout, NULL, 0) == -1 && errno == ETIMEDOUT) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Wake every process sleeping on addr.
+ */
+static void futex_wake(_Atomic uint32_t* addr)
+{
+  syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Map the one-page object holding a ring's count of waiting readers, creating it (writable by every
+ * reader, whatever the umask) if asked.
+ * Returns the count, or NULL on failure.
+ */
+static _Atomic uint32_t* map_waiters(const char* name, int create)
+{
+  long page_size = sysconf(_SC_PAGESIZE);
+  void* waiters;
+  int fd;
+
+  if (create) {
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd != -1 && (fchmod(fd, 0666) == -1 || ftruncate(fd, page_size) == -1)) {
+      close(fd);
+      shm_unlink(name);
+      fd = -1;
+    }
+  } else {
+    fd = shm_open(name, O_RDWR, 0);
+  }
+  if (fd == -1) {
+    log_error("shm: failed to open %s - %s", name, strerror(errno));
+    return NULL;
+  }
+
+  waiters = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (waiters == MAP_FAILED) {
+    log_error("shm: failed to map %s - %s", name, strerror(errno));
+    if (create) {
+      shm_unlink(name);
+    }
+    return NULL;
+  }
+  return (_Atomic uint32_t*)waiters;
+}
+
+/**
+ * Create a shared-memory ring of slot_count slots with the given name (I.e. "/leptonic-0"), each
+ * holding payloads of up to payload_capacity bytes, replacing any left behind by an earlier publisher.
+ * The ring is locked in memory if the RLIMIT_MEMLOCK allows, and faulted in up front.
+ * Returns 1 on success or -1 on failure.
+ */
+int shm_publisher_init(shm_publisher_t* publisher, const char* name, int slot_count, size_t payload_capacity)
+{
+  size_t header_size = round_up(sizeof(shm_header_t), SHM_CACHE_LINE);
+  size_t slot_size = round_up(sizeof(shm_slot_t) + payload_capacity, SHM_CACHE_LINE);
+  long page_size = sysconf(_SC_PAGESIZE);
+  shm_header_t* header;
+  int fd;
+
+  if (slot_count < 3 || slot_count > SHM_MAX_SLOTS) {
+    log_error("shm: a ring needs between 3 and %d slots", SHM_MAX_SLOTS);
+    return -1;
+  }
+
+  memset(publisher, 0, sizeof(shm_publisher_t));
+  snprintf(publisher->name, sizeof(publisher->name), "%s", name);
+  snprintf(publisher->waiters_name, sizeof(publisher->waiters_name), "%s" SHM_WAITERS_SUFFIX, publisher->name);
+  publisher->size = round_up(header_size + slot_count * slot_size, page_size);
+
+  // Readers of a ring left behind keep their mapping of it, and see it closed
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) == -1) {
+    log_error("shm: failed to create %s - %s", name, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, publisher->size) == -1 ||
+      (header = mmap(NULL, publisher->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    log_error("shm: failed to map %zu bytes for %s - %s", publisher->size, name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  close(fd);
+
+  if (mlock(header, publisher->size) == -1) {
+    log_warn("shm: failed to lock %s in memory - check RLIMIT_MEMLOCK (%s)", name, strerror(errno));
+  }
+  for (size_t offset = 0; offset < publisher->size; offset += page_size) {
+    ((volatile uint8_t*)header)[offset] = 0;
+  }
+
+  header->version = SHM_VERSION;
+  header->header_size = header_size;
+  header->slot_count = slot_count;
+  header->slot_size = slot_size;
+  header->payload_capacity = payload_capacity;
+  atomic_init(&header->closed, 0);
+  atomic_init(&header->published, 0);
+
+  // The waiter count has to be there before any reader can find the ring
+  if ((publisher->waiters = map_waiters(publisher->waiters_name, 1)) == NULL) {
+    munmap(header, publisher->size);
+    shm_unlink(name);
+    return -1;
+  }
+
+  // The magic number goes in last, so a reader that finds it finds the rest
+  atomic_thread_fence(memory_order_release);
+  header->magic = SHM_MAGIC;
+
+  publisher->header = header;
+  log_info("shm: publishing to %s (%d slots of %zu bytes)", name, slot_count, slot_size);
+  return 1;
+}
+
+/**
+ * Start writing the next publication, taking the slot written longest ago back from any readers.
+ * The caller fills the slot's metadata, payload and size, then calls shm_publish().
+ * Returns the slot to write.
+ */
+shm_slot_t* shm_begin_publish(shm_publisher_t* publisher)
+{
+  uint32_t publication = atomic_load_explicit(&publisher->header->published, memory_order_relaxed) + 1;
+  shm_slot_t* slot = slot_for(publisher->header, publication);
+
+  // Readers must see the slot's being written before any of what's written
+  atomic_store_explicit(&slot->publication, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  publisher->slot = slot;
+  return slot;
+}
+
+/**
+ * Publish the slot being written, waking any readers waiting for it (only making a syscall if
+ * there might be one).
+ */
+void shm_publish(shm_publisher_t* publisher)
+{
+  uint32_t publication = atomic_load_explicit(&publisher->header->published, memory_order_relaxed) + 1;
+
+  atomic_store_explicit(&publisher->slot->publication, publication, memory_order_release);
+  publisher->slot = NULL;
+
+  // Sequentially consistent, so that either a reader counted in sees the publication before it
+  // sleeps or it's seen counted in here
+  atomic_store(&publisher->header->published, publication);
+  if (atomic_load(publisher->waiters) > 0) {
+    futex_wake(&publisher->header->published);
+  }
+}
+
+/**
+ * Stop publishing to a shared-memory ring and remove it. Readers that have it mapped see it closed.
+ */
+void shm_publisher_close(shm_publisher_t* publisher)
+{
+  if (publisher->header == NULL) {
+    return;
+  }
+
+  atomic_store(&publisher->header->closed, 1);
+  futex_wake(&publisher->header->published);
+  munmap(publisher->header, publisher->size);
+  munmap((void*)publisher->waiters, sysconf(_SC_PAGESIZE));
+  shm_unlink(publisher->name);
+  shm_unlink(publisher->waiters_name);
+  publisher->header = NULL;
+  publisher->waiters = NULL;
+}
+
+/**
+ * Open the shared-memory ring with the given name to read, mapping it read-only.
+ * Reading starts from the next publication.
+ * Returns 1 on success or -1 on failure.
+ */
+int shm_reader_open(shm_reader_t* reader, const char* name)
+{
+  const shm_header_t* header;
+  char waiters_name[64 + sizeof(SHM_WAITERS_SUFFIX)];
+  struct stat st;
+  int fd;
+
+  memset(reader, 0, sizeof(shm_reader_t));
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+    log_error("shm: failed to open %s - %s", name, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_header_t) ||
+      (header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    log_error("shm: failed to map %s", name);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (header->magic != SHM_MAGIC || header->version != SHM_VERSION || header->slot_count < 3 ||
+      header->header_size + (size_t)header->slot_count * header->slot_size > (size_t)st.st_size) {
+    log_error("shm: %s isn't a shared-memory ring this version can read", name);
+    munmap((void*)header, st.st_size);
+    return -1;
+  }
+  atomic_thread_fence(memory_order_acquire);
+
+  snprintf(waiters_name, sizeof(waiters_name), "%s" SHM_WAITERS_SUFFIX, name);
+  if ((reader->waiters = map_waiters(waiters_name, 0)) == NULL) {
+    munmap((void*)header, st.st_size);
+    return -1;
+  }
+
+  reader->header = header;
+  reader->size = st.st_size;
+  reader->publication = atomic_load_explicit(&header->published, memory_order_acquire);
+  return 1;
+}
+
+/**
+ * Wait for the next publication in a shared-memory ring, for up to timeout_ms (forever if negative).
+ * Publications are read in order, unless the reader falls so far behind that the next may have
+ * been overwritten, in which case it skips to the newest (counting those missed).
+ * The slot is read in place; check it's still intact with shm_read_intact() once finished with it.
+ * Returns the slot, or NULL on timeout or once the ring's closed.
+ */
+const shm_slot_t* shm_read(shm_reader_t* reader, int timeout_ms)
+{
+  const shm_header_t* header = reader->header;
+  struct timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000 };
+  uint32_t published, publication;
+
+  while (1) {
+    while ((published = atomic_load_explicit(&header->published, memory_order_acquire)) == reader->publication) {
+      if (atomic_load(&header->closed)) {
+        return NULL;
+      }
+
+      // Count ourselves in before checking again, so the publisher knows to wake us
+      atomic_fetch_add(reader->waiters, 1);
+      int timed_out = atomic_load(&header->published) == published &&
+        futex_wait(&header->published, published, timeout_ms < 0 ? NULL : &timeout) == -1;
+      atomic_fetch_sub(reader->waiters, 1);
+      if (timed_out) {
+        return NULL;
+      }
+    }
+
+    // The slot after the newest may already be being rewritten, so a reader further behind than the
+    // rest of the ring skips straight to the newest to catch up
+    publication = reader->publication + 1;
+    if (published - publication > header->slot_count - 2) {
+      reader->missed += published - publication;
+      publication = published;
+    }
+
+    const shm_slot_t* slot = slot_for(header, publication);
+    reader->publication = publication;
+    if (atomic_load_explicit(&slot->publication, memory_order_acquire) == publication) {
+      return slot;
+    }
+    // Overwritten while we looked, so catch up
+    reader->missed ++;
+  }
+}
+
+/**
+ * Check a slot returned by shm_read() wasn't rewritten while it was being read.
+ * Returns 1 if what was read is intact, or 0 if it should be discarded.
+ */
+int shm_read_intact(shm_reader_t* reader, const shm_slot_t* slot)
+{
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->publication, memory_order_relaxed) == reader->publication;
+}
+
+/**
+ * Check whether a shared-memory ring's publisher has stopped.
+ */
+int shm_reader_closed(shm_reader_t* reader)
+{
+  return atomic_load(&reader->header->closed);
+}
+
+/**
+ * Stop reading a shared-memory ring, unmapping it.
+ */
+void shm_reader_close(shm_reader_t* reader)
+{
+  munmap((void*)reader->header, reader->size);
+  munmap((void*)reader->waiters, sysconf(_SC_PAGESIZE));
+  reader->header = NULL;
+  reader->waiters = NULL;
+}
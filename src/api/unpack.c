@@ -0,0 +1,214 @@
+#include "unpack.h"
+#include "vospi.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define UNPACK_NEON 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNPACK_X86 1
+#endif
+
+typedef void (*unpack_packets_fn)(const vospi_packet_t* packets, int count, uint16_t* pixels,
+  uint16_t* min, uint16_t* max);
+
+/**
+ * Unpack packets one pixel at a time.
+ * The portable fallback, and the reference the vector implementations must match.
+ */
+static void unpack_packets_scalar(const vospi_packet_t* packets, int count, uint16_t* pixels,
+  uint16_t* min, uint16_t* max)
+{
+  uint16_t lo = UINT16_MAX, hi = 0;
+
+  for (int pkt = 0; pkt < count; pkt ++) {
+    const uint8_t* symbols = packets[pkt].symbols;
+    for (int pix = 0; pix < VOSPI_PACKET_PIXELS; pix ++) {
+      uint16_t value = symbols[pix * 2] << 8 | symbols[pix * 2 + 1];
+      lo = value < lo ? value : lo;
+      hi = value > hi ? value : hi;
+      *pixels ++ = value;
+    }
+  }
+
+  *min = lo;
+  *max = hi;
+}
+
+#ifdef UNPACK_NEON
+/**
+ * Unpack packets 8 pixels at a time, reversing the bytes of each pixel with NEON.
+ */
+static void unpack_packets_neon(const vospi_packet_t* packets, int count, uint16_t* pixels,
+  uint16_t* min, uint16_t* max)
+{
+  uint16x8_t lo = vdupq_n_u16(UINT16_MAX), hi = vdupq_n_u16(0);
+
+  for (int pkt = 0; pkt < count; pkt ++) {
+    const uint8_t* symbols = packets[pkt].symbols;
+    for (int sym = 0; sym < VOSPI_PACKET_SYMBOLS; sym += 16) {
+      uint16x8_t value = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(symbols + sym)));
+      vst1q_u16(pixels, value);
+      lo = vminq_u16(lo, value);
+      hi = vmaxq_u16(hi, value);
+      pixels += 8;
+    }
+  }
+
+  // Reduce pairwise, which (unlike vminvq_u16) is available on 32-bit ARM too
+  uint16x4_t lo4 = vmin_u16(vget_low_u16(lo), vget_high_u16(lo));
+  uint16x4_t hi4 = vmax_u16(vget_low_u16(hi), vget_high_u16(hi));
+  lo4 = vpmin_u16(lo4, lo4);
+  hi4 = vpmax_u16(hi4, hi4);
+  *min = vget_lane_u16(vpmin_u16(lo4, lo4), 0);
+  *max = vget_lane_u16(vpmax_u16(hi4, hi4), 0);
+}
+#endif
+
+#ifdef UNPACK_X86
+/**
+ * Reduce vectors of minimum and maximum values to single values.
+ * There's only a horizontal minimum instruction, so the maximum is found as the inverse of the
+ * minimum of the inverted values.
+ */
+__attribute__((target("sse4.1")))
+static inline void reduce_sse41(__m128i lo, __m128i hi, uint16_t* min, uint16_t* max)
+{
+  *min = _mm_extract_epi16(_mm_minpos_epu16(lo), 0);
+  *max = UINT16_MAX - _mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(hi, _mm_set1_epi16(-1))), 0);
+}
+
+/**
+ * Unpack packets 8 pixels at a time, reversing the bytes of each pixel with an SSSE3 shuffle.
+ */
+__attribute__((target("sse4.1")))
+static void unpack_packets_sse41(const vospi_packet_t* packets, int count, uint16_t* pixels,
+  uint16_t* min, uint16_t* max)
+{
+  const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  __m128i lo = _mm_set1_epi16(-1), hi = _mm_setzero_si128();
+
+  for (int pkt = 0; pkt < count; pkt ++) {
+    const uint8_t* symbols = packets[pkt].symbols;
+    for (int sym = 0; sym < VOSPI_PACKET_SYMBOLS; sym += 16) {
+      __m128i value = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(symbols + sym)), swap);
+      _mm_storeu_si128((__m128i*)pixels, value);
+      lo = _mm_min_epu16(lo, value);
+      hi = _mm_max_epu16(hi, value);
+      pixels += 8;
+    }
+  }
+
+  reduce_sse41(lo, hi, min, max);
+}
+
+/**
+ * Unpack packets 16 pixels at a time, reversing the bytes of each pixel with an AVX2 shuffle.
+ * A packet's 160 bytes are exactly five 32-byte vectors.
+ */
+__attribute__((target("avx2")))
+static void unpack_packets_avx2(const vospi_packet_t* packets, int count, uint16_t* pixels,
+  uint16_t* min, uint16_t* max)
+{
+  const __m256i swap = _mm256_setr_epi8(
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+  );
+  __m256i lo = _mm256_set1_epi16(-1), hi = _mm256_setzero_si256();
+
+  for (int pkt = 0; pkt < count; pkt ++) {
+    const uint8_t* symbols = packets[pkt].symbols;
+    for (int sym = 0; sym < VOSPI_PACKET_SYMBOLS; sym += 32) {
+      __m256i value = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(symbols + sym)), swap);
+      _mm256_storeu_si256((__m256i*)pixels, value);
+      lo = _mm256_min_epu16(lo, value);
+      hi = _mm256_max_epu16(hi, value);
+      pixels += 16;
+    }
+  }
+
+  reduce_sse41(
+    _mm_min_epu16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1)),
+    _mm_max_epu16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1)),
+    min, max
+  );
+}
+#endif
+
+// The implementation in use, chosen once at load time (before main(), so before any thread that
+// unpacks is started) and never written again
+static unpack_packets_fn unpack_packets_impl = NULL;
+static const char* unpack_packets_impl_name = NULL;
+
+/**
+ * Choose the fastest implementation the CPU supports.
+ * Runs as a constructor, so that threads unpacking their first frames at once only ever read it.
+ */
+__attribute__((constructor))
+static void unpack_select(void)
+{
+#if defined(UNPACK_NEON)
+  unpack_packets_impl_name = "neon";
+  unpack_packets_impl = unpack_packets_neon;
+#elif defined(UNPACK_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    unpack_packets_impl_name = "avx2";
+    unpack_packets_impl = unpack_packets_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    unpack_packets_impl_name = "sse4.1";
+    unpack_packets_impl = unpack_packets_sse41;
+  } else {
+    unpack_packets_impl_name = "scalar";
+    unpack_packets_impl = unpack_packets_scalar;
+  }
+#else
+  unpack_packets_impl_name = "scalar";
+  unpack_packets_impl = unpack_packets_scalar;
+#endif
+}
+
+/**
+ * Get the name of the implementation used to unpack pixels (I.e. "avx2", "neon" or "scalar").
+ */
+const char* unpack_implementation(void)
+{
+  return unpack_packets_impl_name;
+}
+
+/**
+ * Unpack the big-endian pixels carried by a run of packets into host-order values, finding the
+ * smallest and largest values along the way.
+ * If there are no packets, min is left at UINT16_MAX and max at 0.
+ */
+void unpack_packets(const vospi_packet_t* packets, int count, uint16_t* pixels, uint16_t* min, uint16_t* max)
+{
+  unpack_packets_impl(packets, count, pixels, min, max);
+}
+
+/**
+ * Unpack a frame's pixels into a contiguous, row-major plane of host-order values (which must
+ * have room for UNPACK_MAX_PIXELS), finding the smallest and largest values along the way.
+ * Returns the number of pixels unpacked.
+ */
+int unpack_frame(const vospi_frame_t* frame, const vospi_geometry_t* geometry, uint16_t* pixels,
+  uint16_t* min, uint16_t* max)
+{
+  int packets = geometry->width * geometry->height / VOSPI_PACKET_PIXELS / geometry->segments_per_frame;
+  uint16_t lo = UINT16_MAX, hi = 0, seg_lo, seg_hi;
+
+  // Each segment's video packets are consecutive rows (or half-rows) of the frame
+  for (int seg = 0; seg < geometry->segments_per_frame; seg ++) {
+    unpack_packets(frame->segments[seg].packets, packets, pixels, &seg_lo, &seg_hi);
+    lo = seg_lo < lo ? seg_lo : lo;
+    hi = seg_hi > hi ? seg_hi : hi;
+    pixels += packets * VOSPI_PACKET_PIXELS;
+  }
+
+  *min = lo;
+  *max = hi;
+  return geometry->width * geometry->height;
+}
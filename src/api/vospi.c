@@ -1,23 +1,81 @@
 #include "log.h"
 #include "vospi.h"
+#include "crc16.h"
+#include "vsync.h"
+#include "telemetry.h"
+#include "recording.h"
 
 #include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
+#include <time.h>
+
+/**
+ * Get the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Read the spidev bufsiz module parameter, falling back to the default if it can't be found.
+ */
+static int spidev_bufsiz(void)
+{
+  int bufsiz = VOSPI_SPIDEV_DEFAULT_BUFSIZ;
+  FILE* fp = fopen(VOSPI_SPIDEV_BUFSIZ_PATH, "r");
+
+  if (fp != NULL) {
+    if (fscanf(fp, "%d", &bufsiz) != 1) {
+      bufsiz = VOSPI_SPIDEV_DEFAULT_BUFSIZ;
+    }
+    fclose(fp);
+  }
+
+  return bufsiz;
+}
 
 /**
  * Initialise the VoSPI interface.
+ * If fd isn't a spidev device it's read from directly: a recording (see recording.h) is replayed
+ * at the pace it was recorded, anything else is taken to be a file or pipe of raw packets.
  */
-int vospi_init(int fd, uint32_t speed)
+int vospi_init(vospi_device_t* dev, int fd, uint32_t speed)
 {
+  memset(dev, 0, sizeof(vospi_device_t));
+  dev->fd = fd;
+  dev->geometry = &vospi_geometry_lepton3;
+  dev->schedule.guard_ns = VOSPI_SCHEDULE_GUARD_NS;
+  dev->vsync_fd = -1;
+  crc16_init();
+
   // Set the various SPI parameters
   log_debug("setting SPI device mode...");
-  uint16_t mode = SPI_MODE_3;
+  uint8_t mode = SPI_MODE_3;
   if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
+    if (errno == ENOTTY) {
+      dev->packets_per_transfer = VOSPI_MAX_PACKETS_PER_SEGMENT;
+      if (recording_detect(fd)) {
+        log_warn("SPI: not a spidev device - replaying packets from a recording");
+        if ((dev->replay = recording_open_reader(fd)) == NULL) {
+          return -1;
+        }
+        dev->transfer_mode = VOSPI_TRANSFER_REPLAY;
+        return 1;
+      }
+      log_warn("SPI: not a spidev device - reading packets as a raw stream");
+      dev->transfer_mode = VOSPI_TRANSFER_READ;
+      return 1;
+    }
     log_fatal("SPI: failed to set mode");
     return -1;
   }
@@ -35,44 +93,521 @@ int vospi_init(int fd, uint32_t speed)
     return -1;
   }
 
+  // spidev refuses messages that receive more than bufsiz bytes, so batch as many packets as fit
+  dev->transfer_mode = VOSPI_TRANSFER_IOCTL;
+  dev->packets_per_transfer = spidev_bufsiz() / VOSPI_PACKET_BYTES;
+  if (dev->packets_per_transfer > VOSPI_MAX_PACKETS_PER_SEGMENT) {
+    dev->packets_per_transfer = VOSPI_MAX_PACKETS_PER_SEGMENT;
+  }
+  if (dev->packets_per_transfer < 1) {
+    log_fatal("SPI: spidev bufsiz is too small to receive a single packet");
+    return -1;
+  }
+  log_debug("transferring up to %d packets per SPI message", dev->packets_per_transfer);
+
+  // Each packet gets its own transfer so that the receive buffers can be pointed at packets
+  for (int i = 0; i < VOSPI_MAX_PACKETS_PER_SEGMENT; i ++) {
+    dev->transfers[i].len = VOSPI_PACKET_BYTES;
+  }
+
+  return 1;
+}
+
+/**
+ * Read exactly len bytes from a raw packet stream.
+ * Returns 1 on success or 0 on failure or end of stream.
+ */
+static int read_fully(int fd, void* buf, size_t len)
+{
+  ssize_t count;
+
+  while (len > 0) {
+    if ((count = read(fd, buf, len)) < 1) {
+      if (count == -1 && errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += count;
+    len -= count;
+  }
+
   return 1;
 }
 
+/**
+ * Transfer a run of packets from the device, using as few transfers as possible.
+ * Returns 1 on success or 0 on failure.
+ */
+static int transfer_packets(vospi_device_t* dev, vospi_packet_t* packets, int count)
+{
+  while (count > 0) {
+    int batch = count < dev->packets_per_transfer ? count : dev->packets_per_transfer;
+
+    if (dev->transfer_mode == VOSPI_TRANSFER_IOCTL) {
+      // Point the pre-set transfers at the packets and clock them all out in one message
+      for (int i = 0; i < batch; i ++) {
+        dev->transfers[i].rx_buf = (uintptr_t)&packets[i];
+      }
+      if (ioctl(dev->fd, SPI_IOC_MESSAGE(batch), dev->transfers) < 1) {
+        log_fatal("SPI: failed to transfer %d packets", batch);
+        return 0;
+      }
+    } else if (dev->transfer_mode == VOSPI_TRANSFER_REPLAY) {
+      if (!recording_read(dev->replay, packets, batch)) {
+        return 0;
+      }
+    } else if (!read_fully(dev->fd, packets, batch * VOSPI_PACKET_BYTES)) {
+      log_fatal("SPI: failed to read %d packets from stream", batch);
+      return 0;
+    }
+
+    // Record the packets exactly as they were received, before they're touched
+    if (dev->recorder != NULL && !recording_write(dev->recorder, monotonic_ns(), packets, batch)) {
+      return 0;
+    }
+
+    // Flip the byte order of the IDs & CRCs
+    for (int i = 0; i < batch; i ++) {
+      packets[i].id = FLIP_WORD_BYTES(packets[i].id);
+      packets[i].crc = FLIP_WORD_BYTES(packets[i].crc);
+    }
+
+    dev->stats.transfers ++;
+    packets += batch;
+    count -= batch;
+  }
+
+  return 1;
+}
+
+/**
+ * Receive a run of packets, starting with any carried over from the last segment (which have
+ * already been recorded and had their byte order flipped) and transferring the rest.
+ * Returns 1 on success or 0 on failure.
+ */
+static int receive_packets(vospi_device_t* dev, vospi_packet_t* packets, int count)
+{
+  int carried = dev->carried_packet_count < count ? dev->carried_packet_count : count;
+
+  memcpy(packets, dev->carried_packets, sizeof(vospi_packet_t) * carried);
+  memmove(
+    dev->carried_packets, &dev->carried_packets[carried],
+    sizeof(vospi_packet_t) * (dev->carried_packet_count - carried)
+  );
+  dev->carried_packet_count -= carried;
+
+  return transfer_packets(dev, &packets[carried], count - carried);
+}
+
+/**
+ * Record the time at which a valid segment started, learning the segment cadence from it.
+ */
+static void segment_started(vospi_device_t* dev, uint64_t start_ns)
+{
+  vospi_schedule_t* schedule = &dev->schedule;
+  uint64_t interval = start_ns - schedule->last_segment_ns;
+  schedule->last_segment_ns = start_ns;
+
+  // Keep a histogram of the intervals, noting those that skipped a segment
+  uint64_t bin = interval / VOSPI_INTERVAL_HISTOGRAM_BIN_NS;
+  dev->stats.segment_intervals[
+    bin < VOSPI_INTERVAL_HISTOGRAM_BINS ? bin : VOSPI_INTERVAL_HISTOGRAM_BINS - 1
+  ] ++;
+  if (schedule->period_ns && interval > schedule->period_ns + schedule->period_ns / 2) {
+    dev->stats.late_segments ++;
+  }
+
+  if (schedule->samples < VOSPI_SCHEDULE_LEARN_SEGMENTS) {
+    // Missed segments only ever lengthen intervals, so the shortest plausible one is the period
+    if (interval >= VOSPI_MIN_SEGMENT_PERIOD_NS && interval <= VOSPI_MAX_SEGMENT_PERIOD_NS) {
+      if (schedule->samples == 0 || interval < schedule->period_ns) {
+        schedule->period_ns = interval;
+      }
+      schedule->learned_period_ns = schedule->period_ns;
+      schedule->samples ++;
+    }
+    return;
+  }
+
+  // Intervals spanning segments we didn't see are reduced to a single period
+  uint64_t periods = (interval + schedule->period_ns / 2) / schedule->period_ns;
+  if (periods < 1 || interval / periods < VOSPI_MIN_SEGMENT_PERIOD_NS ||
+      interval / periods > VOSPI_MAX_SEGMENT_PERIOD_NS) {
+    return;
+  }
+
+  // Track the period with a moving average, allowing only for drift of the camera's clock
+  int64_t error = (int64_t)(interval / periods) - (int64_t)schedule->period_ns;
+  schedule->period_ns += error / 8;
+  if (schedule->period_ns > schedule->learned_period_ns + schedule->learned_period_ns / 32) {
+    schedule->period_ns = schedule->learned_period_ns + schedule->learned_period_ns / 32;
+  }
+  if (schedule->period_ns < schedule->learned_period_ns - schedule->learned_period_ns / 32) {
+    schedule->period_ns = schedule->learned_period_ns - schedule->learned_period_ns / 32;
+  }
+  schedule->samples ++;
+}
+
+/**
+ * Sleep until shortly before the next segment is due, if it's worth doing so.
+ * Returns 1 if the thread slept, otherwise 0.
+ */
+static int schedule_sleep(vospi_device_t* dev, uint64_t now_ns)
+{
+  vospi_schedule_t* schedule = &dev->schedule;
+
+  if (!schedule->enabled || schedule->samples < VOSPI_SCHEDULE_LEARN_SEGMENTS) {
+    return 0;
+  }
+
+  // Find the next time a segment is due that's still ahead of us
+  uint64_t wake_ns = schedule->last_segment_ns + schedule->period_ns - schedule->guard_ns;
+  if (wake_ns <= now_ns) {
+    wake_ns += ((now_ns - wake_ns) / schedule->period_ns + 1) * schedule->period_ns;
+  }
+
+  // If we'd wake within the guard window anyway, keep polling
+  if (wake_ns - now_ns < schedule->guard_ns) {
+    return 0;
+  }
+
+  struct timespec wake = {
+    .tv_sec = wake_ns / 1000000000,
+    .tv_nsec = wake_ns % 1000000000
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) ;
+
+  dev->stats.sleeps ++;
+  dev->stats.slept_ns += wake_ns - now_ns;
+  return 1;
+}
+
+/**
+ * Adapt the guard window after waking from a sleep.
+ * A segment already under way on waking means the sleep was too long, so the guard widens quickly;
+ * otherwise it narrows slowly.
+ */
+static void schedule_woke(vospi_device_t* dev, int late)
+{
+  vospi_schedule_t* schedule = &dev->schedule;
+
+  if (late) {
+    dev->stats.late_wakeups ++;
+    schedule->guard_ns *= 2;
+    if (schedule->guard_ns > schedule->period_ns / 2) {
+      schedule->guard_ns = schedule->period_ns / 2;
+    }
+  } else if (schedule->guard_ns > VOSPI_SCHEDULE_MIN_GUARD_NS) {
+    schedule->guard_ns -= schedule->guard_ns / 64;
+  }
+}
+
+/**
+ * Check that each of a segment's packets carries its own packet number.
+ * Returns the index of the first packet that doesn't, or -1 if they all do.
+ */
+static int find_misnumbered_packet(vospi_packet_t* packets, int count)
+{
+  for (int i = 0; i < count; i ++) {
+    if ((packets[i].id & 0x0fff) != i) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Find a segment starting at or after the given packet: a packet numbered 0 followed by
+ * consecutively-numbered packets up to the last one received.
+ * Returns the index of its first packet, or -1 if there isn't one.
+ */
+static int find_segment_start(vospi_packet_t* packets, int from, int count)
+{
+  int start, i;
+
+  for (start = from; start < count; start ++) {
+    if ((packets[start].id & 0x0fff) != 0) {
+      continue;
+    }
+    for (i = start + 1; i < count && (packets[i].id & 0x0fff) == i - start; i ++);
+    if (i == count) {
+      return start;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Get the number of video packets in each of a geometry's segments.
+ */
+static int video_packets_per_segment(const vospi_geometry_t* geometry)
+{
+  return geometry->width * geometry->height / VOSPI_PACKET_PIXELS / geometry->segments_per_frame;
+}
+
+/**
+ * Get the number of packets in each of a geometry's segments when telemetry is enabled.
+ */
+static int telemetry_packets_per_segment(const vospi_geometry_t* geometry)
+{
+  return video_packets_per_segment(geometry) + geometry->telemetry_packets / geometry->segments_per_frame;
+}
+
 /**
  * Transfer a single VoSPI segment.
+ * Until it's known whether telemetry is enabled, a segment without telemetry is received, then one
+ * packet more to tell from its numbering whether the segment runs on; the segment's packet count
+ * is set accordingly, and a packet that turns out to belong to whatever follows is carried over.
+ * If the packets received are misnumbered, realign with the next segment boundary rather than
+ * returning a segment that straddles two; should that fail, the segment is returned misnumbered.
  * Returns the number of successfully-transferred segments (0 or 1).
  */
-int transfer_segment(int fd, vospi_segment_t* segment)
+int transfer_segment(vospi_device_t* dev, vospi_segment_t* segment)
 {
-  // Perform the spidev transfer
-  if (read(fd, &segment->packets[0], VOSPI_PACKET_BYTES) < 1) {
-    log_fatal("SPI: failed to transfer packet");
-    return 0;
+  vospi_packet_t* packets = segment->packets;
+  uint64_t before_ns, after_ns, vsync_ns = 0;
+  int video_packets = video_packets_per_segment(dev->geometry);
+  int count = dev->packets_per_segment ? dev->packets_per_segment : video_packets;
+  int first, slept = 0, pulses, misnumbered, number, start, last, skip, realigns = 0;
+
+  // Wait for the camera to signal that the segment is ready
+  if (dev->vsync_fd >= 0) {
+    if (!(pulses = vsync_wait(dev->vsync_fd, &vsync_ns))) {
+      return 0;
+    }
+    dev->stats.vsync_pulses += pulses;
+    dev->stats.missed_vsync_pulses += pulses - 1;
+  }
+
+  // Receive a segment's worth of packets, skipping any discard packets that precede the segment
+receive:
+  do {
+    before_ns = monotonic_ns();
+    if (!receive_packets(dev, packets, count)) {
+      return 0;
+    }
+    after_ns = monotonic_ns();
+
+    for (first = 0; first < count; first ++) {
+      if ((packets[first].id & 0x0f00) != 0x0f00) {
+        break;
+      }
+    }
+
+    dev->stats.discard_packets += first;
+
+    if (slept) {
+      schedule_woke(dev, first == 0);
+      slept = 0;
+    }
+
+    // No segment ready yet - rather than clocking out discard packets, wait for the next one
+    if (first == count && dev->vsync_fd < 0) {
+      slept = schedule_sleep(dev, after_ns);
+    }
+  } while (first == count);
+
+  // Take the segment's start from VSYNC, or estimate it from where it fell within the transfer
+  segment_started(
+    dev,
+    vsync_ns ? vsync_ns : before_ns + (after_ns - before_ns) * first / count
+  );
+
+  // If the segment started part-way through, move it into place and receive the remainder
+  if (first > 0) {
+    memmove(packets, &packets[first], sizeof(vospi_packet_t) * (count - first));
+    if (!transfer_packets(dev, &packets[count - first], first)) {
+      return 0;
+    }
   }
 
-  // Flip the byte order of the ID & CRC
-  segment->packets[0].id = FLIP_WORD_BYTES(segment->packets[0].id);
-  segment->packets[0].crc = FLIP_WORD_BYTES(segment->packets[0].crc);
+  while (1) {
+
+    // A video segment's worth of well-numbered packets followed by one more tells us telemetry is
+    // on, in which case the rest of it is received; otherwise the packets past the end of the
+    // segment are the start of whatever follows, so they're kept for the next transfer
+    if (!dev->packets_per_segment && find_misnumbered_packet(packets, video_packets) == -1) {
+      if (count == video_packets) {
+        if (!transfer_packets(dev, &packets[count], 1)) {
+          return 0;
+        }
+        count ++;
+      }
+      if ((packets[video_packets].id & 0x0fff) == video_packets) {
+        log_info("telemetry is enabled");
+        start = count;
+        count = telemetry_packets_per_segment(dev->geometry);
+        if (!transfer_packets(dev, &packets[start], count - start)) {
+          return 0;
+        }
+      } else {
+        log_info("telemetry is disabled");
+        dev->telemetry = VOSPI_TELEMETRY_NONE;
+        dev->carried_packet_count = count - video_packets;
+        memcpy(
+          dev->carried_packets, &packets[video_packets], sizeof(vospi_packet_t) * dev->carried_packet_count
+        );
+        count = video_packets;
+      }
+      dev->packets_per_segment = count;
+    }
+
+    // Every packet should carry its own number - if one doesn't, we've lost our place in the stream
+    if ((misnumbered = find_misnumbered_packet(packets, count)) == -1) {
+      break;
+    }
 
-  while ((segment->packets[0].id & 0x0f00) == 0x0f00) {
-    // It was a discard packet, try receiving another packet into the same buf
-    read(fd, &segment->packets[0], VOSPI_PACKET_BYTES);
+    // A segment running on past its end, or ending where one without telemetry would, means
+    // telemetry has been switched on or off - find out which all over again
+    number = packets[misnumbered].id & 0x0fff;
+    if (dev->packets_per_segment &&
+        ((misnumbered == 0 && number == count) ||
+         (misnumbered == video_packets && number == 0 && count > video_packets))) {
+      log_info("segment length has changed - checking for telemetry again");
+      dev->packets_per_segment = 0;
+      dev->telemetry = VOSPI_TELEMETRY_UNKNOWN;
+      if (misnumbered == video_packets) {
+        continue;
+      }
+      count = video_packets;
+      goto receive;
+    }
+
+    // Give up and leave the caller to drop the segment if we can't find our way back
+    if (++ realigns > VOSPI_MAX_REALIGNS) {
+      log_debug("unable to realign with a segment boundary");
+      break;
+    }
+
+    // If the next segment began part-way through, move it into place and receive the remainder
+    start = find_segment_start(packets, misnumbered, count);
+    if (start != -1) {
+      log_debug("realigning with a segment starting at packet %d", start);
+      dev->stats.realigned_segments ++;
+      memmove(packets, &packets[start], sizeof(vospi_packet_t) * (count - start));
+      if (!transfer_packets(dev, &packets[count - start], start)) {
+        return 0;
+      }
+      continue;
+    }
+
+    // Otherwise we're part-way through a segment, so clock out the rest of it and start afresh
+    // with the one after, which will be preceded by discard packets if it isn't ready yet
+    last = packets[count - 1].id & 0x0fff;
+    skip = last < count ? count - 1 - last : 0;
+    log_debug("skipping %d packets to the end of a partial segment", skip);
+    dev->stats.skipped_segments ++;
+    if (skip > 0 && !transfer_packets(dev, packets, skip)) {
+      return 0;
+    }
+    goto receive;
   }
 
-  // Read the remaining packets
-  if (read(fd, &segment->packets[1], VOSPI_PACKET_BYTES * (segment->packet_count - 1)) < 1) {
-    log_fatal(
-      "SPI: failed to transfer the rest of the segment - "
-      "Check to ensure that the bufsiz module parameter for spidev is set to > %d bytes",
-      VOSPI_PACKET_BYTES * segment->packet_count
-    );
-    return 0;
+  segment->packet_count = count;
+  return 1;
+}
+
+/**
+ * Check the CRC of every packet in a segment.
+ * Returns 1 if all of the packets are intact, otherwise 0.
+ */
+static int verify_segment_crc(vospi_device_t* dev, vospi_segment_t* segment)
+{
+  int valid = 1;
+
+  for (int i = 0; i < segment->packet_count; i ++) {
+    vospi_packet_t* packet = &segment->packets[i];
+
+    // The CRC covers the whole packet, with the CRC and the top four bits of the ID zeroed
+    uint8_t header[4] = { (packet->id >> 8) & 0x0f, packet->id & 0xff, 0, 0 };
+    uint16_t crc = crc16_ccitt(0, header, sizeof(header));
+    crc = crc16_ccitt(crc, packet->symbols, VOSPI_PACKET_SYMBOLS);
+
+    if (crc != packet->crc) {
+      log_debug("CRC mismatch in packet %d (%04x, expected %04x)", i, crc, packet->crc);
+      dev->stats.crc_errors ++;
+      valid = 0;
+    }
+  }
+
+  return valid;
+}
+
+/**
+ * Get a packet of a frame by its position in the frame, given the number of packets per segment.
+ */
+static inline vospi_packet_t* frame_packet(vospi_frame_t* frame, int packets_per_segment, int index)
+{
+  return &frame->segments[index / packets_per_segment].packets[index % packets_per_segment];
+}
+
+/**
+ * Check whether a packet looks like telemetry row A.
+ * Row A carries the FPA temperature in Kelvin x 100, which is beyond the range of any 14-bit pixel.
+ */
+static int is_telemetry_row_a(vospi_packet_t* packet)
+{
+  return parse_telemetry_packet(packet).fpa_temp_kelvin_100 > 0x3fff;
+}
+
+/**
+ * Move a frame's telemetry packets (if any) into its telemetry rows, closing up the video packets
+ * so that each segment holds only video, as it would with telemetry disabled.
+ * The first time telemetry is seen, it's located by looking for row A at either end of the frame.
+ * Returns 1 on success, or 0 if the frame's telemetry couldn't be located.
+ */
+static int split_telemetry(vospi_device_t* dev, vospi_frame_t* frame)
+{
+  const vospi_geometry_t* geometry = dev->geometry;
+  int video_packets = video_packets_per_segment(geometry);
+  int frame_video_packets = video_packets * geometry->segments_per_frame;
+  int packets_per_segment = frame->segments[0].packet_count;
+  int header, footer, offset, i;
+
+  frame->telemetry_packet_count = 0;
+  if (packets_per_segment == video_packets) {
+    return 1;
   }
 
-  // Flip the byte order for the rest of the packet IDs
-  for (int i = 1; i < segment->packet_count; i ++) {
-    segment->packets[i].id = FLIP_WORD_BYTES(segment->packets[i].id);
-    segment->packets[i].crc = FLIP_WORD_BYTES(segment->packets[i].crc);
+  // Telemetry being toggled part-way through would leave segments of different lengths
+  for (int seg = 1; seg < geometry->segments_per_frame; seg ++) {
+    if (frame->segments[seg].packet_count != packets_per_segment) {
+      return 0;
+    }
+  }
+
+  if (dev->telemetry == VOSPI_TELEMETRY_UNKNOWN) {
+    header = is_telemetry_row_a(frame_packet(frame, packets_per_segment, 0));
+    footer = is_telemetry_row_a(frame_packet(frame, packets_per_segment, frame_video_packets));
+    if (header == footer) {
+      log_debug("unable to locate telemetry rows");
+      return 0;
+    }
+    dev->telemetry = header ? VOSPI_TELEMETRY_HEADER : VOSPI_TELEMETRY_FOOTER;
+    log_info("telemetry is in the %s", header ? "header" : "footer");
+  }
+
+  offset = dev->telemetry == VOSPI_TELEMETRY_HEADER ? 0 : frame_video_packets;
+  for (i = 0; i < geometry->telemetry_packets; i ++) {
+    frame->telemetry[i] = *frame_packet(frame, packets_per_segment, offset + i);
+  }
+  frame->telemetry_packet_count = geometry->telemetry_packets;
+
+  // Close up the video packets, working in whichever direction doesn't overwrite those yet to move
+  if (dev->telemetry == VOSPI_TELEMETRY_HEADER) {
+    for (i = 0; i < frame_video_packets; i ++) {
+      *frame_packet(frame, video_packets, i) =
+        *frame_packet(frame, packets_per_segment, i + geometry->telemetry_packets);
+    }
+  } else {
+    for (i = frame_video_packets - 1; i >= 0; i --) {
+      *frame_packet(frame, video_packets, i) = *frame_packet(frame, packets_per_segment, i);
+    }
+  }
+
+  for (int seg = 0; seg < geometry->segments_per_frame; seg ++) {
+    frame->segments[seg].packet_count = video_packets;
   }
 
   return 1;
@@ -82,18 +617,24 @@ int transfer_segment(int fd, vospi_segment_t* segment)
  * Synchroise the VoSPI stream and transfer a single frame.
  * Returns the number of successfully-transferred frames (0 or 1).
  */
-int sync_and_transfer_frame(int fd, vospi_frame_t* frame)
+int sync_and_transfer_frame(vospi_device_t* dev, vospi_frame_t* frame)
 {
   // Keep streaming segments until we receive a valid, first segment to sync
   log_debug("synchronising with first segment");
   uint16_t packet_20_num;
   uint8_t ttt_bits, resets = 0;
 
+  dev->stats.syncs ++;
+
+  // Find out afresh whether telemetry is enabled, and where
+  dev->telemetry = VOSPI_TELEMETRY_UNKNOWN;
+  dev->packets_per_segment = 0;
+
   while (1) {
 
       // Stream a first segment
       log_debug("receiving first segment...");
-      if (!transfer_segment(fd, &frame->segments[0])) {
+      if (!transfer_segment(dev, &frame->segments[0])) {
         log_error("failed to receive the first segment");
         return 0;
       }
@@ -113,6 +654,13 @@ int sync_and_transfer_frame(int fd, vospi_frame_t* frame)
           continue;
       }
 
+      frame->timestamp_ns = dev->schedule.last_segment_ns;
+
+      // Single-segment frames have no TTT bits, so any valid segment is the start of a frame
+      if (dev->geometry->segments_per_frame == 1) {
+        break;
+      }
+
       // Check we're looking at the first segment, if not, just keep reading until we get there
       ttt_bits = frame->segments[0].packets[20].id >> 12;
       log_debug("TTT bits were: %dm P20 Num: %d", ttt_bits, packet_20_num);
@@ -122,35 +670,180 @@ int sync_and_transfer_frame(int fd, vospi_frame_t* frame)
   }
 
   // Receive the remaining segments
-  for (int seg = 1; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-    transfer_segment(fd, &frame->segments[seg]);
+  for (int seg = 1; seg < dev->geometry->segments_per_frame; seg ++) {
+    if (!transfer_segment(dev, &frame->segments[seg])) {
+      return 0;
+    }
+  }
+
+  // If the telemetry can't be located in this frame, carry on to the next
+  if (!split_telemetry(dev, frame)) {
+    return transfer_frame(dev, frame);
   }
 
   return 1;
 }
 
 /**
- * Transfer a frame.
- * Assumes that we're already synchronised with the VoSPI stream.
+ * Transfer a frame made up of a fixed number of segments.
+ * Always inlined so that each geometry gets its own copy of the loop with the segment count folded in.
  */
-int transfer_frame(int fd, vospi_frame_t* frame)
+static inline __attribute__((always_inline))
+int transfer_frame_segments(vospi_device_t* dev, vospi_frame_t* frame, const int segments)
 {
   uint8_t ttt_bits, restarts = 0;
+  uint32_t realigned = dev->stats.realigned_segments, skipped = dev->stats.skipped_segments;
 
   // Receive all segments
-  for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-    transfer_segment(fd, &frame->segments[seg]);
+  for (int seg = 0; seg < segments; seg ++) {
+    if (!transfer_segment(dev, &frame->segments[seg])) {
+      return 0;
+    }
+
+    // Every attempt at a frame gets a sequence number of its own, so that segments already passed
+    // on from an attempt that's restarted can't be mistaken for the restarted frame's
+    if (seg == 0) {
+      frame->timestamp_ns = dev->schedule.last_segment_ns;
+      frame->sequence = ++ dev->frames_started;
+    }
+
+    // A segment we couldn't realign is as good as corrupt, but the stream is still flowing, so
+    // drop the frame and start on the next one rather than resynchronising
+    if (find_misnumbered_packet(frame->segments[seg].packets, frame->segments[seg].packet_count) != -1) {
+      log_debug("dropping frame with misnumbered segment %d", seg + 1);
+      dev->stats.misnumbered_segments ++;
+      dev->stats.dropped_frames ++;
+      seg = -1;
+      if (restarts ++ > VOSPI_MAX_INVALID_FRAMES * 4) {
+        log_error("too many invalid frames - need to resync");
+        return 0;
+      }
+      continue;
+    }
 
+    // A corrupt segment can't be received again, so drop the frame and start on the next one
+    if (dev->verify_crc && !verify_segment_crc(dev, &frame->segments[seg])) {
+      log_debug("dropping frame with corrupt segment %d", seg + 1);
+      dev->stats.dropped_frames ++;
+      seg = -1;
+      if (restarts ++ > VOSPI_MAX_INVALID_FRAMES * 4) {
+        log_error("too many invalid frames - need to resync");
+        return 0;
+      }
+      continue;
+    }
+
+    // Single-segment frames carry no TTT bits to check
     ttt_bits = frame->segments[seg].packets[20].id >> 12;
-    if (ttt_bits != seg + 1) {
-      seg --;
+    if (segments > 1 && ttt_bits != seg + 1) {
+      if (restarts ++ > VOSPI_MAX_INVALID_FRAMES * 4) {
+        log_error("too many invalid frames - need to resync");
+        return 0;
+      }
+
+      // A segment has been missed, so the frame can't be completed. Rather than waiting for the
+      // missing segment to come round again in the next frame (and tearing this one), restart the
+      // frame - from this segment if it happens to be the first of the next frame.
+      if (ttt_bits != 1) {
+        seg = -1;
+        continue;
+      }
+      log_debug("restarting frame from segment 1 after missing segment %d", seg + 1);
+      memcpy(&frame->segments[0], &frame->segments[seg], sizeof(vospi_segment_t));
+      frame->timestamp_ns = dev->schedule.last_segment_ns;
+      frame->sequence = ++ dev->frames_started;
+      seg = 0;
+    }
+
+    // Once the frame is complete, move its telemetry aside - a frame whose telemetry can't be
+    // located is dropped
+    if (seg == segments - 1 && !split_telemetry(dev, frame)) {
+      dev->stats.dropped_frames ++;
+      seg = -1;
       if (restarts ++ > VOSPI_MAX_INVALID_FRAMES * 4) {
         log_error("too many invalid frames - need to resync");
         return 0;
       }
       continue;
     }
+
+    // Segments only hold whole video rows once any telemetry has been moved aside
+    if (dev->segment_received) {
+      if (dev->telemetry == VOSPI_TELEMETRY_NONE) {
+        dev->segment_received(dev, frame, seg);
+      } else if (seg == segments - 1) {
+        for (int received = 0; received < segments; received ++) {
+          dev->segment_received(dev, frame, received);
+        }
+      }
+    }
   }
 
+  // Credit each recovery path that kept this frame from being lost
+  dev->stats.realigned_frames += dev->stats.realigned_segments != realigned;
+  dev->stats.skipped_frames += dev->stats.skipped_segments != skipped;
+  dev->stats.restarted_frames += restarts > 0;
+
+  dev->stats.frames ++;
   return 1;
 }
+
+/**
+ * Transfer a Lepton 2.x frame (80x60, a single segment).
+ */
+static int transfer_frame_lepton2(vospi_device_t* dev, vospi_frame_t* frame)
+{
+  return transfer_frame_segments(dev, frame, 1);
+}
+
+/**
+ * Transfer a Lepton 3.x frame (160x120, four segments).
+ */
+static int transfer_frame_lepton3(vospi_device_t* dev, vospi_frame_t* frame)
+{
+  return transfer_frame_segments(dev, frame, 4);
+}
+
+// Supported camera geometries
+const vospi_geometry_t vospi_geometry_lepton2 = {
+  .name = "Lepton 2.x",
+  .width = 80,
+  .height = 60,
+  .segments_per_frame = 1,
+  .telemetry_packets = 3,
+  .transfer_frame = transfer_frame_lepton2
+};
+
+const vospi_geometry_t vospi_geometry_lepton3 = {
+  .name = "Lepton 3.x",
+  .width = 160,
+  .height = 120,
+  .segments_per_frame = 4,
+  .telemetry_packets = 4,
+  .transfer_frame = transfer_frame_lepton3
+};
+
+/**
+ * Get the geometry for a Lepton major version (2 or 3).
+ * Returns NULL for unsupported versions.
+ */
+const vospi_geometry_t* vospi_geometry_for_model(int lepton_version)
+{
+  switch (lepton_version) {
+    case 2:
+      return &vospi_geometry_lepton2;
+    case 3:
+      return &vospi_geometry_lepton3;
+    default:
+      return NULL;
+  }
+}
+
+/**
+ * Transfer a frame.
+ * Assumes that we're already synchronised with the VoSPI stream.
+ */
+int transfer_frame(vospi_device_t* dev, vospi_frame_t* frame)
+{
+  return dev->geometry->transfer_frame(dev, frame);
+}
@@ -0,0 +1,56 @@
+#include "vsync.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+/**
+ * Request rising-edge events from the GPIO line the camera's VSYNC output (GPIO3) is wired to.
+ * chip_fd is an open GPIO character device (I.e. /dev/gpiochip0).
+ * Returns a file descriptor to read events from, or -1 on failure.
+ */
+int vsync_init(int chip_fd, unsigned int line)
+{
+  struct gpio_v2_line_request request;
+  memset(&request, 0, sizeof(request));
+
+  request.offsets[0] = line;
+  request.num_lines = 1;
+  request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING;
+  strncpy(request.consumer, "leptonic-vsync", sizeof(request.consumer) - 1);
+
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request) == -1) {
+    log_error("GPIO: failed to request edge events for line %u", line);
+    return -1;
+  }
+
+  return request.fd;
+}
+
+/**
+ * Wait for the next VSYNC pulse.
+ * Any pulses already queued are consumed, and the most recent one is taken as the current one.
+ * Sets timestamp_ns to the kernel's CLOCK_MONOTONIC timestamp of the pulse.
+ * Returns the number of pulses consumed (more than 1 means some were missed), or 0 on failure.
+ */
+int vsync_wait(int line_fd, uint64_t* timestamp_ns)
+{
+  struct gpio_v2_line_event events[VSYNC_EVENT_BATCH];
+  ssize_t count;
+
+  while ((count = read(line_fd, events, sizeof(events))) == -1 && errno == EINTR) ;
+
+  if (count < (ssize_t)sizeof(struct gpio_v2_line_event)) {
+    log_error("GPIO: failed to read VSYNC event");
+    return 0;
+  }
+
+  count /= sizeof(struct gpio_v2_line_event);
+  *timestamp_ns = events[count - 1].timestamp_ns;
+
+  return count;
+}
@@ -1,101 +1,919 @@
+#define _GNU_SOURCE
 #include "log.h"
 #include "vospi.h"
+#include "cci.h"
+#include "vsync.h"
+#include "recording.h"
+#include "ring.h"
+#include "fanout.h"
+#include "arena.h"
+#include "unpack.h"
+#include "delta.h"
+#include "telemetry.h"
+#include "metadata.h"
+#include "shm.h"
+#include "render.h"
+#include "http.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <assert.h>
 #include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <endian.h>
+#include <signal.h>
+#include <limits.h>
 #include <zmq.h>
+#include <jpeglib.h>
+#include <jerror.h>
 
 // The default spec for the ZMQ socket that will be used for comms with the frontend
 #define ZMQ_DEFAULT_SOCKET_SPEC "tcp://*:5555"
 
+// The default high-water mark of the publishing socket (in message parts), kept low for live view
+#define PUBLISH_DEFAULT_HWM 16
+
+// How often (in frames) to send a delta-encoded keyframe, unless asked for one sooner
+#define KEYFRAME_DEFAULT_INTERVAL 30
+
+// The directory the web frontend is served from by the HTTP server, unless given
+#define HTTP_DEFAULT_ROOT "frontend"
+
+// The quality (out of 100) frames are compressed at for MJPEG streams
+#define MJPEG_QUALITY 80
+
+// The room set aside for each compressed frame, which a 160x120 JPEG can never outgrow: it's 80
+// MCUs of 6 blocks (at 4:2:0), each of them at worst a 16-bit Huffman code and 11 bits for the DC
+// coefficient and a 16-bit code and 10 bits for each of the 63 AC ones, doubled in case every byte
+// is stuffed, and then up to 2 KiB of headers and tables
+#define MJPEG_BUF_SIZE (80 * 6 * ((16 + 11 + 63 * (16 + 10) + 7) / 8 * 2) + 2048)
+
+// The region of the arena each camera's JPEG compressor allocates from, nearly four times the
+// 17 KiB compressing a 160x120 frame takes
+#define MJPEG_POOL_SIZE (64 * 1024)
+
 // The size of the circular frame buffer
 #define FRAME_BUF_SIZE 8
 
-// Positions of the reader and writer in the frame buffer
-int reader = 0, writer = 0;
+// The largest number of consumers each camera's frames can be shared between
+#define MAX_FRAME_CONSUMERS 4
+
+// The largest number of each camera's frames that can be in the middle of zero-copy sends at once;
+// any more are copied instead
+#define MAX_FRAMES_SENDING 8
+
+// The number of frame slots each camera needs: those shared by its consumers and being sent, and
+// the one the socket thread reads telemetry from before its first frame
+#define FRAME_SLOTS_PER_CAMERA (FANOUT_SLOTS(FRAME_BUF_SIZE, MAX_FRAME_CONSUMERS, MAX_FRAMES_SENDING) + 1)
+
+// The number of slots in each camera's shared-memory ring (about a second of frames), which is how
+// far behind a local reader can fall before it misses frames
+#define SHM_SLOTS_PER_CAMERA 8
+
+// The largest number of cameras that can be captured from by a single process
+#define MAX_CAMERAS 4
+
+// How often (in frames) to log VoSPI stream statistics
+#define STATS_LOG_INTERVAL 1000
+
+// The default SCHED_FIFO priority of the capture thread in realtime mode
+#define REALTIME_DEFAULT_PRIORITY 50
+// The stack size of the capture thread in realtime mode, all of which is prefaulted
+#define REALTIME_STACK_SIZE (256 * 1024)
+#define REALTIME_STACK_PREFAULT (192 * 1024)
+
+// Whether to verify the CRC of every received VoSPI packet
+int verify_crc = 0;
+
+// Whether to sleep until segments are due rather than polling for them
+int schedule_segments = 0;
+
+// Whether to run the capture thread under SCHED_FIFO, pinned to a CPU with all memory locked
+int realtime = 0;
+int realtime_priority = REALTIME_DEFAULT_PRIORITY;
+
+// The geometry of the cameras' frames, and whether it was given explicitly
+const vospi_geometry_t* geometry = &vospi_geometry_lepton3;
+int geometry_given = 0;
+
+// A file to record every transfer to, if any, and whether to replay recordings as fast as possible
+// rather than at the pace they were recorded
+char* record_path = NULL;
+int replay_flat_out = 0;
+
+// How the socket thread reads frames, and what to do when it falls behind (by default, serve the newest)
+fanout_policy_t frame_policy = FANOUT_LATEST;
+
+// Set when asked to stop, so that the capture threads can finish any recordings cleanly
+volatile sig_atomic_t stopping = 0;
+
+// Part number prefixes of the camera models, used to identify the camera over CCI
+struct {
+  const char* part_number;
+  int lepton_version;
+} camera_models[] = {
+  {"500-0643", 2}, // Lepton 1.6 (80x60)
+  {"500-0659", 2}, // Lepton 2.0
+  {"500-0763", 2}, // Lepton 2.5
+  {"500-0726", 3}, // Lepton 3.0
+  {"500-0758", 3}, // Lepton 3.1R
+  {"500-0771", 3}, // Lepton 3.5
+};
+
+// The pixels of a single segment, published as soon as the segment is received
+typedef struct __attribute__((packed)) {
+  // The sequence number of the frame the segment belongs to (little-endian), which may never be
+  // completed if the frame's dropped or restarted
+  uint32_t frame_sequence;
+  // The segment's position in the frame (from 1) and the number of segments in a frame
+  uint8_t segment;
+  uint8_t segments_per_frame;
+  uint16_t reserved;
+  uint8_t pixels[VOSPI_PACKETS_PER_SEGMENT_NORMAL * VOSPI_PACKET_SYMBOLS];
+} segment_message_t;
+
+// Whether to publish each segment as it arrives, as well as whole frames
+int publish_segments = 0;
+
+// Whether to serve frames in reply to requests (ZMQ_REP) rather than pushing them to subscribers as
+// soon as they're captured (ZMQ_XPUB), and how many message parts may queue for each subscriber
+int request_reply = 0;
+int publish_hwm = PUBLISH_DEFAULT_HWM;
+
+// How often (in frames) delta-encoded frames are sent as keyframes
+int keyframe_interval = KEYFRAME_DEFAULT_INTERVAL;
+
+// The name of the shared-memory ring to publish frames to for local readers, if any
+char* shm_name = NULL;
+
+// How frames are rendered to colour for clients that want them ready to display
+render_format_t render_format = RENDER_RGB;
+render_palette_t render_palette = RENDER_PALETTE_FUSION;
+renderer_t renderer;
+
+// The port to serve the web frontend and streams of frames to browsers on (0 for none), and the
+// directory the frontend is served from
+int http_port = 0;
+char* http_root = HTTP_DEFAULT_ROOT;
+http_server_t http_server;
+
+// How frames are rendered for MJPEG streams (always to RGB, in the palette above)
+renderer_t mjpeg_renderer;
+
+// What's pushed to subscribers for each camera, each under a topic of its own (I.e. "frame 1")
+typedef enum {
+  TOPIC_FRAME,
+  TOPIC_SEGMENT,
+  TOPIC_TELEMETRY,
+  TOPIC_DELTA,
+  TOPIC_RENDERED,
+  TOPIC_COUNT
+} topic_t;
+
+const char* topic_names[TOPIC_COUNT] = {"frame", "segment", "telemetry", "delta", "rendered"};
+
+// The tag sent ahead of frames, segments and telemetry requested from a particular camera
+typedef struct __attribute__((packed)) {
+  // The camera's index, in the order the cameras were given
+  uint8_t camera;
+  uint8_t reserved[3];
+  // The sequence number of the frame (little-endian)
+  uint32_t frame_sequence;
+} camera_tag_t;
+
+// libjpeg's memory manager, replaced by one allocating from a region of the arena: what lasts as
+// long as the compressor from the bottom, and what's needed for each image from the top, all of
+// that given back once the image is finished
+typedef struct {
+  struct jpeg_memory_mgr pub;
+  uint8_t* base;
+  size_t size;
+  size_t permanent_used;
+  size_t image_used;
+} jpeg_arena_mgr_t;
+
+// A camera being captured from, with its own capture thread and buffers
+typedef struct {
+  // The VoSPI device comes first, so that callbacks given the device can find their camera
+  vospi_device_t dev;
+  int index;
+  char name[24];
+  char* spidev_path;
+  const vospi_geometry_t* geometry;
+  // The CCI I2C device used to identify & configure the camera, if any
+  char* i2c_path;
+  // The GPIO chip & line wired to the camera's VSYNC output (GPIO3), if capture should wait on it
+  char* vsync_chip_path;
+  unsigned int vsync_line;
+  // The CPU to pin the capture thread to, or -1 to leave it to the scheduler
+  int cpu;
+  pthread_t thread;
+  // Frames shared between their consumers, and the buffer of individually-published segments
+  fanout_t frames;
+  ring_t segment_ring;
+  // The socket thread's view of the frames, and the slot holding the frame it sent last
+  fanout_consumer_t* socket_consumer;
+  vospi_frame_t* socket_slot;
+  // Free segment slots, owned by the capture and socket threads respectively when they start
+  segment_message_t* capture_segment_slot;
+  segment_message_t* socket_segment_slot;
+  // The camera's topics, and the number of subscriptions matching each
+  char topics[TOPIC_COUNT][16];
+  int subscriptions[TOPIC_COUNT];
+  // The number of frames copied to the socket because too many were already being sent without copying
+  uint32_t copied_frames;
+  // The metadata and unpacked pixels of the frame the socket thread is sending
+  frame_metadata_t metadata;
+  uint16_t* frame_pixels;
+  // The socket thread's delta encoder for the camera's frames, and the encoded frame
+  delta_encoder_t encoder;
+  uint8_t* delta_buf;
+  // The frame rendered to colour by the socket thread
+  uint8_t* render_buf;
+  // The shm thread's view of the frames, notifications of them, and the shared-memory ring it
+  // publishes them to, if any
+  fanout_consumer_t* shm_consumer;
+  int shm_event_fd;
+  shm_publisher_t shm;
+  // The HTTP thread's view of the frames, and the metadata, unpacked pixels, delta encoder and
+  // buffers it streams them to browsers with, apart from the socket thread's
+  fanout_consumer_t* http_consumer;
+  frame_metadata_t http_metadata;
+  uint16_t* http_pixels;
+  delta_encoder_t http_encoder;
+  uint8_t* http_delta_buf;
+  uint8_t* http_rgb_buf;
+  uint8_t* http_jpeg_buf;
+  // The HTTP thread's JPEG compressor for MJPEG streams, set up once at startup
+  struct jpeg_compress_struct http_compressor;
+  struct jpeg_error_mgr http_jpeg_errors;
+  jpeg_arena_mgr_t http_jpeg_memory;
+  // When capture started on CLOCK_MONOTONIC, and the CPU time used once it's finished
+  struct timespec capture_started;
+  uint64_t finished_cpu_ns;
+  int finished;
+} camera_t;
+
+camera_t cameras[MAX_CAMERAS];
+int camera_count = 0;
+int finished_cameras = 0;
+
+// The thread publishing frames to shared memory, and whether a camera's failed, so it should close
+// every ring straight away rather than as each camera finishes
+pthread_t shm_thread;
+int capture_failed = 0;
+
+// The size of a frame's pixels packed into a contiguous plane, large enough for any geometry
+#define FRAME_PIXELS_SIZE (VOSPI_SEGMENTS_PER_FRAME * VOSPI_PACKETS_PER_SEGMENT_NORMAL * VOSPI_PACKET_SYMBOLS)
+
+// A frame slot: the frame as received, and room for its pixels to be packed into a plane by the
+// socket thread (the only thread that sends them) and sent straight from the slot
+typedef struct {
+  // The frame comes first, so that a slot can be used as a frame
+  vospi_frame_t frame;
+  camera_t* camera;
+  size_t pixels_size;
+  // The number of frames the camera had dropped when the frame was captured
+  uint32_t dropped_frames;
+  _Alignas(ARENA_ALIGNMENT) uint8_t pixels[FRAME_PIXELS_SIZE];
+} frame_slot_t;
+
+// The arena every camera's slots and the socket thread's telemetry buffer are allocated from at startup
+arena_t arena;
+
+// The buffer telemetry rows are packed into for sending
+#define TELEMETRY_BUF_SIZE (VOSPI_MAX_TELEMETRY_PACKETS * VOSPI_PACKET_SYMBOLS)
+unsigned char* telemetry_buf;
+
+/**
+ * Publish a segment as soon as it's been received.
+ * Called by transfer_frame() from the capture thread for each segment. A frame that's dropped or
+ * restarted part-way never gets the rest of its segments, and the restart is published under a
+ * sequence number of its own.
+ */
+void publish_segment(vospi_device_t* dev, vospi_frame_t* frame, int seg)
+{
+  camera_t* camera = (camera_t*)dev;
+  segment_message_t* message = camera->capture_segment_slot;
+
+  message->frame_sequence = htole32(frame->sequence);
+  message->segment = seg + 1;
+  message->segments_per_frame = dev->geometry->segments_per_frame;
+
+  // Pack the segment's pixels straight into the slot
+  for (int pkt = 0; pkt < VOSPI_PACKETS_PER_SEGMENT_NORMAL; pkt ++) {
+    memcpy(
+      &message->pixels[pkt * VOSPI_PACKET_SYMBOLS],
+      frame->segments[seg].packets[pkt].symbols,
+      VOSPI_PACKET_SYMBOLS
+    );
+  }
+
+  camera->capture_segment_slot = ring_publish(&camera->segment_ring, message);
+}
+
+/**
+ * Log the statistics of a camera's VoSPI stream, along with the CPU time used by the calling thread.
+ */
+void log_stats(camera_t* camera)
+{
+  vospi_device_t* dev = &camera->dev;
+  struct timespec cpu_time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+
+  log_info(
+    "%s VoSPI stats: %u frames, %u dropped, %u CRC errors, %u discard packets, %u transfers, %u syncs",
+    camera->name, dev->stats.frames, dev->stats.dropped_frames, dev->stats.crc_errors,
+    dev->stats.discard_packets, dev->stats.transfers, dev->stats.syncs
+  );
+  log_info(
+    "%s capture CPU time: %ld ms, %u sleeps (%llu ms) awaiting segments, %u late wakeups, period %llu us",
+    camera->name, cpu_time.tv_sec * 1000 + cpu_time.tv_nsec / 1000000,
+    dev->stats.sleeps, (unsigned long long)dev->stats.slept_ns / 1000000, dev->stats.late_wakeups,
+    (unsigned long long)dev->schedule.period_ns / 1000
+  );
+  log_info(
+    "%s resync: %u segments realigned (saving %u frames), %u partial segments skipped (saving %u frames), "
+    "%u frames restarted part-way, %u segments unrecoverable",
+    camera->name, dev->stats.realigned_segments, dev->stats.realigned_frames, dev->stats.skipped_segments,
+    dev->stats.skipped_frames, dev->stats.restarted_frames, dev->stats.misnumbered_segments
+  );
+  log_info(
+    "%s frames: %u published, %u sent by the socket thread (%u copied), %u skipped by it",
+    camera->name, atomic_load(&camera->frames.head), atomic_load(&camera->socket_consumer->received),
+    camera->copied_frames, atomic_load(&camera->socket_consumer->dropped)
+  );
+  if (shm_name != NULL) {
+    log_info(
+      "%s shm: %u frames published, %u skipped",
+      camera->name, atomic_load(&camera->shm_consumer->received), atomic_load(&camera->shm_consumer->dropped)
+    );
+  }
+  if (http_port > 0) {
+    log_info(
+      "%s HTTP: %u frames taken, %u skipped; all cameras: %u requests, %u clients turned away, "
+      "%u frames streamed, %u missed by slow clients",
+      camera->name, atomic_load(&camera->http_consumer->received), atomic_load(&camera->http_consumer->dropped),
+      http_server.stats.requests, http_server.stats.rejected, http_server.stats.frames_sent,
+      http_server.stats.frames_missed
+    );
+  }
+  if (camera->encoder.bytes_out > 0) {
+    log_info(
+      "%s delta encoding: %u keyframes, %u differences, %.2fx compression",
+      camera->name, camera->encoder.keyframes, camera->encoder.differences,
+      (double)camera->encoder.bytes_in / camera->encoder.bytes_out
+    );
+  }
+  if (dev->vsync_fd >= 0) {
+    log_info(
+      "%s VSYNC: %u pulses, %u missed",
+      camera->name, dev->stats.vsync_pulses, dev->stats.missed_vsync_pulses
+    );
+  }
+
+  // Summarise the non-empty bins of the segment interval histogram
+  char histogram[VOSPI_INTERVAL_HISTOGRAM_BINS * 16] = "";
+  size_t length = 0;
+  for (int bin = 0; bin < VOSPI_INTERVAL_HISTOGRAM_BINS; bin ++) {
+    if (dev->stats.segment_intervals[bin]) {
+      length += snprintf(
+        histogram + length, sizeof(histogram) - length, " %s%d:%u",
+        bin == VOSPI_INTERVAL_HISTOGRAM_BINS - 1 ? ">=" : "",
+        bin * VOSPI_INTERVAL_HISTOGRAM_BIN_NS / 1000000, dev->stats.segment_intervals[bin]
+      );
+    }
+  }
+  log_info(
+    "%s segment intervals (ms:count):%s, %u late segments", camera->name, histogram, dev->stats.late_segments
+  );
+}
+
+/**
+ * Log the combined statistics of all cameras, including the share of a CPU core their capture
+ * threads have used between them, to show how many cameras a core can sustain.
+ */
+void log_combined_stats()
+{
+  uint32_t frames = 0, dropped = 0, syncs = 0;
+  uint64_t cpu_ns = 0;
+  double elapsed = 0;
+  struct timespec now, cpu_time;
+  clockid_t cpu_clock;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (int i = 0; i < camera_count; i ++) {
+    camera_t* camera = &cameras[i];
+    double camera_elapsed = (now.tv_sec - camera->capture_started.tv_sec) +
+      (now.tv_nsec - camera->capture_started.tv_nsec) / 1e9;
+
+    // Stats are read without synchronisation, which is good enough for logging
+    frames += camera->dev.stats.frames;
+    dropped += camera->dev.stats.dropped_frames;
+    syncs += camera->dev.stats.syncs;
+    elapsed = camera_elapsed > elapsed ? camera_elapsed : elapsed;
+
+    if (camera->finished) {
+      cpu_ns += camera->finished_cpu_ns;
+    } else if (pthread_getcpuclockid(camera->thread, &cpu_clock) == 0 &&
+        clock_gettime(cpu_clock, &cpu_time) == 0) {
+      cpu_ns += (uint64_t)cpu_time.tv_sec * 1000000000 + cpu_time.tv_nsec;
+    }
+  }
+
+  log_info(
+    "all %d cameras: %u frames (%.1f frames/s), %u dropped, %u syncs, capture using %.1f%% of a CPU core "
+    "(%.1f%% per camera)",
+    camera_count, frames, frames / elapsed, dropped, syncs, cpu_ns / elapsed / 1e7,
+    cpu_ns / elapsed / 1e7 / camera_count
+  );
+}
+
+/**
+ * Touch the top of the calling thread's stack so that it's faulted in before it's needed.
+ */
+void prefault_stack()
+{
+  volatile uint8_t stack[REALTIME_STACK_PREFAULT];
+  memset((void*)stack, 0, sizeof(stack));
+}
+
+/**
+ * Ask the capture threads to stop, or give up on them if asked twice.
+ */
+void stop(int signal)
+{
+  if (stopping) {
+    _exit(1);
+  }
+  stopping = 1;
+}
+
+/**
+ * Finish capturing from a camera, closing any recording.
+ * Exits once every camera has finished, or straight away on failure, in either case once the shm
+ * thread has published what it can and closed the rings.
+ */
+void finish_capture(camera_t* camera, int status)
+{
+  vospi_device_t* dev = &camera->dev;
+  struct timespec now, cpu_time;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+  double elapsed = (now.tv_sec - camera->capture_started.tv_sec) +
+    (now.tv_nsec - camera->capture_started.tv_nsec) / 1e9;
+
+  log_stats(camera);
+  log_info(
+    "%s captured %u frames in %.3f s (%.1f frames/s)",
+    camera->name, dev->stats.frames, elapsed, dev->stats.frames / elapsed
+  );
+  if (dev->recorder != NULL) {
+    recording_close_writer(dev->recorder);
+  }
+
+  // Every frame's been published by now, so the shm thread can close the ring once it's caught up
+  camera->finished_cpu_ns = (uint64_t)cpu_time.tv_sec * 1000000000 + cpu_time.tv_nsec;
+  if (status != 0) {
+    __atomic_store_n(&capture_failed, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&camera->finished, 1, __ATOMIC_RELEASE);
+  if (status != 0 || __sync_add_and_fetch(&finished_cameras, 1) == camera_count) {
+    if (camera_count > 1) {
+      log_combined_stats();
+    }
+    if (shm_name != NULL) {
+      eventfd_write(camera->shm_event_fd, 1);
+      pthread_join(shm_thread, NULL);
+    }
+    exit(status);
+  }
+  if (shm_name != NULL) {
+    eventfd_write(camera->shm_event_fd, 1);
+  }
+  pthread_exit(NULL);
+}
+
+/**
+ * Pack the pixel symbols of a frame made up of a fixed number of segments into a message buffer.
+ * Always inlined so that each geometry gets its own copy of the loop with the segment count folded in.
+ */
+static inline __attribute__((always_inline))
+void pack_frame_segments(vospi_frame_t* frame, unsigned char* message_buf, const int segments)
+{
+  for (int seg = 0; seg < segments; seg ++) {
+    for (int pkt = 0; pkt < VOSPI_PACKETS_PER_SEGMENT_NORMAL; pkt ++) {
+      // Copy each packet into the message buffer
+      memcpy(message_buf, frame->segments[seg].packets[pkt].symbols, VOSPI_PACKET_SYMBOLS);
+      message_buf += VOSPI_PACKET_SYMBOLS;
+    }
+  }
+}
+
+/**
+ * Pack a Lepton 2.x frame (80x60) into a message buffer.
+ */
+void pack_frame_lepton2(vospi_frame_t* frame, unsigned char* message_buf)
+{
+  pack_frame_segments(frame, message_buf, 1);
+}
+
+/**
+ * Pack a Lepton 3.x frame (160x120) into a message buffer.
+ */
+void pack_frame_lepton3(vospi_frame_t* frame, unsigned char* message_buf)
+{
+  pack_frame_segments(frame, message_buf, 4);
+}
+
+/**
+ * Pack the pixels of a camera's frame into its slot's pixel plane, with the packing loop for the
+ * camera's geometry, so that they can be sent straight from the slot.
+ */
+void pack_frame(camera_t* camera, frame_slot_t* slot)
+{
+  if (camera->geometry->segments_per_frame == 1) {
+    pack_frame_lepton2(&slot->frame, slot->pixels);
+  } else {
+    pack_frame_lepton3(&slot->frame, slot->pixels);
+  }
+}
+
+/**
+ * Work out the metadata of a frame captured from a camera, unpacking its pixels along the way.
+ */
+void describe_frame(camera_t* camera, frame_slot_t* slot, uint16_t* pixels, frame_metadata_t* metadata)
+{
+  vospi_frame_t* frame = &slot->frame;
+  int count = camera->geometry->width * camera->geometry->height;
+  struct timespec monotonic_now, wall_clock_now;
+  uint16_t min, max;
+  uint32_t sum = 0;
+
+  unpack_frame(frame, camera->geometry, pixels, &min, &max);
+  for (int i = 0; i < count; i ++) {
+    sum += pixels[i];
+  }
+
+  // The frame's wall-clock time is found from how long ago it started
+  clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+  clock_gettime(CLOCK_REALTIME, &wall_clock_now);
+  uint64_t age_ns = (uint64_t)monotonic_now.tv_sec * 1000000000 + monotonic_now.tv_nsec - frame->timestamp_ns;
+
+  metadata->version = FRAME_METADATA_VERSION;
+  metadata->camera = camera->index;
+  metadata->size = htole16(sizeof(frame_metadata_t));
+  metadata->frame_sequence = htole32(frame->sequence);
+  metadata->timestamp_ns = htole64(frame->timestamp_ns);
+  metadata->wall_clock_ns = htole64((uint64_t)wall_clock_now.tv_sec * 1000000000 + wall_clock_now.tv_nsec - age_ns);
+  metadata->dropped_frames = htole32(slot->dropped_frames);
+  metadata->width = htole16(camera->geometry->width);
+  metadata->height = htole16(camera->geometry->height);
+  metadata->min = htole16(min);
+  metadata->max = htole16(max);
+  metadata->mean = htole16(sum / count);
 
-// semaphore tracking the number of frames available
-sem_t count_sem;
+  // Telemetry row A (which comes first) gives the FFC state, if enabled
+  metadata->ffc_state = FFC_STATE_UNKNOWN;
+  metadata->ffc_desired = 0;
+  if (frame->telemetry_packet_count > 0) {
+    telemetry_data_t telemetry = parse_telemetry_packet(&frame->telemetry[0]);
+    metadata->ffc_state = telemetry.status_bits.ffc_state;
+    metadata->ffc_desired = telemetry.status_bits.ffc_desired;
+  }
+}
 
-// a lock protecting accesses to the frame buffer
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+_Static_assert(sizeof(frame_metadata_t) <= SHM_METADATA_SIZE, "frame metadata must fit in a shared-memory slot");
+
+/**
+ * Publish a frame to a camera's shared-memory ring: its metadata, and its pixels unpacked (in host
+ * byte order) straight into the slot local readers read them from.
+ * Called only by the shm thread.
+ */
+void publish_frame_to_shm(camera_t* camera, frame_slot_t* slot)
+{
+  shm_slot_t* shm_slot = shm_begin_publish(&camera->shm);
 
-// The frame buffer
-vospi_frame_t* frame_buf[FRAME_BUF_SIZE];
+  describe_frame(camera, slot, (uint16_t*)shm_slot->payload, (frame_metadata_t*)shm_slot->metadata);
+  shm_slot->size = camera->geometry->width * camera->geometry->height * sizeof(uint16_t);
+  shm_publish(&camera->shm);
+}
 
 /**
- * Read frames from the device into the circular buffer.
+ * Open a camera's device (or the recording replayed in its place) for VoSPI, along with its VSYNC
+ * line and a recording of it if asked. Done at startup, before the arena's sealed, so that nothing
+ * is left to set up (or allocate) once its capture thread is running.
  */
-void* get_frames_from_device(void* spidev_path_ptr)
+void open_device(camera_t* camera)
 {
-    char* spidev_path = (char*)spidev_path_ptr;
-    int spi_fd;
+  vospi_device_t* dev = &camera->dev;
+  int spi_fd;
+
+  // Open the spidev device
+  log_info("opening SPI device... %s", camera->spidev_path);
+  if ((spi_fd = open(camera->spidev_path, O_RDWR)) < 0) {
+    log_fatal("SPI: failed to open device - check permissions & spidev enabled");
+    exit(-1);
+  }
 
-    // Declare a static frame to use as a scratch space to avoid locking the framebuffer while
-    // we're waiting for a new frame
-    vospi_frame_t frame;
+  // Initialise the VoSPI interface
+  if (vospi_init(dev, spi_fd, 20000000) == -1) {
+    log_fatal("SPI: failed to condition SPI device for VoSPI use.");
+    exit(-1);
+  }
+  dev->verify_crc = verify_crc;
+  dev->geometry = camera->geometry;
+  if (dev->replay != NULL) {
+    dev->replay->paced = !replay_flat_out;
+  }
+  dev->schedule.enabled = schedule_segments;
+  if (publish_segments) {
+    dev->segment_received = publish_segment;
+  }
 
-    // Initialise the segments
-    for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-      frame.segments[seg].packet_count = VOSPI_PACKETS_PER_SEGMENT_NORMAL;
+  // Wait on VSYNC pulses rather than polling, if they're wired up
+  if (camera->vsync_chip_path != NULL) {
+    int chip_fd;
+    log_info("opening GPIO chip for VSYNC... %s (line %u)", camera->vsync_chip_path, camera->vsync_line);
+    if ((chip_fd = open(camera->vsync_chip_path, O_RDONLY)) < 0 ||
+        (dev->vsync_fd = vsync_init(chip_fd, camera->vsync_line)) == -1) {
+      log_fatal("GPIO: failed to set up VSYNC events - check permissions & line number");
+      exit(-1);
     }
+    close(chip_fd);
+  }
 
-    // Open the spidev device
-    log_info("opening SPI device... %s", spidev_path);
-    if ((spi_fd = open(spidev_path, O_RDWR)) < 0) {
-      log_fatal("SPI: failed to open device - check permissions & spidev enabled");
+  // Record every transfer, if asked, to a file per camera if there's more than one
+  if (record_path != NULL) {
+    char path[PATH_MAX];
+    int record_fd;
+    if (camera_count > 1) {
+      snprintf(path, sizeof(path), "%s.%d", record_path, camera->index);
+    } else {
+      snprintf(path, sizeof(path), "%s", record_path);
+    }
+    log_info("recording VoSPI stream to %s", path);
+    if ((record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        (dev->recorder = recording_open_writer(record_fd)) == NULL) {
+      log_fatal("failed to open recording - check permissions");
       exit(-1);
     }
+  }
+}
 
-    // Initialise the VoSPI interface
-    if (vospi_init(spi_fd, 20000000) == -1) {
-        log_fatal("SPI: failed to condition SPI device for VoSPI use.");
-        exit(-1);
+/**
+ * Read frames from a camera's device into its circular buffer.
+ */
+void* get_frames_from_device(void* camera_ptr)
+{
+    camera_t* camera = (camera_t*)camera_ptr;
+    vospi_device_t* dev = &camera->dev;
+
+    // Frames are received straight into a free slot that this thread owns until it's published
+    vospi_frame_t* frame = fanout_producer_slot(&camera->frames);
+
+    if (realtime) {
+      prefault_stack();
     }
 
-    // Synchronise, then receive frames forever
+    // Synchronise, then receive frames until stopped
+    clock_gettime(CLOCK_MONOTONIC, &camera->capture_started);
     do {
 
-      log_info("aquiring VoSPI synchronisation");
+      log_info("%s aquiring VoSPI synchronisation", camera->name);
 
-      if (0 == sync_and_transfer_frame(spi_fd, &frame)) {
+      if (0 == sync_and_transfer_frame(dev, frame)) {
+        // Running out of recording to replay is how replays finish
+        if (dev->replay != NULL) {
+          finish_capture(camera, 0);
+        }
         log_error("failed to obtain frame from device.");
-        exit(-10);
+        finish_capture(camera, -10);
       }
 
-      log_info("VoSPI stream synchronised");
+      log_info("%s VoSPI stream synchronised", camera->name);
 
       do {
 
-          if (!transfer_frame(spi_fd, &frame)) {
+          if (!transfer_frame(dev, frame)) {
             break;
           }
 
-          pthread_mutex_lock(&lock);
+          // Share the frame with its consumers as it is, leaving them any work on its pixels, and
+          // carry on with a free slot
+          frame_slot_t* captured = (frame_slot_t*)frame;
+          captured->camera = camera;
+          captured->pixels_size = camera->geometry->width * camera->geometry->height * 2;
+          captured->dropped_frames = dev->stats.dropped_frames;
+          frame = fanout_publish(&camera->frames);
+
+          if (dev->stats.frames % STATS_LOG_INTERVAL == 0) {
+            log_stats(camera);
+            if (camera_count > 1 && camera->index == 0) {
+              log_combined_stats();
+            }
+          }
+
+      } while (!stopping); // While synchronised
+    } while (!stopping);  // Until stopped
+
+    finish_capture(camera, 0);
+    return NULL;
+
+}
+
+/**
+ * Pack the telemetry rows of a frame into a message buffer.
+ * Returns the size of the packed telemetry (0 if the frame has none).
+ */
+size_t pack_telemetry(vospi_frame_t* frame, unsigned char* message_buf)
+{
+  for (int pkt = 0; pkt < frame->telemetry_packet_count; pkt ++) {
+    memcpy(message_buf + pkt * VOSPI_PACKET_SYMBOLS, frame->telemetry[pkt].symbols, VOSPI_PACKET_SYMBOLS);
+  }
+  return frame->telemetry_packet_count * VOSPI_PACKET_SYMBOLS;
+}
+
+/**
+ * Release a frame slot once ZMQ has finished sending its pixels.
+ * Called from one of ZMQ's I/O threads.
+ */
+void release_sent_frame(void* pixels, void* slot_ptr)
+{
+  frame_slot_t* slot = (frame_slot_t*)slot_ptr;
+  fanout_release(&slot->camera->frames, slot);
+}
+
+/**
+ * Send the pixels of the frame the socket thread has just taken from a camera.
+ * They're packed into the frame's slot (off the capture thread, which mustn't be held up) and sent
+ * from there without copying again, the slot being retained until ZMQ has finished with it; only if
+ * too many of the camera's frames are still being sent are they copied.
+ */
+void send_frame(void* socket, camera_t* camera)
+{
+  frame_slot_t* slot = (frame_slot_t*)camera->socket_slot;
+  zmq_msg_t message;
+
+  pack_frame(camera, slot);
 
-          // Copy the newly-received frame into place
-          memcpy(frame_buf[writer], &frame, sizeof(vospi_frame_t));
+  if (fanout_retain(camera->socket_consumer) == NULL) {
+    camera->copied_frames ++;
+    zmq_send(socket, slot->pixels, slot->pixels_size, 0);
+    return;
+  }
 
-          // Move the writer ahead
-          writer = (writer + 1) & (FRAME_BUF_SIZE - 1);
+  zmq_msg_init_data(&message, slot->pixels, slot->pixels_size, release_sent_frame, slot);
+  if (zmq_msg_send(&message, socket, 0) == -1) {
+    // Closing the unsent message releases the slot
+    log_error("failed to send frame: %s", zmq_strerror(errno));
+    zmq_msg_close(&message);
+  }
+}
 
-          // Unlock and post the space semaphore
-          pthread_mutex_unlock(&lock);
-          sem_post(&count_sem);
+/**
+ * Delta-encode the frame the socket thread has just taken from a camera (and described) into the
+ * camera's delta buffer.
+ * Returns the size of the encoded frame.
+ */
+size_t encode_frame(camera_t* camera)
+{
+  return delta_encode(&camera->encoder, camera->frame_pixels, camera->socket_slot->sequence, camera->delta_buf);
+}
 
-      } while (1); // While synchronised
-    } while (1);  // Forever
+/**
+ * Render the frame the socket thread has just taken from a camera (and described) to colour in the
+ * camera's render buffer, scaled to the frame's own range.
+ * Returns the size of the rendered frame.
+ */
+size_t render_camera_frame(camera_t* camera)
+{
+  return render_frame(
+    &renderer, camera->frame_pixels, camera->geometry->width, camera->geometry->height,
+    le16toh(camera->metadata.min), le16toh(camera->metadata.max), camera->render_buf, 0
+  );
+}
 
+/**
+ * Send the metadata that precedes a frame concerning a particular camera (see describe_frame()).
+ */
+void send_frame_metadata(void* socket, camera_t* camera)
+{
+  zmq_send(socket, &camera->metadata, sizeof(frame_metadata_t), ZMQ_SNDMORE);
 }
 
 /**
- * Wait for reqests for frames on the ZMQ socket and respond with a frame each time.
+ * Send the tag that precedes a reply or publication concerning a particular camera.
+ */
+void send_camera_tag(void* socket, camera_t* camera, uint32_t frame_sequence)
+{
+  camera_tag_t tag = {
+    .camera = camera->index,
+    .frame_sequence = htole32(frame_sequence)
+  };
+  zmq_send(socket, &tag, sizeof(tag), ZMQ_SNDMORE);
+}
+
+// A request for a camera's next frame or segment, which may have to wait until there is one
+typedef struct {
+  camera_t* camera;
+  // Whether the request named the camera, in which case the reply is tagged (with metadata, for frames)
+  int tagged;
+  // Whether a segment was requested rather than a frame, or a delta-encoded or rendered frame
+  int segment;
+  int encoded;
+  int rendered;
+} request_t;
+
+/**
+ * Answer a request for a frame or segment if there's a new one to send.
+ * Returns 1 if answered, or 0 if there's nothing new yet, in which case the camera's event fd for
+ * the request (see request_event_fd()) is notified once there is.
+ */
+int answer_request(void* responder, request_t* request)
+{
+  camera_t* camera = request->camera;
+
+  // Requests for segments are answered with the next segment rather than a whole frame
+  if (request->segment) {
+    segment_message_t* next_segment = ring_try_acquire(&camera->segment_ring, camera->socket_segment_slot);
+    if (next_segment == NULL) {
+      return 0;
+    }
+    camera->socket_segment_slot = next_segment;
+    if (request->tagged) {
+      send_camera_tag(responder, camera, le32toh(next_segment->frame_sequence));
+    }
+    zmq_send(responder, next_segment, sizeof(segment_message_t), 0);
+    return 1;
+  }
+
+  // Take the next frame, releasing the one we sent last time
+  vospi_frame_t* next_frame = fanout_try_acquire(camera->socket_consumer);
+  if (next_frame == NULL) {
+    return 0;
+  }
+  camera->socket_slot = next_frame;
+
+  if (request->tagged || request->encoded || request->rendered) {
+    describe_frame(camera, (frame_slot_t*)next_frame, camera->frame_pixels, &camera->metadata);
+  }
+  if (request->tagged) {
+    send_frame_metadata(responder, camera);
+  }
+
+  // Send the frame delta-encoded or rendered if asked, or else its pixels packed into its slot
+  if (request->encoded) {
+    zmq_send(responder, camera->delta_buf, encode_frame(camera), 0);
+  } else if (request->rendered) {
+    zmq_send(responder, camera->render_buf, render_camera_frame(camera), 0);
+  } else {
+    send_frame(responder, camera);
+  }
+  return 1;
+}
+
+/**
+ * Get the event fd notified when there's something new to answer a request with.
+ */
+int request_event_fd(request_t* request)
+{
+  return request->segment ? ring_event_fd(&request->camera->segment_ring) :
+    fanout_consumer_event_fd(request->camera->socket_consumer);
+}
+
+/**
+ * Set up notifications of each camera's new frames and segments through event fds, before they're needed.
+ */
+void set_up_frame_notifications()
+{
+  for (int i = 0; i < camera_count; i ++) {
+    if (fanout_consumer_event_fd(cameras[i].socket_consumer) == -1 ||
+        (publish_segments && ring_event_fd(&cameras[i].segment_ring) == -1)) {
+      log_fatal("Failed to set up frame notifications");
+      exit(1);
+    }
+  }
+}
+
+/**
+ * Serve reqests for frames on the ZMQ socket, responding with a frame each time.
+ * Requests may name a camera by its index (I.e. "frame 1" or "segment 2"), in which case the reply
+ * comes from that camera and is preceded by a frame_metadata_t part (or a camera_tag_t part, for
+ * segments and telemetry); otherwise it's from the first.
+ * Requests of "delta" are answered with the frame delta-encoded (see delta.h) against the frame
+ * encoded last, "keyframe" with a keyframe to start from, and "rendered" with the frame rendered
+ * to colour (see render.h).
+ * Runs as an event loop: a request for a frame that hasn't arrived yet waits on an event fd along
+ * with the socket, rather than blocking the thread on one camera.
  */
 void* send_frames_to_socket(void* socket_path_ptr)
 {
@@ -108,50 +926,621 @@ void* send_frames_to_socket(void* socket_path_ptr)
       exit(1);
     }
 
-    // Declare a static frame
-    vospi_frame_t next_frame;
+    // Telemetry is packed into the buffer set aside at startup
+    unsigned char* message_buf = telemetry_buf;
 
-    // Declare a static buffer to copy frame data into for sending
-    unsigned char message_buf[VOSPI_SEGMENTS_PER_FRAME * VOSPI_PACKETS_PER_SEGMENT_NORMAL * VOSPI_PACKET_SYMBOLS];
+    // Ask to be notified of new frames and segments
+    set_up_frame_notifications();
+
+    // The request waiting for a new frame or segment, if any; a REP socket only ever has one
+    request_t request;
+    int pending = 0;
+    zmq_pollitem_t items[2];
 
     while (1) {
 
+      // Wait for a request, or for whatever the pending request is waiting for
+      items[0] = (zmq_pollitem_t){ .socket = responder, .events = pending ? 0 : ZMQ_POLLIN };
+      items[1] = (zmq_pollitem_t){ .fd = pending ? request_event_fd(&request) : -1, .events = ZMQ_POLLIN };
+      if (zmq_poll(items, pending ? 2 : 1, -1) < 0) {
+        continue;
+      }
+
+      if (pending) {
+        if (items[1].revents & ZMQ_POLLIN) {
+          uint64_t notifications;
+          if (read(items[1].fd, &notifications, sizeof(notifications)) < 0 && errno != EAGAIN) {
+            log_error("failed to read frame notification: %s", strerror(errno));
+          }
+          pending = !answer_request(responder, &request);
+        }
+        continue;
+      }
+
       // Receive requests
-      char req_buf[10];
-      zmq_recv(responder, req_buf, 10, 0);
+      char req_buf[32];
+      int req_size = zmq_recv(responder, req_buf, sizeof(req_buf) - 1, ZMQ_DONTWAIT);
+      if (req_size < 0) {
+        continue;
+      }
+      req_buf[req_size < sizeof(req_buf) - 1 ? req_size : sizeof(req_buf) - 1] = '\0';
+
+      // Find the camera the request is for
+      camera_t* camera = &cameras[0];
+      char* index = strchr(req_buf, ' ');
+      if (index != NULL) {
+        int camera_index = atoi(index + 1);
+        if (camera_index < 0 || camera_index >= camera_count) {
+          zmq_send(responder, NULL, 0, 0);
+          continue;
+        }
+        camera = &cameras[camera_index];
+      }
+
+      // Requests for telemetry are answered with the telemetry rows of the frame sent last, if any
+      if (strncmp(req_buf, "telemetry", 9) == 0) {
+        vospi_frame_t* frame = camera->socket_slot;
+        size_t size = pack_telemetry(frame, message_buf);
+        if (index != NULL) {
+          send_camera_tag(responder, camera, frame->sequence);
+        }
+        zmq_send(responder, message_buf, size, 0);
+        continue;
+      }
+
+      // Anything else is a request for a frame (delta-encoded, as a keyframe or rendered, if asked),
+      // or for a segment if they're being published
+      request.camera = camera;
+      request.tagged = index != NULL;
+      request.segment = publish_segments && strncmp(req_buf, "segment", 7) == 0;
+      request.encoded = strncmp(req_buf, "delta", 5) == 0 || strncmp(req_buf, "keyframe", 8) == 0;
+      request.rendered = strncmp(req_buf, "rendered", 8) == 0;
+      if (strncmp(req_buf, "keyframe", 8) == 0) {
+        delta_request_keyframe(&camera->encoder);
+      }
+      pending = !answer_request(responder, &request);
+    }
+}
+
+/**
+ * Send the topic, camera tag and payload of a publication.
+ */
+void publish(void* publisher, camera_t* camera, topic_t topic, uint32_t frame_sequence, void* data, size_t size)
+{
+  zmq_send(publisher, camera->topics[topic], strlen(camera->topics[topic]), ZMQ_SNDMORE);
+  send_camera_tag(publisher, camera, frame_sequence);
+  zmq_send(publisher, data, size, 0);
+}
+
+/**
+ * Keep count of the subscriptions matching each camera's topics, so that nothing is packed for
+ * topics nobody has subscribed to. Each message from an XPUB socket is a subscription (1) or an
+ * unsubscription (0) followed by a topic prefix, for every subscriber (ZMQ_XPUB_VERBOSER).
+ * Every new subscription to delta-encoded frames gets a keyframe to start from, so a subscriber
+ * that's lost its place can ask for one by subscribing again.
+ */
+void update_subscriptions(void* publisher)
+{
+  unsigned char message[64];
+  int size;
+
+  while ((size = zmq_recv(publisher, message, sizeof(message), ZMQ_DONTWAIT)) > 0) {
+    size_t prefix_length = (size < sizeof(message) ? size : sizeof(message)) - 1;
+    int change = message[0] == 1 ? 1 : -1;
+
+    for (int i = 0; i < camera_count; i ++) {
+      for (int topic = 0; topic < TOPIC_COUNT; topic ++) {
+        if (prefix_length <= strlen(cameras[i].topics[topic]) &&
+            memcmp(cameras[i].topics[topic], message + 1, prefix_length) == 0) {
+          cameras[i].subscriptions[topic] += change;
+          if (topic == TOPIC_DELTA && change > 0) {
+            delta_request_keyframe(&cameras[i].encoder);
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Publish whatever new frames (and their telemetry) and segments a camera has that anyone has
+ * subscribed to. Everything new is taken either way, so that the capture thread is never held up.
+ */
+void publish_new_frames(void* publisher, camera_t* camera, unsigned char* message_buf)
+{
+  vospi_frame_t* next_frame;
+  segment_message_t* next_segment;
+
+  while ((next_frame = fanout_try_acquire(camera->socket_consumer)) != NULL) {
+    camera->socket_slot = next_frame;
+    if (camera->subscriptions[TOPIC_FRAME] > 0 || camera->subscriptions[TOPIC_DELTA] > 0 ||
+        camera->subscriptions[TOPIC_RENDERED] > 0) {
+      describe_frame(camera, (frame_slot_t*)next_frame, camera->frame_pixels, &camera->metadata);
+    }
+    if (camera->subscriptions[TOPIC_FRAME] > 0) {
+      zmq_send(publisher, camera->topics[TOPIC_FRAME], strlen(camera->topics[TOPIC_FRAME]), ZMQ_SNDMORE);
+      send_frame_metadata(publisher, camera);
+      send_frame(publisher, camera);
+    }
+    if (camera->subscriptions[TOPIC_TELEMETRY] > 0) {
+      size_t size = pack_telemetry(next_frame, message_buf);
+      publish(publisher, camera, TOPIC_TELEMETRY, next_frame->sequence, message_buf, size);
+    }
+    if (camera->subscriptions[TOPIC_DELTA] > 0) {
+      size_t size = encode_frame(camera);
+      zmq_send(publisher, camera->topics[TOPIC_DELTA], strlen(camera->topics[TOPIC_DELTA]), ZMQ_SNDMORE);
+      send_frame_metadata(publisher, camera);
+      zmq_send(publisher, camera->delta_buf, size, 0);
+    }
+    if (camera->subscriptions[TOPIC_RENDERED] > 0) {
+      size_t size = render_camera_frame(camera);
+      zmq_send(publisher, camera->topics[TOPIC_RENDERED], strlen(camera->topics[TOPIC_RENDERED]), ZMQ_SNDMORE);
+      send_frame_metadata(publisher, camera);
+      zmq_send(publisher, camera->render_buf, size, 0);
+    }
+  }
+
+  while (publish_segments &&
+      (next_segment = ring_try_acquire(&camera->segment_ring, camera->socket_segment_slot)) != NULL) {
+    camera->socket_segment_slot = next_segment;
+    if (camera->subscriptions[TOPIC_SEGMENT] > 0) {
+      publish(
+        publisher, camera, TOPIC_SEGMENT, le32toh(next_segment->frame_sequence),
+        next_segment, sizeof(segment_message_t)
+      );
+    }
+  }
+}
+
+/**
+ * Push every camera's frames to any number of subscribers on the ZMQ socket as soon as they're captured.
+ * Each publication is a multipart message: the topic (I.e. "frame 1", "delta 1", "rendered 1", "segment 1"
+ * or "telemetry 1"),
+ * the frame's metadata (a frame_metadata_t, or a camera_tag_t for segments and telemetry) and the
+ * payload, so subscribers choose what they get by topic prefix.
+ * Subscribers that fall behind by more than the high-water mark miss publications rather than
+ * holding up the others.
+ */
+void* publish_frames_to_socket(void* socket_path_ptr)
+{
+    // Create the ZMQ context & socket
+    char* socket_path = (char*)socket_path_ptr;
+    void* context = zmq_ctx_new();
+    void* publisher = zmq_socket(context, ZMQ_XPUB);
+    int verbose = 1;
+    zmq_setsockopt(publisher, ZMQ_SNDHWM, &publish_hwm, sizeof(publish_hwm));
+    zmq_setsockopt(publisher, ZMQ_XPUB_VERBOSER, &verbose, sizeof(verbose));
+    if (zmq_bind(publisher, socket_path) != 0) {
+      log_fatal("Failed to bind to socket: %s", zmq_strerror(errno));
+      exit(1);
+    }
+
+    // Telemetry is packed into the buffer set aside at startup
+    unsigned char* message_buf = telemetry_buf;
+
+    // Ask to be notified of new frames and segments, and wait on those notifications along with the
+    // socket (for subscriptions)
+    set_up_frame_notifications();
+    zmq_pollitem_t items[1 + 2 * MAX_CAMERAS];
+    int item_count = 0;
+    items[item_count ++] = (zmq_pollitem_t){ .socket = publisher, .events = ZMQ_POLLIN };
+    for (int i = 0; i < camera_count; i ++) {
+      camera_t* camera = &cameras[i];
+      for (int topic = 0; topic < TOPIC_COUNT; topic ++) {
+        snprintf(camera->topics[topic], sizeof(camera->topics[topic]), "%s %d", topic_names[topic], i);
+      }
+      items[item_count ++] = (zmq_pollitem_t){
+        .fd = fanout_consumer_event_fd(camera->socket_consumer), .events = ZMQ_POLLIN
+      };
+      if (publish_segments) {
+        items[item_count ++] = (zmq_pollitem_t){ .fd = ring_event_fd(&camera->segment_ring), .events = ZMQ_POLLIN };
+      }
+    }
+
+    while (1) {
+
+      // Publish everything new, which also asks to be notified when there's more
+      for (int i = 0; i < camera_count; i ++) {
+        publish_new_frames(publisher, &cameras[i], message_buf);
+      }
+
+      if (zmq_poll(items, item_count, -1) < 0) {
+        continue;
+      }
+
+      if (items[0].revents & ZMQ_POLLIN) {
+        update_subscriptions(publisher);
+      }
+      for (int item = 1; item < item_count; item ++) {
+        uint64_t notifications;
+        if ((items[item].revents & ZMQ_POLLIN) &&
+            read(items[item].fd, &notifications, sizeof(notifications)) < 0 && errno != EAGAIN) {
+          log_error("failed to read frame notification: %s", strerror(errno));
+        }
+      }
+    }
+}
+
+/**
+ * Allocate from a JPEG compressor's region of the arena (see jpeg_arena_mgr_t).
+ * Exits through the compressor's error handler if the region's exhausted.
+ */
+static void* jpeg_arena_alloc(j_common_ptr cinfo, int pool_id, size_t size)
+{
+  jpeg_arena_mgr_t* memory = (jpeg_arena_mgr_t*)cinfo->mem;
+
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (size > memory->size - memory->permanent_used - memory->image_used) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, pool_id);
+  }
+  if (pool_id == JPOOL_PERMANENT) {
+    memory->permanent_used += size;
+    return memory->base + memory->permanent_used - size;
+  }
+  memory->image_used += size;
+  return memory->base + memory->size - memory->image_used;
+}
+
+/**
+ * Allocate a 2D array of samples for a JPEG compressor from its region of the arena, each row
+ * padded as libjpeg-turbo pads its own, since its SIMD routines may read past the end of a row.
+ */
+static JSAMPARRAY jpeg_arena_alloc_sarray(j_common_ptr cinfo, int pool_id, JDIMENSION samples_per_row, JDIMENSION rows)
+{
+  size_t row_size = (samples_per_row * sizeof(JSAMPLE) + 2 * ARENA_ALIGNMENT - 1) & ~(size_t)(2 * ARENA_ALIGNMENT - 1);
+  JSAMPARRAY array = jpeg_arena_alloc(cinfo, pool_id, rows * sizeof(JSAMPROW));
+  uint8_t* samples = jpeg_arena_alloc(cinfo, pool_id, rows * row_size);
+
+  for (JDIMENSION row = 0; row < rows; row ++) {
+    array[row] = (JSAMPROW)(samples + row * row_size);
+  }
+  return array;
+}
+
+/**
+ * Allocate a 2D array of coefficient blocks for a JPEG compressor from its region of the arena.
+ */
+static JBLOCKARRAY jpeg_arena_alloc_barray(j_common_ptr cinfo, int pool_id, JDIMENSION blocks_per_row, JDIMENSION rows)
+{
+  JBLOCKARRAY array = jpeg_arena_alloc(cinfo, pool_id, rows * sizeof(JBLOCKROW));
+  JBLOCKROW blocks = jpeg_arena_alloc(cinfo, pool_id, (size_t)rows * blocks_per_row * sizeof(JBLOCK));
+
+  for (JDIMENSION row = 0; row < rows; row ++) {
+    array[row] = blocks + row * blocks_per_row;
+  }
+  return array;
+}
+
+/**
+ * Refuse a JPEG compressor's request for a virtual array, which it only makes to optimise Huffman
+ * tables or write a progressive JPEG, neither of which is asked of it.
+ */
+static jvirt_sarray_ptr jpeg_arena_request_virt_sarray(
+  j_common_ptr cinfo, int pool_id, boolean pre_zero, JDIMENSION samples_per_row, JDIMENSION rows, JDIMENSION max_access
+)
+{
+  ERREXIT(cinfo, JERR_NOT_COMPILED);
+  return NULL;
+}
+
+/**
+ * Refuse a JPEG compressor's request for a virtual array of coefficient blocks (see above).
+ */
+static jvirt_barray_ptr jpeg_arena_request_virt_barray(
+  j_common_ptr cinfo, int pool_id, boolean pre_zero, JDIMENSION blocks_per_row, JDIMENSION rows, JDIMENSION max_access
+)
+{
+  ERREXIT(cinfo, JERR_NOT_COMPILED);
+  return NULL;
+}
+
+/**
+ * Set up the virtual arrays a JPEG compressor's asked for, of which there are none.
+ */
+static void jpeg_arena_realize_virt_arrays(j_common_ptr cinfo)
+{
+}
+
+/**
+ * Give back everything a JPEG compressor allocated from a pool, to be allocated again.
+ */
+static void jpeg_arena_free_pool(j_common_ptr cinfo, int pool_id)
+{
+  jpeg_arena_mgr_t* memory = (jpeg_arena_mgr_t*)cinfo->mem;
+
+  if (pool_id == JPOOL_PERMANENT) {
+    memory->permanent_used = 0;
+  } else {
+    memory->image_used = 0;
+  }
+}
+
+/**
+ * Give back everything a JPEG compressor allocated.
+ */
+static void jpeg_arena_self_destruct(j_common_ptr cinfo)
+{
+  jpeg_arena_free_pool(cinfo, JPOOL_IMAGE);
+  jpeg_arena_free_pool(cinfo, JPOOL_PERMANENT);
+}
+
+/**
+ * Set up a camera's JPEG compressor for its MJPEG streams, once at startup: with the defaults and
+ * quality every frame's compressed at, and then allocating from a region of the arena (taken with
+ * the given allocator) rather than the heap, so that compressing a frame never allocates.
+ */
+void init_compressor(camera_t* camera, void* (*allocate)(size_t))
+{
+  struct jpeg_compress_struct* compressor = &camera->http_compressor;
+  jpeg_arena_mgr_t* memory = &camera->http_jpeg_memory;
+
+  compressor->err = jpeg_std_error(&camera->http_jpeg_errors);
+  jpeg_create_compress(compressor);
+  compressor->image_width = camera->geometry->width;
+  compressor->image_height = camera->geometry->height;
+  compressor->input_components = 3;
+  compressor->in_color_space = JCS_RGB;
+  jpeg_set_defaults(compressor);
+  jpeg_set_quality(compressor, MJPEG_QUALITY, TRUE);
+
+  // The tables allocated so far stay with libjpeg's own memory manager, which is never destroyed;
+  // virtual arrays are never requested, so never accessed
+  memory->pub = (struct jpeg_memory_mgr){
+    .alloc_small = jpeg_arena_alloc,
+    .alloc_large = jpeg_arena_alloc,
+    .alloc_sarray = jpeg_arena_alloc_sarray,
+    .alloc_barray = jpeg_arena_alloc_barray,
+    .request_virt_sarray = jpeg_arena_request_virt_sarray,
+    .request_virt_barray = jpeg_arena_request_virt_barray,
+    .realize_virt_arrays = jpeg_arena_realize_virt_arrays,
+    .free_pool = jpeg_arena_free_pool,
+    .self_destruct = jpeg_arena_self_destruct,
+    .max_memory_to_use = compressor->mem->max_memory_to_use,
+    .max_alloc_chunk = compressor->mem->max_alloc_chunk
+  };
+  memory->base = allocate(MJPEG_POOL_SIZE);
+  memory->size = MJPEG_POOL_SIZE;
+  memory->permanent_used = 0;
+  memory->image_used = 0;
+  compressor->mem = &memory->pub;
+}
+
+/**
+ * Compress the frame the HTTP thread has just taken from a camera (and described) to a JPEG in the
+ * camera's JPEG buffer, rendered to RGB in the frame's own range.
+ * Returns the size of the JPEG.
+ */
+size_t compress_frame(camera_t* camera)
+{
+  struct jpeg_compress_struct* compressor = &camera->http_compressor;
+  unsigned char* out = camera->http_jpeg_buf;
+  unsigned long size = MJPEG_BUF_SIZE;
+  int width = camera->geometry->width, height = camera->geometry->height;
+
+  render_frame(
+    &mjpeg_renderer, camera->http_pixels, width, height, le16toh(camera->http_metadata.min),
+    le16toh(camera->http_metadata.max), camera->http_rgb_buf, 0
+  );
+
+  // The buffer's large enough for any JPEG, so libjpeg never has to allocate a larger one
+  jpeg_mem_dest(compressor, &out, &size);
+  jpeg_start_compress(compressor, TRUE);
+  while (compressor->next_scanline < height) {
+    JSAMPROW row = camera->http_rgb_buf + compressor->next_scanline * width * 3;
+    jpeg_write_scanlines(compressor, &row, 1);
+  }
+  jpeg_finish_compress(compressor);
+  return size;
+}
+
+/**
+ * Stream whatever new frames a camera has to the browsers following it: delta-encoded, after their
+ * metadata, to WebSocket clients, and as JPEGs to MJPEG clients. Everything new is taken either way,
+ * so that the capture thread is never held up, but nothing's prepared for streams nobody's following.
+ */
+void stream_new_frames(camera_t* camera)
+{
+  vospi_frame_t* next_frame;
+  int keyframe_wanted, unused;
+
+  while ((next_frame = fanout_try_acquire(camera->http_consumer)) != NULL) {
+    int websocket_clients = http_stream_clients(&http_server, HTTP_STREAM_WEBSOCKET, camera->index, &keyframe_wanted);
+    int mjpeg_clients = http_stream_clients(&http_server, HTTP_STREAM_MJPEG, camera->index, &unused);
+    if (websocket_clients == 0 && mjpeg_clients == 0) {
+      continue;
+    }
+    describe_frame(camera, (frame_slot_t*)next_frame, camera->http_pixels, &camera->http_metadata);
+
+    // Clients that have just joined or missed a frame wait for a keyframe, which they get next
+    if (websocket_clients > 0) {
+      if (keyframe_wanted) {
+        delta_request_keyframe(&camera->http_encoder);
+      }
+      size_t size = delta_encode(&camera->http_encoder, camera->http_pixels, next_frame->sequence, camera->http_delta_buf);
+      http_stream_frame(
+        &http_server, HTTP_STREAM_WEBSOCKET, camera->index, &camera->http_metadata, sizeof(frame_metadata_t),
+        camera->http_delta_buf, size, ((delta_header_t*)camera->http_delta_buf)->type == DELTA_KEYFRAME
+      );
+    }
+    if (mjpeg_clients > 0) {
+      size_t size = compress_frame(camera);
+      http_stream_frame(&http_server, HTTP_STREAM_MJPEG, camera->index, NULL, 0, camera->http_jpeg_buf, size, 1);
+    }
+  }
+}
+
+/**
+ * Serve the web frontend, and stream every camera's frames straight to browsers, over HTTP (see
+ * http.h): to WebSocket clients of /stream/<camera> and MJPEG clients of /mjpeg/<camera>.
+ * Runs as an event loop on the server's fd and each camera's event fd, so that a slow browser only
+ * ever misses frames of its own.
+ */
+void* serve_http(void* unused)
+{
+    struct pollfd fds[1 + MAX_CAMERAS];
+    int fd_count = 0;
+
+    // Wait on the server along with notifications of each camera's new frames
+    fds[fd_count ++] = (struct pollfd){ .fd = http_server_fd(&http_server), .events = POLLIN };
+    for (int i = 0; i < camera_count; i ++) {
+      int event_fd = fanout_consumer_event_fd(cameras[i].http_consumer);
+      if (event_fd == -1) {
+        log_fatal("Failed to set up frame notifications");
+        exit(1);
+      }
+      fds[fd_count ++] = (struct pollfd){ .fd = event_fd, .events = POLLIN };
+    }
+
+    while (1) {
+
+      // Stream everything new, which also asks to be notified when there's more
+      for (int i = 0; i < camera_count; i ++) {
+        stream_new_frames(&cameras[i]);
+      }
 
-      // Wait if there are no new frames to transmit
-      sem_wait(&count_sem);
+      if (poll(fds, fd_count, -1) < 0) {
+        continue;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        http_server_handle(&http_server);
+      }
+      for (int fd = 1; fd < fd_count; fd ++) {
+        uint64_t notifications;
+        if ((fds[fd].revents & POLLIN) &&
+            read(fds[fd].fd, &notifications, sizeof(notifications)) < 0 && errno != EAGAIN) {
+          log_error("failed to read frame notification: %s", strerror(errno));
+        }
+      }
+    }
+}
 
-      // Lock the data structure to prevent new frames being added while we're reading this one
-      pthread_mutex_lock(&lock);
+/**
+ * Publish every camera's frames to its shared-memory ring, unpacking them there, so that the
+ * capture threads never wait on it (it takes only the latest frames, as readers skip to those
+ * anyway).
+ * Runs as an event loop on each camera's event fd, closing a camera's ring once it's finished and
+ * every frame it captured has been published, and returns once they're all closed.
+ */
+void* publish_frames_to_shm(void* unused)
+{
+    struct pollfd fds[MAX_CAMERAS];
+    int open_rings = camera_count;
 
-      // Copy the next frame out ready to transmit
-      memcpy(&next_frame, frame_buf[reader], sizeof(vospi_frame_t));
+    for (int i = 0; i < camera_count; i ++) {
+      fds[i] = (struct pollfd){ .fd = cameras[i].shm_event_fd, .events = POLLIN };
+    }
 
-      // Move the reader ahead
-      reader = (reader + 1) & (FRAME_BUF_SIZE - 1);
+    while (open_rings > 0) {
+      int failed = __atomic_load_n(&capture_failed, __ATOMIC_ACQUIRE);
 
-      // Unlock data structure
-      pthread_mutex_unlock(&lock);
+      // Publish everything new, which also asks to be notified when there's more
+      for (int i = 0; i < camera_count; i ++) {
+        camera_t* camera = &cameras[i];
+        vospi_frame_t* next_frame;
+        if (fds[i].fd < 0) {
+          continue;
+        }
+        int finished = __atomic_load_n(&camera->finished, __ATOMIC_ACQUIRE);
+        while ((next_frame = fanout_try_acquire(camera->shm_consumer)) != NULL) {
+          publish_frame_to_shm(camera, (frame_slot_t*)next_frame);
+        }
+        if (finished || failed) {
+          shm_publisher_close(&camera->shm);
+          fds[i].fd = -1;
+          open_rings --;
+        }
+      }
 
-      // Prepare the message buffer
-      void* message_buf_pos = &message_buf;
-      for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-        for (int pkt = 0; pkt < VOSPI_PACKETS_PER_SEGMENT_NORMAL; pkt ++) {
-          // Copy each packet into the message buffer
-          memcpy(
-            message_buf_pos,
-            next_frame.segments[seg].packets[pkt].symbols,
-            VOSPI_PACKET_SYMBOLS
-          );
-          message_buf_pos += VOSPI_PACKET_SYMBOLS;
+      if (open_rings == 0 || poll(fds, camera_count, -1) < 0) {
+        continue;
+      }
+      for (int i = 0; i < camera_count; i ++) {
+        eventfd_t notifications;
+        if ((fds[i].revents & POLLIN) && eventfd_read(fds[i].fd, &notifications) < 0 && errno != EAGAIN) {
+          log_error("failed to read frame notification: %s", strerror(errno));
         }
       }
+    }
+
+    return NULL;
+}
+
+/**
+ * Identify and configure the camera over CCI.
+ * The camera's geometry is taken from its part number unless one was given explicitly, and the
+ * camera's GPIO3 is switched to VSYNC output if capture is going to wait on it.
+ * Returns 1 on success or -1 on failure.
+ */
+int configure_camera(camera_t* camera)
+{
+  char part_number[CCI_PART_NUMBER_LENGTH + 1];
+  int i2c_fd;
+
+  log_info("opening CCI I2C device... %s", camera->i2c_path);
+  if ((i2c_fd = open(camera->i2c_path, O_RDWR)) < 0) {
+    log_error("I2C: failed to open device - check permissions & I2C enabled");
+    return -1;
+  }
+
+  if (cci_init(i2c_fd) == -1) {
+    close(i2c_fd);
+    return -1;
+  }
+
+  if (camera->vsync_chip_path != NULL) {
+    log_info("enabling VSYNC output on the camera's GPIO3");
+    cci_set_gpio_mode(i2c_fd, CCI_GPIO_MODE_VSYNC);
+  }
+
+  if (geometry_given) {
+    close(i2c_fd);
+    return 1;
+  }
 
-      // Send the message
-      zmq_send(responder, message_buf, sizeof(message_buf), 0);
+  cci_get_part_number(i2c_fd, part_number);
+  close(i2c_fd);
+
+  for (int i = 0; i < sizeof(camera_models) / sizeof(camera_models[0]); i ++) {
+    if (strncmp(part_number, camera_models[i].part_number, strlen(camera_models[i].part_number)) == 0) {
+      log_info("%s part number %s", camera->name, part_number);
+      camera->geometry = vospi_geometry_for_model(camera_models[i].lepton_version);
+      return 1;
     }
+  }
+
+  log_error("unrecognised camera part number: %s", part_number);
+  return -1;
+}
+
+/**
+ * Allocate memory from the arena, which was sized for everything needed at startup.
+ */
+void* allocate_from_arena(size_t size)
+{
+  void* memory = arena_alloc(&arena, size);
+
+  if (memory == NULL) {
+    log_fatal("Can't start - failed to allocate %zu bytes from the arena", size);
+    exit(-1);
+  }
+  return memory;
+}
+
+/**
+ * Allocate a frame slot.
+ */
+void* allocate_slot()
+{
+  return allocate_from_arena(sizeof(frame_slot_t));
+}
+
+/**
+ * Allocate a segment message slot.
+ */
+void* allocate_segment_slot()
+{
+  return allocate_from_arena(sizeof(segment_message_t));
 }
 
 /**
@@ -159,42 +1548,380 @@ void* send_frames_to_socket(void* socket_path_ptr)
  */
 int main(int argc, char *argv[])
 {
-  pthread_t get_frames_thread, send_frames_to_socket_thread;
+  pthread_t socket_thread, http_thread;
+  char* socket_path = ZMQ_DEFAULT_SOCKET_SPEC;
+  int i2c_count = 0, vsync_count = 0, cpu_count = 0;
 
   // Set the log level
   log_set_level(LOG_INFO);
 
-  // Setup semaphores
-  sem_init(&count_sem, 0, 0);
+  // Cameras are configured in the order they're given, and aren't pinned to a CPU unless asked
+  memset(cameras, 0, sizeof(cameras));
+  for (int i = 0; i < MAX_CAMERAS; i ++) {
+    cameras[i].cpu = -1;
+  }
+
+  // Parse options
+  static struct option long_options[] = {
+    {"crc", no_argument, NULL, 'c'},
+    {"schedule", no_argument, NULL, 's'},
+    {"lepton", required_argument, NULL, 'l'},
+    {"i2c", required_argument, NULL, 'i'},
+    {"vsync", required_argument, NULL, 'v'},
+    {"segments", no_argument, NULL, 'g'},
+    {"realtime", no_argument, NULL, 'r'},
+    {"priority", required_argument, NULL, 'p'},
+    {"cpu", required_argument, NULL, 'u'},
+    {"record", required_argument, NULL, 'o'},
+    {"flat-out", no_argument, NULL, 'f'},
+    {"policy", required_argument, NULL, 'y'},
+    {"request-reply", no_argument, NULL, 'q'},
+    {"hwm", required_argument, NULL, 'w'},
+    {"keyframe-interval", required_argument, NULL, 'k'},
+    {"shm", required_argument, NULL, 'm'},
+    {"render", required_argument, NULL, 'e'},
+    {"palette", required_argument, NULL, 'a'},
+    {"http", required_argument, NULL, 'h'},
+    {"http-root", required_argument, NULL, 't'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "csgl:i:v:rp:u:o:fy:qw:k:m:e:a:h:t:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'c':
+        verify_crc = 1;
+        break;
+      case 's':
+        schedule_segments = 1;
+        break;
+      case 'l':
+        if ((geometry = vospi_geometry_for_model(atoi(optarg))) == NULL) {
+          log_error("Can't start - unsupported Lepton version: %s", optarg);
+          exit(-1);
+        }
+        geometry_given = 1;
+        break;
+      case 'i':
+        if (i2c_count == MAX_CAMERAS) {
+          log_error("Can't start - at most %d cameras are supported", MAX_CAMERAS);
+          exit(-1);
+        }
+        cameras[i2c_count ++].i2c_path = optarg;
+        break;
+      case 'v':
+        if (vsync_count == MAX_CAMERAS) {
+          log_error("Can't start - at most %d cameras are supported", MAX_CAMERAS);
+          exit(-1);
+        }
+        cameras[vsync_count].vsync_chip_path = optarg;
+        char* line = strrchr(optarg, ':');
+        if (line == NULL) {
+          log_error("Can't start - VSYNC must be given as <gpiochip path>:<line>");
+          exit(-1);
+        }
+        *line = '\0';
+        cameras[vsync_count ++].vsync_line = atoi(line + 1);
+        break;
+      case 'g':
+        publish_segments = 1;
+        break;
+      case 'r':
+        realtime = 1;
+        break;
+      case 'p':
+        realtime_priority = atoi(optarg);
+        break;
+      case 'u':
+        // One CPU per camera, separated by commas
+        for (char* cpu = strtok(optarg, ","); cpu != NULL && cpu_count < MAX_CAMERAS; cpu = strtok(NULL, ",")) {
+          cameras[cpu_count ++].cpu = atoi(cpu);
+        }
+        break;
+      case 'o':
+        record_path = optarg;
+        break;
+      case 'f':
+        replay_flat_out = 1;
+        break;
+      case 'y':
+        if (fanout_policy_for_name(optarg, &frame_policy) == -1) {
+          log_error("Can't start - unknown frame buffer policy: %s", optarg);
+          exit(-1);
+        }
+        break;
+      case 'q':
+        request_reply = 1;
+        break;
+      case 'w':
+        if ((publish_hwm = atoi(optarg)) < 0) {
+          log_error("Can't start - the high-water mark can't be negative");
+          exit(-1);
+        }
+        break;
+      case 'k':
+        keyframe_interval = atoi(optarg);
+        break;
+      case 'm':
+        shm_name = optarg;
+        break;
+      case 'e':
+        if (render_format_for_name(optarg, &render_format) == -1) {
+          log_error("Can't start - unknown render format: %s", optarg);
+          exit(-1);
+        }
+        break;
+      case 'a':
+        if (render_palette_for_name(optarg, &render_palette) == -1) {
+          log_error("Can't start - unknown palette: %s", optarg);
+          exit(-1);
+        }
+        break;
+      case 'h':
+        if ((http_port = atoi(optarg)) <= 0 || http_port > 65535) {
+          log_error("Can't start - invalid HTTP port: %s", optarg);
+          exit(-1);
+        }
+        break;
+      case 't':
+        http_root = optarg;
+        break;
+      default:
+        log_error(
+          "Usage: %s [--crc] [--schedule] [--segments] [--vsync <gpiochip path>:<line>]... "
+          "[--realtime [--priority <n>] [--cpu <n>[,<n>...]]] [--record <path>] [--flat-out] "
+          "[--policy <latest|in-order|block>] [--request-reply | --hwm <n>] [--keyframe-interval <n>] "
+          "[--shm <name>] [--render <rgb|bgr|rgba|bgra|rgb565>] [--palette <fusion|grey>] "
+          "[--http <port> [--http-root <dir>]] "
+          "[--lepton <2|3>] [--i2c <i2c path>]... <spidev path>... [socket spec]",
+          argv[0]
+        );
+        exit(-1);
+    }
+  }
+
+  // The remaining arguments are the cameras' spidev paths, followed by the socket spec if given
+  for (int arg = optind; arg < argc; arg ++) {
+    if (strstr(argv[arg], "://") != NULL) {
+      socket_path = argv[arg];
+    } else if (camera_count == MAX_CAMERAS) {
+      log_error("Can't start - at most %d cameras are supported", MAX_CAMERAS);
+      exit(-1);
+    } else {
+      cameras[camera_count ++].spidev_path = argv[arg];
+    }
+  }
 
   // Check we have enough arguments to work
-  if (argc < 2) {
+  if (camera_count < 1) {
     log_error("Can't start - SPI device file path must be specified.");
     exit(-1);
   }
+  if (i2c_count > camera_count || vsync_count > camera_count) {
+    log_error("Can't start - more CCI or VSYNC devices given than cameras.");
+    exit(-1);
+  }
+
+  // Stop cleanly when interrupted, so that recordings are complete
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  // Browsers that disconnect mid-frame are noticed when sending to them fails, not by a signal
+  if (http_port > 0) {
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  for (int i = 0; i < camera_count; i ++) {
+    camera_t* camera = &cameras[i];
+    camera->index = i;
+    camera->geometry = geometry;
+    snprintf(camera->name, sizeof(camera->name), "camera %d", i);
+
+    // Identify and configure the camera over CCI if we can
+    if (camera->i2c_path != NULL && configure_camera(camera) == -1) {
+      log_error("Can't start - couldn't configure %s over CCI.", camera->name);
+      exit(-1);
+    }
+    if (camera->vsync_chip_path != NULL && camera->i2c_path == NULL) {
+      log_warn("no CCI device given - assuming %s's GPIO3 is already in VSYNC mode", camera->name);
+    }
+    log_info(
+      "%s (%s) using %s frame geometry (%dx%d)", camera->name, camera->spidev_path,
+      camera->geometry->name, camera->geometry->width, camera->geometry->height
+    );
+    open_device(camera);
+  }
+
+  // Lock all current and future memory so that capture never waits on a page fault
+  if (realtime && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    log_warn("failed to lock memory - check RLIMIT_MEMLOCK (%s)", strerror(errno));
+  }
 
-  // Allocate space to receive the segments in the circular buffer
+  // Set up an arena with room for every camera's slots and the telemetry buffer, all prefaulted and
+  // locked, so that nothing is allocated once capture starts
   log_info("preallocating space for segments...");
-  for (int frame = 0; frame < FRAME_BUF_SIZE; frame ++) {
-    frame_buf[frame] = malloc(sizeof(vospi_frame_t));
-    for (int seg = 0; seg < VOSPI_SEGMENTS_PER_FRAME; seg ++) {
-      frame_buf[frame]->segments[seg].packet_count = VOSPI_PACKETS_PER_SEGMENT_NORMAL;
+  size_t arena_size = arena_size_for(sizeof(frame_slot_t), camera_count * FRAME_SLOTS_PER_CAMERA) +
+    arena_size_for(TELEMETRY_BUF_SIZE, 1) + arena_size_for(DELTA_MAX_PIXELS * sizeof(uint16_t), camera_count * 3) +
+    arena_size_for(DELTA_MAX_ENCODED_SIZE(160, 120), camera_count) +
+    arena_size_for(UNPACK_MAX_PIXELS * RENDER_MAX_BYTES_PER_PIXEL, camera_count);
+  if (publish_segments) {
+    arena_size += arena_size_for(sizeof(segment_message_t), camera_count * (FRAME_BUF_SIZE + 2));
+  }
+  if (http_port > 0) {
+    arena_size += arena_size_for(HTTP_QUEUE_SIZE, HTTP_MAX_CLIENTS) +
+      arena_size_for(DELTA_MAX_PIXELS * sizeof(uint16_t), camera_count * 3) +
+      arena_size_for(DELTA_MAX_ENCODED_SIZE(160, 120), camera_count) +
+      arena_size_for(UNPACK_MAX_PIXELS * 3, camera_count) + arena_size_for(MJPEG_BUF_SIZE, camera_count) +
+      arena_size_for(MJPEG_POOL_SIZE, camera_count);
+  }
+  if (arena_init(&arena, arena_size) == -1) {
+    log_fatal("Can't start - failed to set up the arena");
+    exit(-1);
+  }
+  telemetry_buf = allocate_from_arena(TELEMETRY_BUF_SIZE);
+  render_init(&renderer, render_format, render_palette, RENDER_DEFAULT_MIN_RANGE);
+  // Segments go to the socket thread alone, through a ring with the nearest equivalent policy
+  ring_policy_t segment_policy = frame_policy == FANOUT_LATEST ? RING_LATEST :
+    frame_policy == FANOUT_BLOCK ? RING_BLOCK : RING_DROP_NEWEST;
+  for (int i = 0; i < camera_count; i ++) {
+    camera_t* camera = &cameras[i];
+    fanout_init(&camera->frames, FRAME_BUF_SIZE, MAX_FRAME_CONSUMERS, MAX_FRAMES_SENDING, allocate_slot);
+    camera->socket_consumer = fanout_add_consumer(&camera->frames, frame_policy);
+    camera->socket_slot = allocate_slot();
+    camera->frame_pixels = allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t));
+    camera->delta_buf = allocate_from_arena(DELTA_MAX_ENCODED_SIZE(160, 120));
+    camera->render_buf = allocate_from_arena(UNPACK_MAX_PIXELS * RENDER_MAX_BYTES_PER_PIXEL);
+    delta_encoder_init(
+      &camera->encoder, camera->geometry->width, camera->geometry->height, keyframe_interval,
+      allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t)),
+      allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t))
+    );
+    if (publish_segments) {
+      ring_init(&camera->segment_ring, FRAME_BUF_SIZE, segment_policy, allocate_segment_slot);
+      camera->capture_segment_slot = allocate_segment_slot();
+      camera->socket_segment_slot = allocate_segment_slot();
+    }
+    if (shm_name != NULL) {
+      camera->shm_consumer = fanout_add_consumer(&camera->frames, FANOUT_LATEST);
+      if ((camera->shm_event_fd = fanout_consumer_event_fd(camera->shm_consumer)) == -1) {
+        log_fatal("Can't start - failed to set up frame notifications");
+        exit(-1);
+      }
+    }
+    if (http_port > 0) {
+      camera->http_consumer = fanout_add_consumer(&camera->frames, FANOUT_LATEST);
+      camera->http_pixels = allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t));
+      camera->http_delta_buf = allocate_from_arena(DELTA_MAX_ENCODED_SIZE(160, 120));
+      camera->http_rgb_buf = allocate_from_arena(UNPACK_MAX_PIXELS * 3);
+      camera->http_jpeg_buf = allocate_from_arena(MJPEG_BUF_SIZE);
+      init_compressor(camera, allocate_from_arena);
+      delta_encoder_init(
+        &camera->http_encoder, camera->geometry->width, camera->geometry->height, keyframe_interval,
+        allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t)),
+        allocate_from_arena(DELTA_MAX_PIXELS * sizeof(uint16_t))
+      );
     }
   }
 
-  log_info("Creating get_frames_from_device thread");
-  if (pthread_create(&get_frames_thread, NULL, get_frames_from_device, argv[1])) {
-    log_fatal("Error creating get_frames_from_device thread");
-    return 1;
+  // The HTTP server's clients' queues come from the arena too
+  if (http_port > 0) {
+    render_init(&mjpeg_renderer, RENDER_RGB, render_palette, RENDER_DEFAULT_MIN_RANGE);
+    if (http_server_init(&http_server, http_port, http_root, camera_count, allocate_from_arena) == -1) {
+      log_fatal("Can't start - failed to set up the HTTP server");
+      exit(-1);
+    }
   }
 
-  log_info("Creating send_frames_to_socket thread");
-  char* socket_path = argc > 2 ? argv[2] : ZMQ_DEFAULT_SOCKET_SPEC;
-  if (pthread_create(&send_frames_to_socket_thread, NULL, send_frames_to_socket, socket_path)) {
-    log_fatal("Error creating send_frames_to_socket thread");
-    return 1;
+  arena_seal(&arena);
+
+  // Frames are also published to shared memory for local readers, if asked, to a ring per camera if
+  // there's more than one
+  if (shm_name != NULL) {
+    for (int i = 0; i < camera_count; i ++) {
+      char name[64];
+      if (camera_count > 1) {
+        snprintf(name, sizeof(name), "%s.%d", shm_name, i);
+      } else {
+        snprintf(name, sizeof(name), "%s", shm_name);
+      }
+      if (shm_publisher_init(&cameras[i].shm, name, SHM_SLOTS_PER_CAMERA, UNPACK_MAX_PIXELS * sizeof(uint16_t)) == -1) {
+        log_fatal("Can't start - failed to set up shared memory");
+        exit(-1);
+      }
+    }
+    log_info("Creating publish_frames_to_shm thread");
+    if (pthread_create(&shm_thread, NULL, publish_frames_to_shm, NULL)) {
+      log_fatal("Error creating publish_frames_to_shm thread");
+      return 1;
+    }
   }
 
-  pthread_join(get_frames_thread, NULL);
-  pthread_join(send_frames_to_socket_thread, NULL);
+  // Each camera gets its own capture thread. In realtime mode they run under SCHED_FIFO, each
+  // pinned to a (preferably isolated) CPU of its own, counting down from the last
+  long cpus_online = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < camera_count; i ++) {
+    camera_t* camera = &cameras[i];
+    pthread_attr_t get_frames_attr;
+    pthread_attr_init(&get_frames_attr);
+
+    if (realtime) {
+      struct sched_param param = { .sched_priority = realtime_priority };
+      if (camera->cpu < 0) {
+        camera->cpu = ((cpus_online - 1 - i) % cpus_online + cpus_online) % cpus_online;
+      }
+      pthread_attr_setinheritsched(&get_frames_attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy(&get_frames_attr, SCHED_FIFO);
+      pthread_attr_setschedparam(&get_frames_attr, &param);
+      pthread_attr_setstacksize(&get_frames_attr, REALTIME_STACK_SIZE);
+      log_info(
+        "%s capture thread will run under SCHED_FIFO (priority %d) on CPU %d",
+        camera->name, realtime_priority, camera->cpu
+      );
+    }
+    if (camera->cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(camera->cpu, &cpus);
+      pthread_attr_setaffinity_np(&get_frames_attr, sizeof(cpus), &cpus);
+    }
+
+    log_info("Creating get_frames_from_device thread for %s", camera->name);
+    int error = pthread_create(&camera->thread, &get_frames_attr, get_frames_from_device, camera);
+    pthread_attr_destroy(&get_frames_attr);
+    if (error) {
+      log_fatal(
+        "Error creating get_frames_from_device thread: %s%s", strerror(error),
+        error == EPERM ? " - realtime mode needs CAP_SYS_NICE or an rtprio limit" : ""
+      );
+      return 1;
+    }
+  }
+
+  // Frames are pushed to subscribers unless they're to be served in reply to requests
+  if (request_reply) {
+    log_info("Creating send_frames_to_socket thread");
+    if (pthread_create(&socket_thread, NULL, send_frames_to_socket, socket_path)) {
+      log_fatal("Error creating send_frames_to_socket thread");
+      return 1;
+    }
+  } else {
+    log_info("Creating publish_frames_to_socket thread");
+    if (pthread_create(&socket_thread, NULL, publish_frames_to_socket, socket_path)) {
+      log_fatal("Error creating publish_frames_to_socket thread");
+      return 1;
+    }
+  }
+
+  // Browsers are served by a thread of their own, if asked
+  if (http_port > 0) {
+    log_info("Creating serve_http thread");
+    if (pthread_create(&http_thread, NULL, serve_http, NULL)) {
+      log_fatal("Error creating serve_http thread");
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < camera_count; i ++) {
+    pthread_join(cameras[i].thread, NULL);
+  }
+  pthread_join(socket_thread, NULL);
 }
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <stdatomic.h>
+
+// The most frames of a call stack looked at (or printed) for each allocation
+#define MAX_STACK_FRAMES 24
+
+// How many allocations are printed (with their call stacks) before the rest are just counted
+#define MAX_REPORTED 10
+
+// glibc's own allocator, which everything is passed on to
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* memory, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+// Set once the first thread is started, which leptonic only does once startup is complete (the
+// arena sealed); only allocations after that are counted
+static atomic_int armed = 0;
+
+// The allocations counted: those made by libzmq (somewhere in their call stack), which are known
+// about, and everything else
+static atomic_ulong zmq_allocations = 0;
+static atomic_ulong allocations = 0;
+
+// Whether the thread is inside the counter (or pthread_create()), where allocations aren't counted
+static __thread int inside = 0;
+
+/**
+ * Find out whether an address is in libzmq.
+ */
+static int in_libzmq(void* address)
+{
+  Dl_info info;
+  return dladdr(address, &info) != 0 && info.dli_fname != NULL && strstr(info.dli_fname, "libzmq") != NULL;
+}
+
+/**
+ * Count an allocation of the given size if it was made after startup, printing the call stacks of
+ * the first few that weren't made by libzmq.
+ */
+static void count_allocation(size_t size)
+{
+  void* stack[MAX_STACK_FRAMES];
+  int depth;
+
+  if (!atomic_load_explicit(&armed, memory_order_relaxed) || inside) {
+    return;
+  }
+  inside = 1;
+
+  depth = backtrace(stack, MAX_STACK_FRAMES);
+  for (int i = 1; i < depth; i ++) {
+    if (in_libzmq(stack[i])) {
+      atomic_fetch_add(&zmq_allocations, 1);
+      inside = 0;
+      return;
+    }
+  }
+  if (atomic_fetch_add(&allocations, 1) < MAX_REPORTED) {
+    fprintf(stderr, "alloc_counter: %zu bytes allocated after startup by:\n", size);
+    backtrace_symbols_fd(stack + 1, depth - 1, STDERR_FILENO);
+  }
+
+  inside = 0;
+}
+
+void* malloc(size_t size)
+{
+  count_allocation(size);
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+  count_allocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* memory, size_t size)
+{
+  count_allocation(size);
+  return __libc_realloc(memory, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+  count_allocation(size);
+  return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  count_allocation(size);
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** memory, size_t alignment, size_t size)
+{
+  count_allocation(size);
+  if ((*memory = __libc_memalign(alignment, size)) == NULL) {
+    return ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * Start a thread as usual, counting allocations from then on, though not pthread_create()'s own.
+ */
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start)(void*), void* arg)
+{
+  static int (*real_pthread_create)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+  int result;
+
+  inside = 1;
+  if (real_pthread_create == NULL) {
+    real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+  }
+  result = real_pthread_create(thread, attr, start, arg);
+  inside = 0;
+
+  atomic_store(&armed, 1);
+  return result;
+}
+
+/**
+ * Load what backtrace() needs up front, so that it doesn't allocate once counting.
+ */
+__attribute__((constructor)) static void start_counting(void)
+{
+  void* stack[1];
+  backtrace(stack, 1);
+}
+
+/**
+ * Report the allocations counted once the process exits, failing it if anything but libzmq
+ * allocated after startup.
+ */
+__attribute__((destructor)) static void report_allocations(void)
+{
+  unsigned long counted = atomic_load(&allocations);
+
+  fprintf(
+    stderr, "alloc_counter: %lu allocations after startup, and %lu more by libzmq\n",
+    counted, atomic_load(&zmq_allocations)
+  );
+  if (counted > 0) {
+    _exit(1);
+  }
+}
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Replay a recording through leptonic with every output in use (segments, shared memory, the web
+# server and a ZMQ subscriber to everything), counting heap allocations with alloc_counter.so from
+# the moment startup is complete. Fails if anything but libzmq allocated.
+#
+# Usage: test/check_alloc.sh <recording> [seconds]
+
+RECORDING=$1
+SECONDS_RUN=${2:-10}
+SOCKET=tcp://127.0.0.1:5599
+HTTP_PORT=8599
+SHM_NAME=/leptonic-check-alloc
+LOG=bin/test/check_alloc.log
+
+if [ ! -f "$RECORDING" ]; then
+  echo "Usage: $0 <recording> [seconds]" >&2
+  exit 2
+fi
+
+LD_PRELOAD=bin/test/alloc_counter.so bin/leptonic --segments --shm "$SHM_NAME" --http "$HTTP_PORT" \
+  "$RECORDING" "$SOCKET" > "$LOG" 2>&1 &
+LEPTONIC=$!
+sleep 1
+
+# Follow every stream for as long as asked, then stop leptonic
+bin/test/subscriber "$SOCKET" "$SECONDS_RUN" &
+bin/examples/shm_reader "$SHM_NAME" 1000000 > /dev/null 2>&1 &
+SHM_READER=$!
+bin/examples/web_load_test 127.0.0.1 "$HTTP_PORT" /stream/0 4 "$SECONDS_RUN" > /dev/null 2>&1 &
+bin/examples/web_load_test 127.0.0.1 "$HTTP_PORT" /mjpeg/0 4 "$SECONDS_RUN" > /dev/null 2>&1 &
+sleep "$SECONDS_RUN"
+kill -INT "$LEPTONIC"
+wait "$LEPTONIC"
+STATUS=$?
+kill "$SHM_READER" 2> /dev/null
+wait
+
+grep -A 24 "alloc_counter" "$LOG" | grep -v "^--"
+if [ "$STATUS" -ne 0 ]; then
+  echo "FAILED - see $LOG" >&2
+  exit 1
+fi
+echo "passed"
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zmq.h>
+
+/**
+ * Main entry point for the subscriber.
+ *
+ * Subscribes to everything leptonic publishes (frames, segments, telemetry, delta-encoded and
+ * rendered frames) for a number of seconds, so that all of it is packed and sent while allocations
+ * are counted, and reports how many messages it received.
+ */
+int main(int argc, char *argv[])
+{
+  static char buf[256 * 1024];
+  unsigned long messages = 0;
+  int timeout_ms = 100;
+
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <socket spec> <seconds>\n", argv[0]);
+    exit(-1);
+  }
+
+  void* context = zmq_ctx_new();
+  void* subscriber = zmq_socket(context, ZMQ_SUB);
+  zmq_setsockopt(subscriber, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+  zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, "", 0);
+  if (zmq_connect(subscriber, argv[1]) == -1) {
+    fprintf(stderr, "failed to connect to %s - %s\n", argv[1], zmq_strerror(zmq_errno()));
+    exit(-1);
+  }
+
+  time_t end = time(NULL) + atoi(argv[2]);
+  while (time(NULL) < end) {
+    if (zmq_recv(subscriber, buf, sizeof(buf), 0) >= 0) {
+      messages ++;
+    }
+  }
+  printf("subscriber: %lu message parts received\n", messages);
+
+  zmq_close(subscriber);
+  zmq_ctx_destroy(context);
+  return messages > 0 ? 0 : 1;
+}